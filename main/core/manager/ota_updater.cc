@@ -0,0 +1,175 @@
+#include "ota_updater.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_timer.h"
+#include "event/global_event_bus.h"
+#include "led/led_indicator_wrapper.h"
+#include "mbedtls/sha256.h"
+#include "util/http_download.h"
+
+static const char* TAG = "ota_updater";
+
+#define SHA256_SIZE 32
+
+namespace esp {
+
+static bool ParseSha256(const std::string& hex, uint8_t* digest) {
+  if (hex.size() != SHA256_SIZE * 2) {
+    return false;
+  }
+  for (size_t i = 0; i < SHA256_SIZE; ++i) {
+    unsigned value = 0;
+    if (sscanf(hex.c_str() + i * 2, "%2x", &value) != 1) {
+      return false;
+    }
+    digest[i] = value;
+  }
+  return true;
+}
+
+OtaProgressEvent::OtaProgressEvent(State state, size_t written, size_t total)
+    : state_(state), written_(written), total_(total) {}
+
+char* OtaProgressEvent::Name() { return (char*)OTA_PROGRESS_EVENT; }
+
+int8_t OtaProgressEvent::Priority() { return 0; }
+
+OtaUpdater::OtaUpdater(HttpDownload* download, LedIndicator* indicator,
+                       Config config)
+    : download_(download), indicator_(indicator), config_(config) {}
+
+void OtaUpdater::Publish(OtaProgressEvent::State state, size_t written,
+                         size_t total) {
+  auto event = new OtaProgressEvent(state, written, total);
+  if (!GlobalEventBus::Instance()->Publish(event)) {
+    delete event;
+  }
+}
+
+bool OtaUpdater::Update(const char* url, const std::string& sha256_hex) {
+  if (!download_ || !url || config_.block_size == 0) {
+    return false;
+  }
+  uint8_t expected[SHA256_SIZE];
+  if (!sha256_hex.empty() && !ParseSha256(sha256_hex, expected)) {
+    ESP_LOGE(TAG, "invalid sha-256:%s", sha256_hex.c_str());
+    return false;
+  }
+  auto partition = esp_ota_get_next_update_partition(nullptr);
+  if (!partition) {
+    ESP_LOGE(TAG, "no ota partition");
+    return false;
+  }
+  stats_ = Stats();
+  auto start_us = esp_timer_get_time();
+
+  // sequential writes erase sector by sector while the image streams in,
+  // instead of the whole partition before the download starts
+  esp_ota_handle_t handle = 0;
+  auto err = esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &handle);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "ota begin failed:%s", esp_err_to_name(err));
+    return false;
+  }
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts_ret(&sha, 0);
+  if (indicator_) {
+    indicator_->Start(LedIndicator::UPDATING);
+  }
+  Publish(OtaProgressEvent::kStarted, 0, 0);
+  ESP_LOGI(TAG, "update %s to partition %s", url, partition->label);
+
+  // the download belongs to the caller, its settings are put back after
+  // the update
+  auto buffer_size = download_->BufferSize();
+  bool pipelined = download_->Pipelined();
+  auto consumer_stack_size = download_->ConsumerStackSize();
+  auto consumer_priority = download_->ConsumerPriority();
+  bool inflate = download_->Inflate();
+  std::string resume_key = download_->ResumeKey();
+  // a resumed download skips the head of the image, which this partition
+  // does not hold, and an inflated one has no total size
+  download_->SetResumeKey(nullptr);
+  download_->SetInflate(false);
+  // one block per callback, run on the download consumer task while the
+  // next block is read
+  download_->SetBufferSize(config_.block_size);
+  download_->SetPipelined(true, config_.writer_stack_size,
+                          config_.writer_priority);
+  size_t written = 0;
+  size_t total_size = 0;
+  size_t next_progress = config_.progress_interval;
+  auto on_data = [&](const uint8_t* data, size_t len, size_t left_size,
+                     size_t total) {
+    if (total - left_size - len != written) {
+      // the download started over, the partition already holds the head
+      // of the old image
+      ESP_LOGE(TAG, "image changed during download");
+      return false;
+    }
+    mbedtls_sha256_update_ret(&sha, data, len);
+    auto write_err = esp_ota_write(handle, data, len);
+    if (write_err != ESP_OK) {
+      ESP_LOGE(TAG, "write image failed:%s", esp_err_to_name(write_err));
+      return false;
+    }
+    total_size = total;
+    written += len;
+    if (config_.progress_interval > 0 && written >= next_progress) {
+      next_progress += config_.progress_interval;
+      Publish(OtaProgressEvent::kDownloading, written, total);
+    }
+    return true;
+  };
+  bool ok = download_->DoDownload(url, on_data) && written == total_size;
+  auto download_stats = download_->GetStats();
+  stats_.flash_ms = download_stats.consumer_ms;
+  stats_.stall_ms = download_stats.stall_ms;
+  download_->SetBufferSize(buffer_size);
+  download_->SetPipelined(pipelined, consumer_stack_size, consumer_priority);
+  download_->SetInflate(inflate);
+  download_->SetResumeKey(resume_key.c_str());
+
+  uint8_t digest[SHA256_SIZE];
+  mbedtls_sha256_finish_ret(&sha, digest);
+  mbedtls_sha256_free(&sha);
+  if (ok) {
+    Publish(OtaProgressEvent::kVerifying, written, total_size);
+    if (!sha256_hex.empty() && memcmp(digest, expected, SHA256_SIZE) != 0) {
+      ESP_LOGE(TAG, "image sha-256 mismatch");
+      ok = false;
+    }
+  }
+  if (ok) {
+    // checks the image header and the appended checksum
+    err = esp_ota_end(handle);
+    if (err == ESP_OK) {
+      err = esp_ota_set_boot_partition(partition);
+    }
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "finish update failed:%s", esp_err_to_name(err));
+      ok = false;
+    }
+  } else {
+    esp_ota_abort(handle);
+  }
+
+  if (indicator_) {
+    indicator_->Stop(LedIndicator::UPDATING);
+  }
+  stats_.image_size = written;
+  stats_.elapsed_ms = (esp_timer_get_time() - start_us) / 1000;
+  ESP_LOGI(TAG, "update %s, %u bytes in %u ms, flash %u ms, stall %u ms",
+           ok ? "done" : "failed", (unsigned)stats_.image_size,
+           stats_.elapsed_ms, stats_.flash_ms, stats_.stall_ms);
+  Publish(ok ? OtaProgressEvent::kDone : OtaProgressEvent::kFailed,
+          written, total_size);
+  return ok;
+}
+
+}  // namespace esp
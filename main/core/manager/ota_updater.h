@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "event/event.h"
+
+namespace esp {
+
+class HttpDownload;
+class LedIndicator;
+
+#define OTA_PROGRESS_EVENT "ota_progress"
+
+// published on GlobalEventBus while an update runs
+class OtaProgressEvent : public Event {
+ public:
+  enum State {
+    kStarted = 0,
+    kDownloading,
+    kVerifying,
+    kDone,
+    kFailed,
+  };
+
+  OtaProgressEvent(State state, size_t written, size_t total);
+
+  char* Name() override;
+
+  int8_t Priority() override;
+
+  State GetState() const { return state_; }
+
+  // bytes written to flash
+  size_t Written() const { return written_; }
+
+  // image size, 0 until the server sent it
+  size_t Total() const { return total_; }
+
+ private:
+  State state_;
+  size_t written_;
+  size_t total_;
+};
+
+// streams a firmware image from HttpDownload into the next ota partition.
+// the download runs pipelined: it reads one block while its consumer task
+// hashes (sha-256) and writes the other to flash, so the update takes
+// about the network time instead of network plus flash time.
+// the image becomes the boot partition on success, restart to run it
+class OtaUpdater {
+ public:
+  struct Config {
+    // flash write unit, a sector
+    size_t block_size{4096};
+    uint32_t writer_stack_size{4096};
+    uint32_t writer_priority{5};
+    // a progress event every this many bytes
+    size_t progress_interval{64 * 1024};
+  };
+
+  struct Stats {
+    size_t image_size{0};
+    uint32_t elapsed_ms{0};
+    // consumer task busy hashing and writing
+    uint32_t flash_ms{0};
+    // download waiting for a free block, flash slower than the network
+    uint32_t stall_ms{0};
+  };
+
+  // download settings (certs, retries, pool) are used as they are. during
+  // Update the buffer size and pipelined mode come from config, resume
+  // and inflate are off, all four are restored afterwards. indicator may
+  // be nullptr
+  OtaUpdater(HttpDownload* download, LedIndicator* indicator, Config config);
+
+  // blocks until the image is written and verified. sha256_hex is the
+  // expected digest of the image, 64 hex chars, empty skips the check
+  bool Update(const char* url, const std::string& sha256_hex);
+
+  Stats GetStats() const { return stats_; }
+
+ private:
+  void Publish(OtaProgressEvent::State state, size_t written, size_t total);
+
+  HttpDownload* download_;
+  LedIndicator* indicator_;
+  Config config_;
+  Stats stats_;
+};
+
+}  // namespace esp
@@ -0,0 +1,222 @@
+
+#include "mqtt_batch_publisher.h"
+
+#include <string_view>
+#include <utility>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "mqtt_client_wrapper.h"
+
+static const char* TAG = "mqtt_batch";
+
+#define MAX_FRAME_TOPIC_LEN 0xff
+#define MAX_FRAME_PAYLOAD_LEN 0xffff
+
+namespace esp {
+
+static void FlushTask(void* args) {
+  auto self = (MqttBatchPublisher*)args;
+  if (self) {
+    self->FlushLoop();
+  }
+}
+
+MqttBatchPublisher::MqttBatchPublisher(MqttClient* client, Config config)
+    : client_(client), config_(std::move(config)) {
+  if (config_.max_topics == 0) {
+    ESP_LOGW(TAG, "max_topics 0, using 1");
+    config_.max_topics = 1;
+  }
+  readings_.resize(config_.max_topics);
+  flushing_.resize(config_.max_topics);
+  if (!config_.batch_topic.empty()) {
+    batch_buffer_.reserve(config_.max_batch_bytes);
+  }
+}
+
+MqttBatchPublisher::~MqttBatchPublisher() { Stop(); }
+
+bool MqttBatchPublisher::Start() {
+  if (task_handle_) {
+    return true;
+  }
+  exit_ = false;
+  wakeup_sem_ = xSemaphoreCreateBinary();
+  exit_sem_ = xSemaphoreCreateBinary();
+  TaskHandle_t task = nullptr;
+  auto ret = xTaskCreate(FlushTask, "mqtt_batch", config_.task_stack_size,
+                         (void*)this, config_.task_priority, &task);
+  if (ret != pdPASS) {
+    ESP_LOGE(TAG, "start flush task failed");
+    vSemaphoreDelete((SemaphoreHandle_t)wakeup_sem_);
+    vSemaphoreDelete((SemaphoreHandle_t)exit_sem_);
+    wakeup_sem_ = nullptr;
+    exit_sem_ = nullptr;
+    return false;
+  }
+  task_handle_ = task;
+  return true;
+}
+
+void MqttBatchPublisher::Stop() {
+  if (task_handle_) {
+    exit_ = true;
+    xSemaphoreGive((SemaphoreHandle_t)wakeup_sem_);
+    // returns after a flush in progress on the task is done
+    xSemaphoreTake((SemaphoreHandle_t)exit_sem_, portMAX_DELAY);
+    vSemaphoreDelete((SemaphoreHandle_t)wakeup_sem_);
+    vSemaphoreDelete((SemaphoreHandle_t)exit_sem_);
+    wakeup_sem_ = nullptr;
+    exit_sem_ = nullptr;
+    task_handle_ = nullptr;
+  }
+  Flush();
+}
+
+void MqttBatchPublisher::FlushLoop() {
+  for (;;) {
+    xSemaphoreTake((SemaphoreHandle_t)wakeup_sem_,
+                   pdMS_TO_TICKS(config_.flush_interval_ms) + 1);
+    if (exit_) {
+      break;
+    }
+    Flush();
+  }
+  xSemaphoreGive((SemaphoreHandle_t)exit_sem_);
+  vTaskDelete(NULL);
+}
+
+size_t MqttBatchPublisher::FrameSize(size_t topic_len, size_t payload_len) {
+  return 1 + topic_len + 2 + payload_len;
+}
+
+bool MqttBatchPublisher::Publish(const char* topic, const char* data,
+                                 int32_t len) {
+  if (!topic || len < 0) {
+    return false;
+  }
+  std::string_view topic_view(topic);
+  bool batch = !config_.batch_topic.empty();
+  if (batch && (topic_view.size() > MAX_FRAME_TOPIC_LEN ||
+                (size_t)len > MAX_FRAME_PAYLOAD_LEN)) {
+    ESP_LOGW(TAG, "reading from topic:%s too large to batch", topic);
+    return false;
+  }
+  size_t frame_size = FrameSize(topic_view.size(), len);
+
+  Reading* reading = nullptr;
+  for (;;) {
+    mutex_.Lock();
+    reading = nullptr;
+    for (size_t i = 0; i < pending_count_; ++i) {
+      if (readings_[i].topic == topic_view) {
+        reading = &readings_[i];
+        break;
+      }
+    }
+    // batch size without the value being replaced
+    size_t others = pending_bytes_;
+    if (reading) {
+      others -= FrameSize(reading->topic.size(), reading->payload.size());
+    }
+    bool fits = !batch || others == 0 ||
+                others + frame_size <= config_.max_batch_bytes;
+    bool room = reading || pending_count_ < readings_.size();
+    if (fits && room) {
+      break;
+    }
+    // the pending batch goes out first, the reading starts the next one
+    mutex_.Unlock();
+    Flush();
+  }
+  ++stats_.readings;
+  if (reading) {
+    ++stats_.coalesced;
+    ++reading->count;
+    pending_bytes_ -= FrameSize(reading->topic.size(), reading->payload.size());
+  } else {
+    reading = &readings_[pending_count_++];
+    reading->topic.assign(topic_view.data(), topic_view.size());
+    reading->count = 1;
+  }
+  reading->payload.assign(data, len);
+  pending_bytes_ += frame_size;
+  mutex_.Unlock();
+  return true;
+}
+
+void MqttBatchPublisher::Flush() {
+  flush_mutex_.Lock();
+  mutex_.Lock();
+  // the slots swap, Publish fills the other set while this one is sent
+  std::swap(readings_, flushing_);
+  size_t count = pending_count_;
+  pending_count_ = 0;
+  pending_bytes_ = 0;
+  mutex_.Unlock();
+  if (count > 0) {
+    Send(count);
+  }
+  flush_mutex_.Unlock();
+}
+
+void MqttBatchPublisher::Send(size_t count) {
+  uint32_t packets = 0;
+  uint32_t sent = 0;
+  uint32_t dropped = 0;
+  if (config_.batch_topic.empty()) {
+    for (size_t i = 0; i < count; ++i) {
+      const auto& reading = flushing_[i];
+      if (client_->AsyncPublish(reading.topic.c_str(), reading.payload.data(),
+                                reading.payload.size(), config_.qos,
+                                config_.retain)) {
+        ++packets;
+        sent += reading.count;
+      } else {
+        dropped += reading.count;
+      }
+    }
+  } else {
+    uint32_t readings = 0;
+    batch_buffer_.clear();
+    for (size_t i = 0; i < count; ++i) {
+      const auto& reading = flushing_[i];
+      size_t payload_len = reading.payload.size();
+      batch_buffer_.push_back((char)reading.topic.size());
+      batch_buffer_.insert(batch_buffer_.end(), reading.topic.begin(),
+                           reading.topic.end());
+      batch_buffer_.push_back((char)(payload_len >> 8));
+      batch_buffer_.push_back((char)(payload_len & 0xff));
+      batch_buffer_.insert(batch_buffer_.end(), reading.payload.begin(),
+                           reading.payload.end());
+      readings += reading.count;
+    }
+    if (client_->AsyncPublish(config_.batch_topic.c_str(),
+                              batch_buffer_.data(), batch_buffer_.size(),
+                              config_.qos, config_.retain)) {
+      packets = 1;
+      sent = readings;
+    } else {
+      dropped = readings;
+    }
+  }
+  mutex_.Lock();
+  stats_.packets += packets;
+  stats_.packets_saved += sent - packets;
+  stats_.dropped += dropped;
+  mutex_.Unlock();
+  ESP_LOGD(TAG, "flush %u readings in %u packets, %u dropped",
+           sent + dropped, packets, dropped);
+}
+
+MqttBatchPublisher::Stats MqttBatchPublisher::GetStats() {
+  mutex_.Lock();
+  Stats stats = stats_;
+  mutex_.Unlock();
+  return stats;
+}
+
+}  // namespace esp
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "util/mutex.h"
+
+namespace esp {
+
+class MqttClient;
+
+// sits in front of MqttClient::AsyncPublish, readings are held until the
+// next flush: same topic readings are coalesced (last value wins), and if
+// batch_topic is set all pending readings are packed in one publish:
+//   [topic_len:u8][topic][payload_len:u16 big endian][payload] ...
+// the periodic flush runs on its own task, publishing happens outside the
+// lock so Publish never waits on a flush that writes to the offline queue
+class MqttBatchPublisher {
+ public:
+  struct Config {
+    // latency bound, pending readings are flushed at least this often
+    uint32_t flush_interval_ms{1000};
+    // size bound, flush early when a batch would grow beyond it
+    size_t max_batch_bytes{1024};
+    // pending distinct topics, flush early when full
+    size_t max_topics{16};
+    // empty: only coalesce, one publish per pending topic
+    std::string batch_topic;
+    int32_t qos{0};
+    int32_t retain{0};
+    uint32_t task_stack_size{3072};
+    uint32_t task_priority{5};
+  };
+
+  struct Stats {
+    uint32_t readings{0};
+    uint32_t coalesced{0};
+    uint32_t packets{0};
+    // readings published minus the packets they took
+    uint32_t packets_saved{0};
+    // readings in a failed publish
+    uint32_t dropped{0};
+  };
+
+  MqttBatchPublisher(MqttClient* client, Config config);
+
+  ~MqttBatchPublisher();
+
+  bool Start();
+
+  void Stop();
+
+  bool Publish(const char* topic, const char* data, int32_t len);
+
+  void Flush();
+
+  Stats GetStats();
+
+  // flush task loop
+  void FlushLoop();
+
+ private:
+  struct Reading {
+    std::string topic;
+    std::string payload;
+    // readings coalesced into this one, itself included
+    uint32_t count;
+  };
+
+  static size_t FrameSize(size_t topic_len, size_t payload_len);
+
+  // publish the first count slots of flushing_, flush_mutex_ held
+  void Send(size_t count);
+
+  MqttClient* client_;
+  Config config_;
+  Mutex mutex_;
+  // slots are reused between flushes to keep string capacity
+  std::vector<Reading> readings_;
+  size_t pending_count_{0};
+  size_t pending_bytes_{0};
+  // one batch is published at a time, flushing_ and batch_buffer_ belong
+  // to it
+  Mutex flush_mutex_;
+  std::vector<Reading> flushing_;
+  std::vector<char> batch_buffer_;
+  void* task_handle_{nullptr};
+  void* wakeup_sem_{nullptr};
+  void* exit_sem_{nullptr};
+  std::atomic<bool> exit_{false};
+  Stats stats_;
+};
+
+}  // namespace esp
@@ -2,15 +2,55 @@
 #include "mqtt_client_wrapper.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "mqtt_client.h"
+#include "mqtt_offline_queue.h"
+#include "sdkconfig.h"
+#include "util/cbor.h"
+#include "util/dns_cache.h"
+#include "util/tls_handshake_metrics.h"
+#include "util/url.h"
 
 static const char* TAG = "mqtt_client";
 
+#define DEFAULT_MAX_MESSAGE_SIZE (16 * 1024)
+// qos>0 publishes tracked for ack latency, older ones are evicted
+#define MAX_TRACKED_IN_FLIGHT 32
+// esp-mqtt drops unacked outbox entries after this long
+#ifdef CONFIG_MQTT_OUTBOX_EXPIRED_TIMEOUT_MS
+#define IN_FLIGHT_EXPIRE_MS CONFIG_MQTT_OUTBOX_EXPIRED_TIMEOUT_MS
+#else
+#define IN_FLIGHT_EXPIRE_MS (30 * 1000)
+#endif
+#define MAX_EARLY_ACKS 4
+#define MAX_EARLY_SUBACKS 4
+
 namespace esp {
 
+std::string_view MqttMessage::Topic() const {
+  if (!buffer_.Valid()) {
+    return std::string_view();
+  }
+  return std::string_view((const char*)buffer_.Data(), topic_len_);
+}
+
+const char* MqttMessage::TopicCStr() const {
+  return buffer_.Valid() ? (const char*)buffer_.Data() : "";
+}
+
+std::string_view MqttMessage::Payload() const {
+  if (!buffer_.Valid()) {
+    return std::string_view();
+  }
+  // [topic]['\0'][payload]
+  return std::string_view((const char*)buffer_.Data() + topic_len_ + 1,
+                          buffer_.Size() - topic_len_ - 1);
+}
+
 static void log_error_if_nonzero(const char* message, int error_code) {
   if (error_code != 0) {
     ESP_LOGE(TAG, "Last error %s: 0x%x", message, error_code);
@@ -24,9 +64,14 @@ static void mqtt_event_handler(void* handler_args, esp_event_base_t base,
   auto mqtt_client = (MqttClient*)handler_args;
   esp_mqtt_event_handle_t event = (esp_mqtt_event_handle_t)event_data;
   switch ((esp_mqtt_event_id_t)event_id) {
+    case MQTT_EVENT_BEFORE_CONNECT:
+      ESP_LOGD(TAG, "MQTT_EVENT_BEFORE_CONNECT");
+      mqtt_client->OnBeforeConnect();
+      break;
     case MQTT_EVENT_CONNECTED:
-      ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-      mqtt_client->OnReady();
+      ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED, session_present=%d",
+               event->session_present);
+      mqtt_client->OnReady(event->session_present != 0);
       break;
     case MQTT_EVENT_DISCONNECTED:
       ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
@@ -34,21 +79,24 @@ static void mqtt_event_handler(void* handler_args, esp_event_base_t base,
       break;
 
     case MQTT_EVENT_SUBSCRIBED:
-      ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
+      ESP_LOGD(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
+      mqtt_client->OnSubscribed(event->msg_id);
       break;
     case MQTT_EVENT_UNSUBSCRIBED:
-      ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
+      ESP_LOGD(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
       break;
     case MQTT_EVENT_PUBLISHED:
-      ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+      ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+      mqtt_client->OnPublished(event->msg_id);
       break;
     case MQTT_EVENT_DATA:
-      ESP_LOGI(TAG, "MQTT_EVENT_DATA");
+      ESP_LOGD(TAG, "MQTT_EVENT_DATA, len=%d", event->data_len);
       mqtt_client->OnReceiveMsg(event->topic, event->topic_len, event->data,
-                                event->data_len);
+                                event->data_len, event->current_data_offset,
+                                event->total_data_len);
       break;
     case MQTT_EVENT_ERROR:
-      ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
+      ESP_LOGW(TAG, "MQTT_EVENT_ERROR");
       if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
         log_error_if_nonzero("reported from esp-tls",
                              event->error_handle->esp_tls_last_esp_err);
@@ -61,14 +109,17 @@ static void mqtt_event_handler(void* handler_args, esp_event_base_t base,
       }
       break;
     default:
-      ESP_LOGI(TAG, "Other event id:%d", event->event_id);
+      ESP_LOGD(TAG, "Other event id:%d", event->event_id);
       break;
   }
 }
 
 MqttClient::MqttClient(const char* broker_url, const char* client_id,
                        bool clean_session, bool auto_reconnect)
-    : url_(broker_url), client_id_(client_id) {
+    : url_(broker_url),
+      client_id_(client_id),
+      max_message_size_(DEFAULT_MAX_MESSAGE_SIZE),
+      clean_session_(clean_session) {
   auto config =
       (esp_mqtt_client_config_t*)malloc(sizeof(esp_mqtt_client_config_t));
   memset(config, 0, sizeof(esp_mqtt_client_config_t));
@@ -77,6 +128,10 @@ MqttClient::MqttClient(const char* broker_url, const char* client_id,
   config->disable_clean_session = clean_session ? 0 : 1;
   config->disable_auto_reconnect = !auto_reconnect;
   config_ = (void*)config;
+  in_flight_.reserve(MAX_TRACKED_IN_FLIGHT);
+  early_acks_.reserve(MAX_EARLY_ACKS);
+  Url url;
+  secure_ = ParseUrl(url_, url) && url.secure;
 }
 
 MqttClient::~MqttClient() {
@@ -108,6 +163,22 @@ void MqttClient::SetClientCertPem(const char* client_cert_pem,
   }
 }
 
+void MqttClient::SetBufferSize(int32_t rx_size, int32_t tx_size) {
+  if (config_) {
+    ((esp_mqtt_client_config_t*)config_)->buffer_size = rx_size;
+    ((esp_mqtt_client_config_t*)config_)->out_buffer_size = tx_size;
+  }
+}
+
+void MqttClient::SetTaskConfig(int32_t stack_size, int32_t priority) {
+  if (config_) {
+    ((esp_mqtt_client_config_t*)config_)->task_stack = stack_size;
+    ((esp_mqtt_client_config_t*)config_)->task_prio = priority;
+  }
+}
+
+void MqttClient::SetMaxMessageSize(size_t size) { max_message_size_ = size; }
+
 void MqttClient::SetOnReadyCallback(OnReadyCallback callback) {
   ready_callback_ = std::move(callback);
 }
@@ -116,28 +187,184 @@ void MqttClient::SetOnReceiveMsgCallback(OnReceiveMsgCallback callback) {
   receive_msg_callback_ = std::move(callback);
 }
 
+MqttClient::OnReceiveMsgCallback MqttClient::GetOnReceiveMsgCallback() const {
+  return receive_msg_callback_;
+}
+
+void MqttClient::SetOnReceiveChunkCallback(OnReceiveChunkCallback callback) {
+  receive_chunk_callback_ = std::move(callback);
+}
+
 void MqttClient::SetOnDisconnectCallback(OnDisconnectCallback callback) {
   disconnect_callback_ = std::move(callback);
 }
 
-void MqttClient::OnReady() {
+bool MqttClient::CopyMessage(std::string_view topic, std::string_view payload,
+                             MqttMessage& message) {
+  auto buffer =
+      BufferPool::Instance()->Acquire(topic.size() + 1 + payload.size());
+  if (!buffer.Valid()) {
+    ESP_LOGE(TAG, "copy message failed, no memory");
+    return false;
+  }
+  buffer.Append(topic.data(), topic.size());
+  buffer.Append("", 1);
+  buffer.Append(payload.data(), payload.size());
+  message.buffer_ = std::move(buffer);
+  message.topic_len_ = topic.size();
+  return true;
+}
+
+void MqttClient::SetOfflineQueue(MqttOfflineQueue* queue) {
+  offline_queue_ = queue;
+  if (offline_queue_) {
+    offline_queue_->Attach(this);
+  }
+}
+
+void MqttClient::SetDnsCache(DnsCache* dns_cache) { dns_cache_ = dns_cache; }
+
+void MqttClient::OnBeforeConnect() {
+  before_connect_us_ = esp_timer_get_time();
+  if (!dns_cache_ || !handle_ || secure_) {
+    return;
+  }
+  // dispatched on the mqtt task before the transport connects, the new
+  // uri is used for this connect
+  Url url;
+  if (dns_unconfirmed_ && ParseUrl(url_, url)) {
+    dns_cache_->Remove(std::string(url.host).c_str());
+  }
+  std::string rewritten;
+  const char* uri = url_.c_str();
+  dns_unconfirmed_ = dns_cache_->RewriteUrl(url_, rewritten);
+  if (dns_unconfirmed_) {
+    connect_url_ = std::move(rewritten);
+    uri = connect_url_.c_str();
+  }
+  esp_mqtt_client_set_uri((esp_mqtt_client_handle_t)handle_, uri);
+}
+
+void MqttClient::OnReady(bool session_present) {
   is_ready_ = true;
+  dns_unconfirmed_ = false;
+  auto now = esp_timer_get_time();
+  auto connect_ms = (uint32_t)((now - disconnect_time_us_) / 1000);
+  if (secure_ && before_connect_us_ > 0) {
+    // esp-mqtt cannot resume sessions, tcp connect, full tls handshake
+    // and CONNACK
+    TlsHandshakeMetrics::Instance()->RecordHandshake(
+        (uint32_t)((now - before_connect_us_) / 1000));
+    before_connect_us_ = 0;
+  }
+  subscription_mutex_.Lock();
+  ++session_stats_.connect_count;
+  session_stats_.last_connect_ms = connect_ms;
+  if (connect_ms > session_stats_.max_connect_ms) {
+    session_stats_.max_connect_ms = connect_ms;
+  }
+  session_stats_.session_present = session_present;
+  subscription_mutex_.Unlock();
+  if (!session_present) {
+    // a new session, the broker will not ack what the old one had open
+    metrics_mutex_.Lock();
+    in_flight_.clear();
+    untracked_in_flight_ = 0;
+    early_acks_.clear();
+    metrics_mutex_.Unlock();
+  }
+  ESP_LOGI(TAG, "ready after %u ms", connect_ms);
+
+  RestoreSubscriptions(!clean_session_ && session_present);
   if (ready_callback_) {
     ready_callback_();
   }
+  if (offline_queue_) {
+    offline_queue_->Replay();
+  }
 }
 
 void MqttClient::OnDisconnect() {
   is_ready_ = false;
+  disconnect_time_us_ = esp_timer_get_time();
+  metrics_mutex_.Lock();
+  ++metrics_.reconnect_count;
+  metrics_mutex_.Unlock();
+  subscription_mutex_.Lock();
+  for (auto& subscription : subscriptions_) {
+    subscription.second.active = false;
+    // a SUBACK in flight is lost, the subscription is sent again
+    subscription.second.msg_id = -1;
+  }
+  early_subacks_.clear();
+  subscription_mutex_.Unlock();
+  // the rest of a fragmented message will never arrive
+  fragment_buffer_.Reset();
   if (disconnect_callback_) {
     disconnect_callback_();
   }
 }
 
-void MqttClient ::OnReceiveMsg(const char* topic, int32_t topic_len,
-                               const char* data, int32_t len) {
-  if (receive_msg_callback_) {
-    receive_msg_callback_(std::string(topic, topic_len), data, len);
+void MqttClient::OnReceiveMsg(const char* topic, int32_t topic_len,
+                              const char* data, int32_t len, int32_t offset,
+                              int32_t total_len) {
+  metrics_mutex_.Lock();
+  metrics_.bytes_in += len;
+  if (offset == 0) {
+    ++metrics_.messages_in;
+  }
+  metrics_mutex_.Unlock();
+
+  std::string_view payload(data, len);
+  // common case, whole message in one event, no copy
+  if (offset == 0 && len >= total_len) {
+    std::string_view topic_view(topic, topic_len);
+    if (receive_chunk_callback_) {
+      receive_chunk_callback_(topic_view, payload, 0, len);
+    }
+    if (receive_msg_callback_) {
+      receive_msg_callback_(topic_view, payload);
+    }
+    return;
+  }
+
+  // only the first fragment carries the topic
+  if (offset == 0) {
+    fragment_topic_.assign(topic, topic_len);
+    fragment_buffer_.Reset();
+    if (receive_msg_callback_) {
+      if ((size_t)total_len > max_message_size_) {
+        ESP_LOGW(TAG, "drop msg from topic:%s, size:%d over max:%d",
+                 fragment_topic_.c_str(), total_len, (int)max_message_size_);
+      } else {
+        fragment_buffer_ = BufferPool::Instance()->Acquire(total_len);
+        if (!fragment_buffer_.Valid()) {
+          ESP_LOGE(TAG, "drop msg from topic:%s, no memory for %d bytes",
+                   fragment_topic_.c_str(), total_len);
+        }
+      }
+    }
+  }
+
+  std::string_view topic_view(fragment_topic_);
+  if (receive_chunk_callback_) {
+    receive_chunk_callback_(topic_view, payload, offset, total_len);
+  }
+  if (!fragment_buffer_.Valid()) {
+    return;
+  }
+  if (fragment_buffer_.Size() != (size_t)offset ||
+      !fragment_buffer_.Append(data, len)) {
+    ESP_LOGW(TAG, "drop msg from topic:%s, bad fragment offset:%d",
+             fragment_topic_.c_str(), offset);
+    fragment_buffer_.Reset();
+    return;
+  }
+  if (fragment_buffer_.Size() == (size_t)total_len) {
+    receive_msg_callback_(
+        topic_view, std::string_view((const char*)fragment_buffer_.Data(),
+                                     fragment_buffer_.Size()));
+    fragment_buffer_.Reset();
   }
 }
 
@@ -167,6 +394,7 @@ bool MqttClient::Start() {
     ESP_LOGE(TAG, "start failed:%s", esp_err_to_name(ret));
     return false;
   }
+  disconnect_time_us_ = esp_timer_get_time();
   is_start_ = true;
   return true;
 }
@@ -185,60 +413,317 @@ bool MqttClient::Stop() {
 
 bool MqttClient::Publish(const char* topic, const char* data, int32_t len,
                          int32_t qos, int32_t retain) {
+  if (offline_queue_ && (!is_ready_ || !offline_queue_->Empty())) {
+    return offline_queue_->Append(topic, data, len, qos, retain);
+  }
+  return DoPublish(topic, data, len, qos, retain);
+}
+
+bool MqttClient::DoPublish(const char* topic, const char* data, int32_t len,
+                           int32_t qos, int32_t retain) {
   if (!is_ready_) {
     ESP_LOGW(TAG, "not ready, so cannot publish");
     return false;
   }
+  auto start_us = esp_timer_get_time();
+  // returns msg id, -1 on failure
   auto ret = esp_mqtt_client_publish((esp_mqtt_client_handle_t)handle_, topic,
                                      data, len, qos, retain);
-  if (ret != ESP_OK) {
-    ESP_LOGE(TAG, "publish failed:%s", esp_err_to_name(ret));
+  if (ret < 0) {
+    ESP_LOGE(TAG, "publish to topic:%s failed", topic);
     return false;
   }
+  TrackPublish(ret, qos, strlen(topic) + len, start_us);
   return true;
 }
 
 bool MqttClient::AsyncPublish(const char* topic, const char* data, int32_t len,
                               int32_t qos, int32_t retain) {
+  if (offline_queue_ && (!is_ready_ || !offline_queue_->Empty())) {
+    return offline_queue_->Append(topic, data, len, qos, retain);
+  }
   if (!is_ready_) {
     ESP_LOGW(TAG, "not ready, so cannot publish");
     return false;
   }
+  auto start_us = esp_timer_get_time();
   auto ret = esp_mqtt_client_enqueue((esp_mqtt_client_handle_t)handle_, topic,
                                      data, len, qos, retain, true);
-  if (ret != ESP_OK) {
-    ESP_LOGE(TAG, "publish failed:%s", esp_err_to_name(ret));
+  if (ret < 0) {
+    ESP_LOGE(TAG, "enqueue to topic:%s failed", topic);
     return false;
   }
+  TrackPublish(ret, qos, strlen(topic) + len, start_us);
   return true;
 }
 
+bool MqttClient::AsyncPublish(const char* topic, const CborWriter& writer,
+                              int32_t qos, int32_t retain) {
+  if (!writer.Ok()) {
+    ESP_LOGE(TAG, "cbor payload to topic:%s overflowed", topic);
+    return false;
+  }
+  return AsyncPublish(topic, (const char*)writer.Data(), writer.Size(), qos,
+                      retain);
+}
+
 bool MqttClient::Subscribe(const char* topic, int32_t qos) {
-  if (!is_ready_) {
-    ESP_LOGW(TAG, "not ready, so cannot publish");
+  if (!topic) {
     return false;
   }
+  subscription_mutex_.Lock();
+  for (auto it = pending_unsubscribes_.begin();
+       it != pending_unsubscribes_.end(); ++it) {
+    if (*it == topic) {
+      pending_unsubscribes_.erase(it);
+      break;
+    }
+  }
+  auto inserted =
+      subscriptions_.emplace(topic, Subscription{qos, false, false, -1});
+  auto& subscription = inserted.first->second;
+  if (subscription.active && subscription.qos == qos) {
+    subscription_mutex_.Unlock();
+    return true;
+  }
+  subscription.qos = qos;
+  subscription.active = false;
+  subscription.confirmed = false;
+  subscription.msg_id = -1;
+  if (!is_ready_) {
+    // sent by RestoreSubscriptions once connected
+    subscription_mutex_.Unlock();
+    return true;
+  }
+  // esp-mqtt holds its api lock while dispatching events, which take
+  // subscription_mutex_, so it must not be held across the call
+  subscription_mutex_.Unlock();
+  // returns msg id, -1 on failure
   auto ret =
       esp_mqtt_client_subscribe((esp_mqtt_client_handle_t)handle_, topic, qos);
-  if (ret != ESP_OK) {
-    ESP_LOGE(TAG, "subscribe failed:%s", esp_err_to_name(ret));
+  if (ret < 0) {
+    ESP_LOGE(TAG, "subscribe topic:%s failed", topic);
     return false;
   }
+  subscription_mutex_.Lock();
+  // unsubscribed, resubscribed or restored meanwhile, keep that state
+  auto it = subscriptions_.find(topic);
+  if (it != subscriptions_.end() && it->second.qos == qos &&
+      it->second.msg_id < 0 && !it->second.active) {
+    it->second.active = true;
+    it->second.msg_id = ret;
+    for (auto ack = early_subacks_.begin(); ack != early_subacks_.end();
+         ++ack) {
+      if (*ack == ret) {
+        early_subacks_.erase(ack);
+        it->second.confirmed = true;
+        it->second.msg_id = -1;
+        break;
+      }
+    }
+  }
+  subscription_mutex_.Unlock();
   return true;
 }
 
 bool MqttClient::Unsubscribe(const char* topic) {
-  if (!is_ready_) {
-    ESP_LOGW(TAG, "not ready, so cannot publish");
+  if (!topic) {
     return false;
   }
+  subscription_mutex_.Lock();
+  subscriptions_.erase(topic);
+  // a persistent session may still hold it, so send even if never active
+  if (!is_ready_) {
+    if (!clean_session_) {
+      bool queued = false;
+      for (auto& pending : pending_unsubscribes_) {
+        queued = queued || pending == topic;
+      }
+      if (!queued) {
+        pending_unsubscribes_.emplace_back(topic);
+      }
+    }
+    subscription_mutex_.Unlock();
+    return true;
+  }
+  subscription_mutex_.Unlock();
   auto ret =
       esp_mqtt_client_unsubscribe((esp_mqtt_client_handle_t)handle_, topic);
-  if (ret != ESP_OK) {
-    ESP_LOGE(TAG, "unsubscribe failed:%s", esp_err_to_name(ret));
+  if (ret < 0) {
+    ESP_LOGE(TAG, "unsubscribe topic:%s failed", topic);
     return false;
   }
   return true;
 }
 
+void MqttClient::RestoreSubscriptions(bool session_kept) {
+  // esp-mqtt only sends one topic filter per SUBSCRIBE, they are all
+  // enqueued here right after CONNACK instead of by the app callback
+  uint32_t restored = 0;
+  subscription_mutex_.Lock();
+  for (auto& subscription : subscriptions_) {
+    auto& state = subscription.second;
+    if (session_kept && state.confirmed) {
+      state.active = true;
+      continue;
+    }
+    state.confirmed = false;
+    auto ret = esp_mqtt_client_subscribe((esp_mqtt_client_handle_t)handle_,
+                                         subscription.first.c_str(),
+                                         state.qos);
+    if (ret < 0) {
+      ESP_LOGE(TAG, "restore subscription:%s failed",
+               subscription.first.c_str());
+      continue;
+    }
+    state.active = true;
+    state.msg_id = ret;
+    ++restored;
+  }
+  // without the session the broker dropped them already
+  for (auto& topic : pending_unsubscribes_) {
+    if (session_kept &&
+        esp_mqtt_client_unsubscribe((esp_mqtt_client_handle_t)handle_,
+                                    topic.c_str()) < 0) {
+      ESP_LOGE(TAG, "unsubscribe topic:%s failed", topic.c_str());
+    }
+  }
+  pending_unsubscribes_.clear();
+  session_stats_.restored_subscriptions += restored;
+  subscription_mutex_.Unlock();
+  if (restored > 0) {
+    ESP_LOGI(TAG, "restore %u subscriptions", restored);
+  }
+}
+
+void MqttClient::OnSubscribed(int32_t msg_id) {
+  subscription_mutex_.Lock();
+  bool matched = false;
+  for (auto& subscription : subscriptions_) {
+    if (subscription.second.msg_id == msg_id) {
+      subscription.second.confirmed = true;
+      subscription.second.msg_id = -1;
+      matched = true;
+      break;
+    }
+  }
+  if (!matched && msg_id > 0) {
+    if (early_subacks_.size() == MAX_EARLY_SUBACKS) {
+      early_subacks_.erase(early_subacks_.begin());
+    }
+    early_subacks_.push_back(msg_id);
+  }
+  subscription_mutex_.Unlock();
+}
+
+MqttClient::SessionStats MqttClient::GetSessionStats() {
+  subscription_mutex_.Lock();
+  auto stats = session_stats_;
+  subscription_mutex_.Unlock();
+  return stats;
+}
+
+bool MqttClient::IsReady() const { return is_ready_; }
+
+void MqttClient::TrackPublish(int32_t msg_id, int32_t qos, size_t bytes,
+                              int64_t start_us) {
+  metrics_mutex_.Lock();
+  ++metrics_.messages_out;
+  metrics_.bytes_out += bytes;
+  if (qos > 0) {
+    bool acked = false;
+    for (auto it = early_acks_.begin(); it != early_acks_.end(); ++it) {
+      if (it->msg_id == msg_id) {
+        RecordAckLocked(qos, start_us, it->time_us);
+        early_acks_.erase(it);
+        acked = true;
+        break;
+      }
+    }
+    if (!acked) {
+      ExpireInFlightLocked(esp_timer_get_time());
+      if (in_flight_.size() == MAX_TRACKED_IN_FLIGHT) {
+        in_flight_.erase(in_flight_.begin());
+        ++untracked_in_flight_;
+      }
+      in_flight_.push_back({msg_id, qos, start_us});
+    }
+  }
+  metrics_mutex_.Unlock();
+}
+
+void MqttClient::RecordAckLocked(int32_t qos, int64_t start_us,
+                                 int64_t ack_us) {
+  auto ms = (uint32_t)((ack_us - start_us) / 1000);
+  if (qos == 1) {
+    metrics_.qos1_latency.Record(ms);
+  } else {
+    metrics_.qos2_latency.Record(ms);
+  }
+}
+
+void MqttClient::ExpireInFlightLocked(int64_t now) {
+  int64_t expire_us = (int64_t)IN_FLIGHT_EXPIRE_MS * 1000;
+  size_t expired = 0;
+  while (expired < in_flight_.size() &&
+         now - in_flight_[expired].time_us >= expire_us) {
+    ++expired;
+  }
+  if (expired == 0) {
+    return;
+  }
+  in_flight_.erase(in_flight_.begin(), in_flight_.begin() + expired);
+  // pushed out before the oldest tracked one, expired as well
+  untracked_in_flight_ = 0;
+}
+
+void MqttClient::OnPublished(int32_t msg_id) {
+  auto now = esp_timer_get_time();
+  metrics_mutex_.Lock();
+  bool found = false;
+  for (auto it = in_flight_.begin(); it != in_flight_.end(); ++it) {
+    if (it->msg_id == msg_id) {
+      RecordAckLocked(it->qos, it->time_us, now);
+      in_flight_.erase(it);
+      found = true;
+      break;
+    }
+  }
+  if (!found && untracked_in_flight_ > 0) {
+    // most likely one pushed out of the full list under load
+    --untracked_in_flight_;
+  } else if (!found && msg_id > 0) {
+    // acked before the publishing task got to TrackPublish, qos 0 has no
+    // id
+    if (early_acks_.size() == MAX_EARLY_ACKS) {
+      early_acks_.erase(early_acks_.begin());
+    }
+    early_acks_.push_back({msg_id, 0, now});
+  }
+  metrics_mutex_.Unlock();
+}
+
+MqttClient::Metrics MqttClient::GetMetrics() {
+  metrics_mutex_.Lock();
+  ExpireInFlightLocked(esp_timer_get_time());
+  auto metrics = metrics_;
+  metrics.in_flight = in_flight_.size() + untracked_in_flight_;
+  metrics_mutex_.Unlock();
+  metrics.outbox_size = OutboxSize();
+  return metrics;
+}
+
+int32_t MqttClient::OutboxSize() {
+  if (!handle_) {
+    return 0;
+  }
+  return esp_mqtt_client_get_outbox_size((esp_mqtt_client_handle_t)handle_);
+}
+
+void MqttClient::ResetMetrics() {
+  metrics_mutex_.Lock();
+  metrics_ = Metrics();
+  metrics_mutex_.Unlock();
+}
+
 }  // namespace esp
@@ -2,17 +2,82 @@
 
 #include <cstdint>
 #include <functional>
+#include <map>
 #include <string>
+#include <string_view>
+#include <vector>
+
+#include "util/buffer_pool.h"
+#include "util/latency_histogram.h"
+#include "util/mutex.h"
 
 namespace esp {
 
+// owned copy of a received message, kept in a pooled buffer
+class MqttMessage {
+ public:
+  bool Valid() const { return buffer_.Valid(); }
+
+  std::string_view Topic() const;
+
+  // nul terminated topic, for the publish apis
+  const char* TopicCStr() const;
+
+  std::string_view Payload() const;
+
+ private:
+  friend class MqttClient;
+
+  PooledBuffer buffer_;
+  size_t topic_len_{0};
+};
+
+class CborWriter;
+class DnsCache;
+class MqttOfflineQueue;
+
 class MqttClient {
  public:
   using OnReadyCallback = std::function<void()>;
   using OnDisconnectCallback = std::function<void()>;
+  // topic and payload are borrowed from the mqtt rx buffer and only valid
+  // during the callback, use CopyMessage to keep them
   using OnReceiveMsgCallback =
-      std::function<void(std::string topic, const char* data, int32_t len)>;
-
+      std::function<void(std::string_view topic, std::string_view payload)>;
+  // streaming delivery, called for every fragment of a message as it
+  // arrives; offset is the fragment position inside a total_len payload
+  using OnReceiveChunkCallback =
+      std::function<void(std::string_view topic, std::string_view chunk,
+                         size_t offset, size_t total_len)>;
+
+  struct SessionStats {
+    uint32_t connect_count{0};
+    // time from disconnect (or Start) to ready
+    uint32_t last_connect_ms{0};
+    uint32_t max_connect_ms{0};
+    uint32_t restored_subscriptions{0};
+    // broker kept the session, subscriptions were not restored
+    bool session_present{false};
+  };
+
+  struct Metrics {
+    // publish (or enqueue) to PUBACK for qos 1, to PUBCOMP for qos 2
+    LatencyHistogram qos1_latency;
+    LatencyHistogram qos2_latency;
+    // qos>0 publishes not acked yet, the ones esp-mqtt expired from its
+    // outbox or a clean session dropped are not counted
+    uint32_t in_flight{0};
+    uint32_t messages_in{0};
+    uint32_t messages_out{0};
+    uint64_t bytes_in{0};
+    uint64_t bytes_out{0};
+    uint32_t reconnect_count{0};
+    // bytes held in the esp-mqtt outbox
+    int32_t outbox_size{0};
+  };
+
+  // clean_session false asks the broker to keep subscriptions and queued
+  // qos>0 messages across reconnects, client_id must be stable then
   MqttClient(const char* broker_url, const char* client_id, bool clean_session, bool auto_reconnect);
 
   ~MqttClient();
@@ -23,12 +88,42 @@ class MqttClient {
 
   void SetClientCertPem(const char* client_cert_pem, size_t client_cert_pem_len);
 
+  // esp-mqtt rx/tx buffer size, messages larger than rx buffer arrive in
+  // fragments, must call before Start
+  void SetBufferSize(int32_t rx_size, int32_t tx_size);
+
+  // stack size and priority of the esp-mqtt task, must call before Start
+  void SetTaskConfig(int32_t stack_size, int32_t priority);
+
+  // fragmented messages up to this size are reassembled before
+  // OnReceiveMsgCallback, larger ones only reach OnReceiveChunkCallback
+  void SetMaxMessageSize(size_t size);
+
   void SetOnReadyCallback(OnReadyCallback callback);
   
   void SetOnReceiveMsgCallback(OnReceiveMsgCallback callback);
 
+  // the current callback, so a temporary one can restore it
+  OnReceiveMsgCallback GetOnReceiveMsgCallback() const;
+
+  void SetOnReceiveChunkCallback(OnReceiveChunkCallback callback);
+
   void SetOnDisconnectCallback(OnDisconnectCallback callback);
 
+  // copy a borrowed message into a pooled buffer
+  static bool CopyMessage(std::string_view topic, std::string_view payload,
+                          MqttMessage& message);
+
+  // publishes made while not ready, or while older ones are still queued,
+  // go to the offline queue and are replayed after reconnect.
+  // the queue must be initialized and outlive the client
+  void SetOfflineQueue(MqttOfflineQueue* queue);
+
+  // every connect of an mqtt:// broker goes to the address cached in
+  // dns_cache, an address that never got to ready is looked up again.
+  // mqtts and ws keep the name and are resolved by esp-mqtt
+  void SetDnsCache(DnsCache* dns_cache);
+
   bool Start();
 
   bool Stop();
@@ -39,17 +134,79 @@ class MqttClient {
   bool AsyncPublish(const char* topic, const char* data, int32_t len,
                     int32_t qos, int32_t retain);
 
+  // publish a cbor encoded payload, fails if the writer overflowed
+  bool AsyncPublish(const char* topic, const CborWriter& writer, int32_t qos,
+                    int32_t retain);
+
+  // subscriptions are kept in a registry and restored on every connect,
+  // with a present session only the ones the broker has not acked yet, so
+  // they only need to be made once, subscribing while not ready is
+  // deferred to the next connect
   bool Subscribe(const char* topic, int32_t qos);
 
+  // while not ready the unsubscribe is sent on the next connect that
+  // finds the persistent session
   bool Unsubscribe(const char* topic);
 
-  void OnReady();
+  bool IsReady() const;
+
+  SessionStats GetSessionStats();
+
+  Metrics GetMetrics();
+
+  // bytes held in the esp-mqtt outbox
+  int32_t OutboxSize();
+
+  void ResetMetrics();
+
+  void OnBeforeConnect();
+
+  void OnReady(bool session_present);
 
   void OnDisconnect();
 
-  void OnReceiveMsg(const char* topic, int32_t topic_len, const char* data, int32_t len);
+  void OnPublished(int32_t msg_id);
+
+  void OnSubscribed(int32_t msg_id);
+
+  void OnReceiveMsg(const char* topic, int32_t topic_len, const char* data,
+                    int32_t len, int32_t offset, int32_t total_len);
 
  private:
+  friend class MqttOfflineQueue;
+
+  bool DoPublish(const char* topic, const char* data, int32_t len, int32_t qos,
+                 int32_t retain);
+
+  // session_kept: the broker still has the acked subscriptions
+  void RestoreSubscriptions(bool session_kept);
+
+  // start_us is taken before the publish call, the ack may be handled on
+  // the mqtt task before the call returns
+  void TrackPublish(int32_t msg_id, int32_t qos, size_t bytes,
+                    int64_t start_us);
+
+  void RecordAckLocked(int32_t qos, int64_t start_us, int64_t ack_us);
+
+  // forget publishes esp-mqtt has expired from its outbox by now
+  void ExpireInFlightLocked(int64_t now);
+
+  struct InFlight {
+    int32_t msg_id;
+    int32_t qos;
+    int64_t time_us;
+  };
+
+  struct Subscription {
+    int32_t qos;
+    // subscribed in the current connection
+    bool active;
+    // SUBACK received, part of the broker session
+    bool confirmed;
+    // SUBSCRIBE waiting for its ack, -1 if none
+    int32_t msg_id;
+  };
+
   std::string url_;
   std::string client_id_;
   void* config_{nullptr};
@@ -58,7 +215,37 @@ class MqttClient {
   bool is_ready_{false};
   OnReadyCallback ready_callback_;
   OnReceiveMsgCallback receive_msg_callback_;
+  OnReceiveChunkCallback receive_chunk_callback_;
+  size_t max_message_size_;
+  // reassembly of the fragmented message in progress
+  std::string fragment_topic_;
+  PooledBuffer fragment_buffer_;
   OnDisconnectCallback disconnect_callback_;
+  MqttOfflineQueue* offline_queue_{nullptr};
+  DnsCache* dns_cache_{nullptr};
+  // uri given to esp-mqtt for the current connect, the host replaced by
+  // its address
+  std::string connect_url_;
+  // connect_url_ has not reached ready yet
+  bool dns_unconfirmed_{false};
+  bool clean_session_;
+  bool secure_{false};
+  int64_t before_connect_us_{0};
+  Mutex subscription_mutex_;
+  std::map<std::string, Subscription> subscriptions_;
+  // unsubscribed while not ready, still held by a persistent session
+  std::vector<std::string> pending_unsubscribes_;
+  // SUBACKs that beat Subscribe storing their msg id
+  std::vector<int32_t> early_subacks_;
+  int64_t disconnect_time_us_{0};
+  SessionStats session_stats_;
+  Mutex metrics_mutex_;
+  Metrics metrics_;
+  std::vector<InFlight> in_flight_;
+  // in flight but pushed out of the full in_flight_, no latency sample
+  uint32_t untracked_in_flight_{0};
+  // acks that came before TrackPublish, time_us is the ack time
+  std::vector<InFlight> early_acks_;
 };
 
 }  // namespace esp
@@ -0,0 +1,141 @@
+
+#include "mqtt_connection_manager.h"
+
+#include <utility>
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "mqtt_client_wrapper.h"
+#include "util/delay.h"
+
+static const char* TAG = "mqtt_connections";
+
+#define READY_POLL_MS 10
+
+namespace esp {
+
+MqttConnectionManager::MqttConnectionManager(Config config)
+    : config_(std::move(config)) {}
+
+MqttConnectionManager::~MqttConnectionManager() { StopAll(); }
+
+MqttClient* MqttConnectionManager::Add(const char* name,
+                                       const char* broker_url,
+                                       const char* client_id,
+                                       bool clean_session) {
+  if (!name || Get(name)) {
+    ESP_LOGE(TAG, "invalid or duplicate connection name");
+    return nullptr;
+  }
+  auto client =
+      std::make_unique<MqttClient>(broker_url, client_id, clean_session, true);
+  client->SetTaskConfig(config_.task_stack_size, config_.task_priority);
+  client->SetBufferSize(config_.rx_buffer_size, config_.tx_buffer_size);
+  auto ptr = client.get();
+  mutex_.Lock();
+  connections_.push_back({name, std::move(client), 0, 0});
+  mutex_.Unlock();
+  return ptr;
+}
+
+MqttClient* MqttConnectionManager::Get(const char* name) {
+  MqttClient* client = nullptr;
+  mutex_.Lock();
+  for (const auto& connection : connections_) {
+    if (connection.name == name) {
+      client = connection.client.get();
+      break;
+    }
+  }
+  mutex_.Unlock();
+  return client;
+}
+
+bool MqttConnectionManager::StartAll() {
+  // sessions are never removed, so the clients and their index stay valid
+  // while the lock is released for the slow part
+  mutex_.Lock();
+  std::vector<MqttClient*> clients;
+  clients.reserve(connections_.size());
+  for (const auto& connection : connections_) {
+    clients.push_back(connection.client.get());
+  }
+  mutex_.Unlock();
+
+  bool ret = true;
+  for (size_t i = 0; i < clients.size(); ++i) {
+    auto client = clients[i];
+    auto free_before = esp_get_free_heap_size();
+    if (!client->Start()) {
+      ESP_LOGE(TAG, "start connection %u failed", (unsigned)i);
+      ret = false;
+      continue;
+    }
+    auto free_started = esp_get_free_heap_size();
+    int64_t deadline =
+        esp_timer_get_time() + (int64_t)config_.start_stagger_ms * 1000;
+    while (!client->IsReady() && esp_timer_get_time() < deadline) {
+      DelayMS(READY_POLL_MS);
+    }
+    auto free_connected = esp_get_free_heap_size();
+
+    mutex_.Lock();
+    auto& connection = connections_[i];
+    connection.start_heap_bytes = (int32_t)free_before - (int32_t)free_started;
+    connection.connect_heap_bytes =
+        (int32_t)free_started - (int32_t)free_connected;
+    ESP_LOGI(TAG, "connection %s started, %s, heap %d + %d bytes",
+             connection.name.c_str(),
+             client->IsReady() ? "ready" : "not ready yet",
+             connection.start_heap_bytes, connection.connect_heap_bytes);
+    mutex_.Unlock();
+  }
+  return ret;
+}
+
+void MqttConnectionManager::StopAll() {
+  mutex_.Lock();
+  for (auto& connection : connections_) {
+    connection.client->Stop();
+  }
+  mutex_.Unlock();
+}
+
+std::vector<MqttConnectionManager::ConnectionInfo>
+MqttConnectionManager::GetConnections() {
+  std::vector<ConnectionInfo> infos;
+  mutex_.Lock();
+  infos.reserve(connections_.size());
+  for (const auto& connection : connections_) {
+    auto client = connection.client.get();
+    infos.push_back({connection.name, client, BudgetBytes(),
+                     connection.start_heap_bytes,
+                     connection.connect_heap_bytes, client->IsReady(),
+                     client->OutboxSize()});
+  }
+  mutex_.Unlock();
+  return infos;
+}
+
+int32_t MqttConnectionManager::BudgetBytes() const {
+  return config_.task_stack_size + config_.rx_buffer_size +
+         config_.tx_buffer_size;
+}
+
+void MqttConnectionManager::LogHeapUsage() {
+  int32_t total = 0;
+  for (const auto& info : GetConnections()) {
+    ESP_LOGI(TAG,
+             "%s: %s, budget %d bytes, heap start %d connect %d bytes, "
+             "outbox %d bytes",
+             info.name.c_str(), info.ready ? "ready" : "not ready",
+             info.budget_bytes, info.start_heap_bytes,
+             info.connect_heap_bytes, info.outbox_size);
+    total += info.start_heap_bytes + info.connect_heap_bytes;
+  }
+  ESP_LOGI(TAG, "total heap %d bytes, free heap %u", total,
+           esp_get_free_heap_size());
+}
+
+}  // namespace esp
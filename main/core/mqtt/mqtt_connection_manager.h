@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "util/mutex.h"
+
+namespace esp {
+
+class MqttClient;
+
+// owns several MqttClient sessions (e.g. local and cloud broker) and
+// applies one per session budget to them: task stack and rx/tx buffer
+// sizes, and staggered starts so tls handshakes do not overlap.
+// nothing is shared between sessions: esp-mqtt still runs one task with
+// its own rx/tx buffers per connection, the manager only bounds their
+// size. messages larger than the rx buffer are reassembled in BufferPool
+// as for any MqttClient
+class MqttConnectionManager {
+ public:
+  struct Config {
+    int32_t task_stack_size{4096};
+    int32_t task_priority{5};
+    int32_t rx_buffer_size{512};
+    int32_t tx_buffer_size{512};
+    // wait for a session to connect before starting the next one
+    uint32_t start_stagger_ms{3000};
+  };
+
+  struct ConnectionInfo {
+    std::string name;
+    MqttClient* client;
+    // task stack plus rx/tx buffers from the config, exact
+    int32_t budget_bytes;
+    // free heap drop across MqttClient::Start: esp-mqtt handle, task and
+    // buffers. short window, but other tasks allocating meanwhile skew it
+    int32_t start_heap_bytes;
+    // further drop until connected or start_stagger_ms, mostly transport
+    // and tls session. an estimate, skewed the same way
+    int32_t connect_heap_bytes;
+    bool ready;
+    int32_t outbox_size;
+  };
+
+  explicit MqttConnectionManager(Config config);
+
+  ~MqttConnectionManager();
+
+  // the client is owned by the manager and configured with the budget,
+  // callbacks and subscriptions can be set on it before StartAll
+  MqttClient* Add(const char* name, const char* broker_url,
+                  const char* client_id, bool clean_session);
+
+  MqttClient* Get(const char* name);
+
+  // starts the sessions one by one, blocks up to start_stagger_ms per
+  // session. Get and GetConnections are not blocked meanwhile
+  bool StartAll();
+
+  void StopAll();
+
+  std::vector<ConnectionInfo> GetConnections();
+
+  void LogHeapUsage();
+
+ private:
+  struct Connection {
+    std::string name;
+    std::unique_ptr<MqttClient> client;
+    int32_t start_heap_bytes;
+    int32_t connect_heap_bytes;
+  };
+
+  int32_t BudgetBytes() const;
+
+  Config config_;
+  Mutex mutex_;
+  std::vector<Connection> connections_;
+};
+
+}  // namespace esp
@@ -0,0 +1,230 @@
+
+#include "mqtt_event_bridge.h"
+
+#include <cstdlib>
+#include <vector>
+
+#include "esp_log.h"
+#include "event/global_event_bus.h"
+#include "util/mutex.h"
+
+static const char* TAG = "mqtt_bridge";
+
+#define MAX_FREE_EVENTS 16
+
+namespace esp {
+
+// free list of event storage, guarded since events are created on the
+// mqtt task and deleted on the bus task
+static Mutex* EventPoolMutex() {
+  static Mutex mutex;
+  return &mutex;
+}
+
+static std::vector<void*>* EventPool() {
+  static std::vector<void*> pool;
+  return &pool;
+}
+
+void* MqttMessageEvent::operator new(size_t size) {
+  void* ptr = nullptr;
+  EventPoolMutex()->Lock();
+  if (size == sizeof(MqttMessageEvent) && !EventPool()->empty()) {
+    ptr = EventPool()->back();
+    EventPool()->pop_back();
+  }
+  EventPoolMutex()->Unlock();
+  if (!ptr) {
+    // built without exceptions, a failed allocation aborts like
+    // the global operator new
+    ptr = malloc(size);
+    if (!ptr) {
+      abort();
+    }
+  }
+  return ptr;
+}
+
+void MqttMessageEvent::operator delete(void* ptr) {
+  if (!ptr) {
+    return;
+  }
+  EventPoolMutex()->Lock();
+  auto pool = EventPool();
+  if (pool->capacity() == 0) {
+    pool->reserve(MAX_FREE_EVENTS);
+  }
+  if (pool->size() < MAX_FREE_EVENTS) {
+    pool->push_back(ptr);
+    ptr = nullptr;
+  }
+  EventPoolMutex()->Unlock();
+  if (ptr) {
+    free(ptr);
+  }
+}
+
+MqttMessageEvent::MqttMessageEvent(const char* name, int8_t priority)
+    : name_(name), priority_(priority) {}
+
+char* MqttMessageEvent::Name() { return (char*)name_; }
+
+int8_t MqttMessageEvent::Priority() { return priority_; }
+
+bool MqttMessageEvent::SetMessage(std::string_view topic,
+                                  std::string_view payload) {
+  return MqttClient::CopyMessage(topic, payload, message_);
+}
+
+class MqttEventBridge::OutboundHandler : public EventHandler {
+ public:
+  OutboundHandler(MqttEventBridge* bridge, std::string event_name,
+                  std::string topic, int32_t qos, int32_t retain)
+      : bridge_(bridge),
+        event_name_(std::move(event_name)),
+        topic_(std::move(topic)),
+        qos_(qos),
+        retain_(retain) {}
+
+  void Process(Event* event) override {
+    // no rtti, the bus only routes events with our name here
+    bridge_->OnOutboundEvent(topic_, qos_, retain_, (MqttMessageEvent*)event);
+  }
+
+  const std::string& EventName() const { return event_name_; }
+
+ private:
+  MqttEventBridge* bridge_;
+  std::string event_name_;
+  std::string topic_;
+  int32_t qos_;
+  int32_t retain_;
+};
+
+MqttEventBridge::MqttEventBridge(MqttClient* client) : client_(client) {}
+
+MqttEventBridge::~MqttEventBridge() {
+  for (const auto& handler : outbound_handlers_) {
+    GlobalEventBus::Instance()->Unsubscribe(handler->EventName(), handler);
+  }
+}
+
+bool MqttEventBridge::MapInbound(const std::string& topic_filter,
+                                 const std::string& event_name,
+                                 int8_t priority, int32_t qos) {
+  if (topic_filter.empty() || event_name.empty()) {
+    return false;
+  }
+  inbound_rules_.push_back({topic_filter, event_name, priority});
+  return client_->Subscribe(topic_filter.c_str(), qos);
+}
+
+bool MqttEventBridge::MapOutbound(const std::string& event_name,
+                                  const std::string& topic, int32_t qos,
+                                  int32_t retain) {
+  if (event_name.empty()) {
+    return false;
+  }
+  auto handler = std::make_shared<OutboundHandler>(this, event_name, topic,
+                                                   qos, retain);
+  if (!GlobalEventBus::Instance()->Subscribe(event_name, handler)) {
+    return false;
+  }
+  outbound_handlers_.push_back(std::move(handler));
+  return true;
+}
+
+void MqttEventBridge::SetFallbackCallback(
+    MqttClient::OnReceiveMsgCallback callback) {
+  fallback_callback_ = std::move(callback);
+}
+
+bool MqttEventBridge::Start() {
+  client_->SetOnReceiveMsgCallback(
+      [this](std::string_view topic, std::string_view payload) {
+        OnReceiveMsg(topic, payload);
+      });
+  return true;
+}
+
+MqttEventBridge::Stats MqttEventBridge::GetStats() const {
+  Stats stats;
+  stats.inbound = inbound_;
+  stats.outbound = outbound_;
+  stats.unmatched = unmatched_;
+  stats.dropped = dropped_;
+  return stats;
+}
+
+void MqttEventBridge::OnReceiveMsg(std::string_view topic,
+                                   std::string_view payload) {
+  for (const auto& rule : inbound_rules_) {
+    if (!TopicMatches(rule.topic_filter, topic)) {
+      continue;
+    }
+    auto event = new MqttMessageEvent(rule.event_name.c_str(), rule.priority);
+    if (!event->SetMessage(topic, payload) ||
+        !GlobalEventBus::Instance()->Publish(event)) {
+      ESP_LOGW(TAG, "drop msg from topic:%.*s", (int)topic.size(),
+               topic.data());
+      delete event;
+      ++dropped_;
+      return;
+    }
+    ++inbound_;
+    return;
+  }
+  ++unmatched_;
+  if (fallback_callback_) {
+    fallback_callback_(topic, payload);
+  }
+}
+
+void MqttEventBridge::OnOutboundEvent(const std::string& topic, int32_t qos,
+                                      int32_t retain,
+                                      MqttMessageEvent* event) {
+  const char* target = topic.empty() ? event->Message().TopicCStr()
+                                     : topic.c_str();
+  auto payload = event->Payload();
+  if (target[0] == 0 ||
+      !client_->AsyncPublish(target, payload.data(), payload.size(), qos,
+                             retain)) {
+    ++dropped_;
+    return;
+  }
+  ++outbound_;
+}
+
+bool MqttEventBridge::TopicMatches(std::string_view filter,
+                                   std::string_view topic) {
+  size_t f = 0;
+  size_t t = 0;
+  for (;;) {
+    size_t f_end = filter.find('/', f);
+    if (f_end == std::string_view::npos) {
+      f_end = filter.size();
+    }
+    auto level = filter.substr(f, f_end - f);
+    if (level == "#") {
+      return true;
+    }
+    size_t t_end = topic.find('/', t);
+    if (t_end == std::string_view::npos) {
+      t_end = topic.size();
+    }
+    if (level != "+" && level != topic.substr(t, t_end - t)) {
+      return false;
+    }
+    bool filter_last = f_end == filter.size();
+    bool topic_last = t_end == topic.size();
+    if (filter_last || topic_last) {
+      // "a/#" also matches "a"
+      return topic_last &&
+             (filter_last || filter.substr(f_end + 1) == "#");
+    }
+    f = f_end + 1;
+    t = t_end + 1;
+  }
+}
+
+}  // namespace esp
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "event/event.h"
+#include "mqtt_client_wrapper.h"
+
+namespace esp {
+
+// bus event carrying an mqtt message, used in both directions.
+// events are recycled through a free list and the payload is kept in a
+// pooled buffer, so a message costs at most one allocation when the pools
+// are cold and none once they are warm
+class MqttMessageEvent : public Event {
+ public:
+  // name must outlive the event
+  MqttMessageEvent(const char* name, int8_t priority);
+
+  char* Name() override;
+
+  int8_t Priority() override;
+
+  // copy topic and payload into a pooled buffer
+  bool SetMessage(std::string_view topic, std::string_view payload);
+
+  std::string_view Topic() const { return message_.Topic(); }
+
+  std::string_view Payload() const { return message_.Payload(); }
+
+  const MqttMessage& Message() const { return message_; }
+
+  static void* operator new(size_t size);
+
+  static void operator delete(void* ptr);
+
+ private:
+  const char* name_;
+  int8_t priority_;
+  MqttMessage message_;
+};
+
+// maps mqtt topic filters to bus events and bus events to mqtt topics, so
+// device logic only talks to GlobalEventBus.
+// takes over the client's receive callback when started
+class MqttEventBridge {
+ public:
+  struct Stats {
+    uint32_t inbound{0};
+    uint32_t outbound{0};
+    uint32_t unmatched{0};
+    uint32_t dropped{0};
+  };
+
+  explicit MqttEventBridge(MqttClient* client);
+
+  ~MqttEventBridge();
+
+  // messages matching topic_filter (+ and # wildcards) are published on the
+  // bus as MqttMessageEvent named event_name, the client subscribes to it
+  bool MapInbound(const std::string& topic_filter,
+                  const std::string& event_name, int8_t priority,
+                  int32_t qos);
+
+  // MqttMessageEvent named event_name published on the bus are sent to
+  // topic, or to the event's own topic if topic is empty
+  bool MapOutbound(const std::string& event_name, const std::string& topic,
+                   int32_t qos, int32_t retain);
+
+  // receives messages that match no inbound mapping
+  void SetFallbackCallback(MqttClient::OnReceiveMsgCallback callback);
+
+  bool Start();
+
+  Stats GetStats() const;
+
+  static bool TopicMatches(std::string_view filter, std::string_view topic);
+
+ private:
+  struct InboundRule {
+    std::string topic_filter;
+    std::string event_name;
+    int8_t priority;
+  };
+
+  class OutboundHandler;
+
+  void OnReceiveMsg(std::string_view topic, std::string_view payload);
+
+  void OnOutboundEvent(const std::string& topic, int32_t qos, int32_t retain,
+                       MqttMessageEvent* event);
+
+  MqttClient* client_;
+  // lists keep event name pointers stable
+  std::list<InboundRule> inbound_rules_;
+  std::list<std::shared_ptr<OutboundHandler>> outbound_handlers_;
+  MqttClient::OnReceiveMsgCallback fallback_callback_;
+  // updated from the mqtt task and the bus task
+  std::atomic<uint32_t> inbound_{0};
+  std::atomic<uint32_t> outbound_{0};
+  std::atomic<uint32_t> unmatched_{0};
+  std::atomic<uint32_t> dropped_{0};
+};
+
+}  // namespace esp
@@ -0,0 +1,170 @@
+
+#include "mqtt_load_generator.h"
+
+#include <cstring>
+#include <utility>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "util/buffer_pool.h"
+#include "util/delay.h"
+
+static const char* TAG = "mqtt_load";
+
+// send time (us) and sequence number
+#define PAYLOAD_HEADER_SIZE 12
+
+namespace esp {
+
+MqttLoadGenerator::MqttLoadGenerator(MqttClient* client, Config config)
+    : client_(client), config_(std::move(config)) {
+  if (config_.payload_size < PAYLOAD_HEADER_SIZE) {
+    config_.payload_size = PAYLOAD_HEADER_SIZE;
+  }
+  if (config_.messages_per_sec == 0) {
+    config_.messages_per_sec = 1;
+  }
+}
+
+void MqttLoadGenerator::SetDisconnectInjector(DisconnectInjector injector) {
+  injector_ = std::move(injector);
+}
+
+void MqttLoadGenerator::OnReceive(std::string_view topic,
+                                  std::string_view payload) {
+  if (topic != config_.topic) {
+    if (previous_callback_) {
+      previous_callback_(topic, payload);
+    }
+    return;
+  }
+  if (payload.size() < PAYLOAD_HEADER_SIZE) {
+    return;
+  }
+  int64_t send_us;
+  std::memcpy(&send_us, payload.data(), sizeof(send_us));
+  auto ms = (uint32_t)((esp_timer_get_time() - send_us) / 1000);
+  mutex_.Lock();
+  round_trip_.Record(ms);
+  mutex_.Unlock();
+  ++received_;
+}
+
+MqttLoadGenerator::Report MqttLoadGenerator::Run() {
+  Report report;
+  auto payload = BufferPool::Instance()->Acquire(config_.payload_size);
+  if (!payload.Valid()) {
+    ESP_LOGE(TAG, "no memory for %u bytes payload",
+             (unsigned)config_.payload_size);
+    return report;
+  }
+  payload.SetSize(config_.payload_size);
+  std::memset(payload.Data(), 'x', payload.Size());
+
+  mutex_.Lock();
+  round_trip_.Reset();
+  mutex_.Unlock();
+  received_ = 0;
+  if (config_.measure_round_trip) {
+    previous_callback_ = client_->GetOnReceiveMsgCallback();
+    client_->SetOnReceiveMsgCallback(
+        [this](std::string_view topic, std::string_view payload) {
+          OnReceive(topic, payload);
+        });
+    client_->Subscribe(config_.topic.c_str(), config_.qos);
+  }
+  client_->ResetMetrics();
+
+  ESP_LOGI(TAG, "start: %u msg/s, %u bytes, qos %d, %u ms",
+           config_.messages_per_sec, (unsigned)config_.payload_size,
+           config_.qos, config_.duration_ms);
+  int64_t interval_us = 1000000 / config_.messages_per_sec;
+  int64_t start_us = esp_timer_get_time();
+  int64_t end_us = start_us + (int64_t)config_.duration_ms * 1000;
+  int64_t next_us = start_us;
+  int64_t next_disconnect_us =
+      start_us + (int64_t)config_.disconnect_interval_ms * 1000;
+  uint32_t seq = 0;
+  for (;;) {
+    int64_t now = esp_timer_get_time();
+    if (now >= end_us) {
+      break;
+    }
+    if (config_.disconnect_interval_ms > 0 && injector_ &&
+        now >= next_disconnect_us) {
+      injector_();
+      ++report.disconnects;
+      next_disconnect_us += (int64_t)config_.disconnect_interval_ms * 1000;
+    }
+    // rates above the tick rate publish several messages per wakeup
+    while (now >= next_us && next_us < end_us) {
+      std::memcpy(payload.Data(), &now, sizeof(now));
+      std::memcpy(payload.Data() + sizeof(now), &seq, sizeof(seq));
+      ++seq;
+      ++report.attempted;
+      if (client_->AsyncPublish(config_.topic.c_str(),
+                                (const char*)payload.Data(), payload.Size(),
+                                config_.qos, 0)) {
+        ++report.published;
+        report.bytes_out += payload.Size();
+      } else {
+        ++report.failed;
+      }
+      next_us += interval_us;
+    }
+    int64_t wait_ms = (next_us - esp_timer_get_time()) / 1000;
+    TickType_t wait = wait_ms > 0 ? pdMS_TO_TICKS((uint32_t)wait_ms) : 0;
+    vTaskDelay(wait > 0 ? wait : 1);
+  }
+  report.duration_ms = (uint32_t)((esp_timer_get_time() - start_us) / 1000);
+  DelayMS(config_.drain_ms);
+
+  if (config_.measure_round_trip) {
+    client_->Unsubscribe(config_.topic.c_str());
+    client_->SetOnReceiveMsgCallback(std::move(previous_callback_));
+    previous_callback_ = nullptr;
+  }
+  report.client = client_->GetMetrics();
+  report.received = received_;
+  mutex_.Lock();
+  report.round_trip = round_trip_;
+  mutex_.Unlock();
+  if (report.duration_ms > 0) {
+    report.publish_per_sec = report.published * 1000.0f / report.duration_ms;
+    report.receive_per_sec = report.received * 1000.0f / report.duration_ms;
+  }
+  return report;
+}
+
+void MqttLoadGenerator::LogReport(const Report& report) {
+  ESP_LOGI(TAG,
+           "%u ms: attempted %u, published %u, failed %u, received %u, "
+           "disconnects %u, reconnects %u",
+           report.duration_ms, report.attempted, report.published,
+           report.failed, report.received, report.disconnects,
+           report.client.reconnect_count);
+  ESP_LOGI(TAG, "throughput: publish %.1f msg/s, receive %.1f msg/s, %llu B",
+           report.publish_per_sec, report.receive_per_sec,
+           (unsigned long long)report.bytes_out);
+  const struct {
+    const char* name;
+    const LatencyHistogram* histogram;
+  } latencies[] = {
+      {"round trip", &report.round_trip},
+      {"qos1 ack", &report.client.qos1_latency},
+      {"qos2 ack", &report.client.qos2_latency},
+  };
+  for (const auto& latency : latencies) {
+    const auto* histogram = latency.histogram;
+    if (histogram->count == 0) {
+      continue;
+    }
+    ESP_LOGI(TAG, "%s latency: avg %u ms, p50 <%u ms, p99 <%u ms, max %u ms",
+             latency.name, histogram->AverageMS(), histogram->PercentileMS(50),
+             histogram->PercentileMS(99), histogram->max_ms);
+  }
+}
+
+}  // namespace esp
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "mqtt_client_wrapper.h"
+#include "util/latency_histogram.h"
+#include "util/mutex.h"
+
+namespace esp {
+
+// drives a started MqttClient at a fixed message rate, payload size and qos
+// and reports throughput and latency, optionally injecting disconnects.
+// pair it with MqttLoopbackBroker to benchmark mqtt changes on the device
+// without a real broker:
+//   broker.Start();
+//   client.Start();
+//   MqttLoadGenerator generator(&client, {});
+//   generator.SetDisconnectInjector([&]() { broker.DropConnections(); });
+//   MqttLoadGenerator::LogReport(generator.Run());
+class MqttLoadGenerator {
+ public:
+  using DisconnectInjector = std::function<void()>;
+
+  struct Config {
+    std::string topic{"load/test"};
+    uint32_t messages_per_sec{50};
+    // at least 12 bytes, send time and sequence number go first
+    size_t payload_size{64};
+    int32_t qos{1};
+    uint32_t duration_ms{10000};
+    // 0 disables injected disconnects
+    uint32_t disconnect_interval_ms{0};
+    // subscribe to the topic and measure publish to receive latency, the
+    // broker must deliver our own messages back. Run wraps the client
+    // receive callback, other topics still reach the previous callback,
+    // and restores it when done
+    bool measure_round_trip{true};
+    // time to wait for the last messages to come back
+    uint32_t drain_ms{1000};
+  };
+
+  struct Report {
+    uint32_t duration_ms{0};
+    uint32_t attempted{0};
+    uint32_t published{0};
+    uint32_t failed{0};
+    uint32_t received{0};
+    uint32_t disconnects{0};
+    uint64_t bytes_out{0};
+    float publish_per_sec{0};
+    float receive_per_sec{0};
+    LatencyHistogram round_trip;
+    // client metrics of the run, qos 1/2 ack latency and reconnects
+    MqttClient::Metrics client;
+  };
+
+  MqttLoadGenerator(MqttClient* client, Config config);
+
+  void SetDisconnectInjector(DisconnectInjector injector);
+
+  // blocks the calling task for duration_ms plus drain_ms
+  Report Run();
+
+  static void LogReport(const Report& report);
+
+ private:
+  void OnReceive(std::string_view topic, std::string_view payload);
+
+  MqttClient* client_;
+  Config config_;
+  DisconnectInjector injector_;
+  // the app callback while Run owns the client, other topics go to it
+  MqttClient::OnReceiveMsgCallback previous_callback_;
+  Mutex mutex_;
+  LatencyHistogram round_trip_;
+  std::atomic<uint32_t> received_{0};
+};
+
+}  // namespace esp
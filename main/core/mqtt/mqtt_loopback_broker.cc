@@ -0,0 +1,485 @@
+
+#include "mqtt_loopback_broker.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "mqtt_event_bridge.h"
+#include "util/buffer_pool.h"
+
+static const char* TAG = "mqtt_loopback";
+
+#define MAX_SESSIONS 4
+#define MAX_PACKET_SIZE (16 * 1024)
+#define MAX_SUBSCRIBE_FILTERS 16
+#define RECV_CHUNK_SIZE 512
+// per session, beyond this the subscriber is dropped
+#define MAX_TX_QUEUE_SIZE (32 * 1024)
+#define SELECT_TIMEOUT_MS 100
+#define BROKER_TASK_STACK_SIZE 4096
+#define BROKER_TASK_PRIORITY 5
+
+#define PACKET_CONNECT 1
+#define PACKET_CONNACK 2
+#define PACKET_PUBLISH 3
+#define PACKET_PUBACK 4
+#define PACKET_PUBREC 5
+#define PACKET_PUBREL 6
+#define PACKET_PUBCOMP 7
+#define PACKET_SUBSCRIBE 8
+#define PACKET_SUBACK 9
+#define PACKET_UNSUBSCRIBE 10
+#define PACKET_UNSUBACK 11
+#define PACKET_PINGREQ 12
+#define PACKET_PINGRESP 13
+#define PACKET_DISCONNECT 14
+
+namespace esp {
+
+static void BrokerTask(void* args) {
+  auto self = (MqttLoopbackBroker*)args;
+  if (self) {
+    self->Run();
+  }
+}
+
+// mqtt utf-8 string, u16 big endian length prefix
+static bool ReadString(const uint8_t* body, size_t len, size_t& pos,
+                       std::string_view& out) {
+  if (pos + 2 > len) {
+    return false;
+  }
+  size_t str_len = (body[pos] << 8) | body[pos + 1];
+  pos += 2;
+  if (pos + str_len > len) {
+    return false;
+  }
+  out = std::string_view((const char*)body + pos, str_len);
+  pos += str_len;
+  return true;
+}
+
+// fixed header plus remaining length, returns the header size
+static size_t WriteHeader(uint8_t* out, uint8_t header, size_t remaining) {
+  size_t len = 0;
+  out[len++] = header;
+  do {
+    uint8_t digit = remaining & 0x7f;
+    remaining >>= 7;
+    out[len++] = remaining > 0 ? (digit | 0x80) : digit;
+  } while (remaining > 0);
+  return len;
+}
+
+MqttLoopbackBroker::MqttLoopbackBroker(uint16_t port) : port_(port) {}
+
+MqttLoopbackBroker::~MqttLoopbackBroker() { Stop(); }
+
+bool MqttLoopbackBroker::Start() {
+  if (task_handle_) {
+    return true;
+  }
+  listen_fd_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listen_fd_ < 0) {
+    ESP_LOGE(TAG, "create socket failed");
+    return false;
+  }
+  int reuse = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port_);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(listen_fd_, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(listen_fd_, MAX_SESSIONS) != 0) {
+    ESP_LOGE(TAG, "listen on port %u failed", port_);
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  exit_ = false;
+  exit_sem_ = xSemaphoreCreateBinary();
+  TaskHandle_t task = nullptr;
+  auto ret = xTaskCreate(BrokerTask, "mqtt_loopback", BROKER_TASK_STACK_SIZE,
+                         (void*)this, BROKER_TASK_PRIORITY, &task);
+  if (ret != pdPASS) {
+    ESP_LOGE(TAG, "start broker task failed");
+    vSemaphoreDelete((SemaphoreHandle_t)exit_sem_);
+    exit_sem_ = nullptr;
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  task_handle_ = task;
+  ESP_LOGI(TAG, "loopback broker listen on port %u", port_);
+  return true;
+}
+
+void MqttLoopbackBroker::Stop() {
+  if (!task_handle_) {
+    return;
+  }
+  exit_ = true;
+  xSemaphoreTake((SemaphoreHandle_t)exit_sem_, portMAX_DELAY);
+  vSemaphoreDelete((SemaphoreHandle_t)exit_sem_);
+  exit_sem_ = nullptr;
+  task_handle_ = nullptr;
+}
+
+void MqttLoopbackBroker::DropConnections() { drop_ = true; }
+
+MqttLoopbackBroker::Stats MqttLoopbackBroker::GetStats() {
+  stats_mutex_.Lock();
+  auto stats = stats_;
+  stats_mutex_.Unlock();
+  return stats;
+}
+
+void MqttLoopbackBroker::Run() {
+  while (!exit_) {
+    if (drop_.exchange(false)) {
+      while (!sessions_.empty()) {
+        CloseSession(sessions_.size() - 1);
+        stats_mutex_.Lock();
+        ++stats_.dropped_connections;
+        stats_mutex_.Unlock();
+      }
+    }
+    fd_set read_fds;
+    fd_set write_fds;
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    FD_SET(listen_fd_, &read_fds);
+    int max_fd = listen_fd_;
+    for (const auto& session : sessions_) {
+      FD_SET(session.fd, &read_fds);
+      if (!session.tx.empty()) {
+        FD_SET(session.fd, &write_fds);
+      }
+      if (session.fd > max_fd) {
+        max_fd = session.fd;
+      }
+    }
+    struct timeval timeout = {0, SELECT_TIMEOUT_MS * 1000};
+    int ready = select(max_fd + 1, &read_fds, &write_fds, nullptr, &timeout);
+    if (ready <= 0) {
+      continue;
+    }
+    if (FD_ISSET(listen_fd_, &read_fds)) {
+      Accept();
+    }
+    for (auto& session : sessions_) {
+      if (FD_ISSET(session.fd, &write_fds) && !Flush(session)) {
+        session.failed = true;
+      }
+      if (!session.failed && FD_ISSET(session.fd, &read_fds) &&
+          !Receive(session)) {
+        session.failed = true;
+      }
+    }
+    // routing may fail any session, not only the one being read
+    for (size_t i = sessions_.size(); i > 0; --i) {
+      if (sessions_[i - 1].failed) {
+        CloseSession(i - 1);
+      }
+    }
+  }
+  while (!sessions_.empty()) {
+    CloseSession(sessions_.size() - 1);
+  }
+  close(listen_fd_);
+  listen_fd_ = -1;
+  xSemaphoreGive((SemaphoreHandle_t)exit_sem_);
+  vTaskDelete(NULL);
+}
+
+bool MqttLoopbackBroker::Accept() {
+  int fd = accept(listen_fd_, nullptr, nullptr);
+  if (fd < 0) {
+    return false;
+  }
+  if (sessions_.size() == MAX_SESSIONS) {
+    ESP_LOGW(TAG, "too many sessions, reject");
+    close(fd);
+    return false;
+  }
+  int nodelay = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  sessions_.push_back({fd, false, {}, {}, {}, false});
+  return true;
+}
+
+void MqttLoopbackBroker::CloseSession(size_t index) {
+  close(sessions_[index].fd);
+  sessions_.erase(sessions_.begin() + index);
+}
+
+bool MqttLoopbackBroker::Send(Session& session, const uint8_t* data,
+                              size_t len) {
+  if (session.failed) {
+    return false;
+  }
+  size_t sent = 0;
+  // keep the byte order, nothing jumps ahead of queued data
+  while (session.tx.empty() && sent < len) {
+    int ret = send(session.fd, data + sent, len - sent, MSG_DONTWAIT);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (ret <= 0) {
+      session.failed = true;
+      return false;
+    }
+    sent += ret;
+  }
+  if (sent < len) {
+    if (session.tx.size() + len - sent > MAX_TX_QUEUE_SIZE) {
+      ESP_LOGW(TAG, "session tx queue full, drop slow consumer");
+      stats_mutex_.Lock();
+      ++stats_.slow_consumers;
+      stats_mutex_.Unlock();
+      session.failed = true;
+      return false;
+    }
+    session.tx.insert(session.tx.end(), data + sent, data + len);
+  }
+  stats_mutex_.Lock();
+  stats_.bytes_out += len;
+  stats_mutex_.Unlock();
+  return true;
+}
+
+bool MqttLoopbackBroker::Flush(Session& session) {
+  size_t sent = 0;
+  while (sent < session.tx.size()) {
+    int ret = send(session.fd, session.tx.data() + sent,
+                   session.tx.size() - sent, MSG_DONTWAIT);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (ret <= 0) {
+      return false;
+    }
+    sent += ret;
+  }
+  session.tx.erase(session.tx.begin(), session.tx.begin() + sent);
+  return true;
+}
+
+bool MqttLoopbackBroker::Receive(Session& session) {
+  uint8_t chunk[RECV_CHUNK_SIZE];
+  int len = recv(session.fd, chunk, sizeof(chunk), 0);
+  if (len <= 0) {
+    return false;
+  }
+  stats_mutex_.Lock();
+  stats_.bytes_in += len;
+  stats_mutex_.Unlock();
+  session.rx.insert(session.rx.end(), chunk, chunk + len);
+
+  // dispatch every complete packet in the rx buffer
+  size_t pos = 0;
+  while (pos < session.rx.size()) {
+    size_t remaining = 0;
+    size_t header_len = 1;
+    bool complete = false;
+    for (size_t shift = 0; shift < 28; shift += 7) {
+      if (pos + header_len >= session.rx.size()) {
+        break;
+      }
+      uint8_t digit = session.rx[pos + header_len++];
+      remaining |= (size_t)(digit & 0x7f) << shift;
+      if (!(digit & 0x80)) {
+        complete = true;
+        break;
+      }
+    }
+    if (!complete) {
+      if (header_len == 5) {
+        // malformed remaining length
+        return false;
+      }
+      break;
+    }
+    if (remaining > MAX_PACKET_SIZE) {
+      ESP_LOGW(TAG, "packet too large:%u", (unsigned)remaining);
+      return false;
+    }
+    if (pos + header_len + remaining > session.rx.size()) {
+      break;
+    }
+    if (!HandlePacket(session, session.rx[pos],
+                      session.rx.data() + pos + header_len, remaining)) {
+      return false;
+    }
+    pos += header_len + remaining;
+  }
+  session.rx.erase(session.rx.begin(), session.rx.begin() + pos);
+  return true;
+}
+
+bool MqttLoopbackBroker::HandlePacket(Session& session, uint8_t header,
+                                      const uint8_t* body, size_t len) {
+  uint8_t type = header >> 4;
+  if (!session.connected && type != PACKET_CONNECT) {
+    return false;
+  }
+  uint8_t ack[4];
+  size_t pos = 0;
+  switch (type) {
+    case PACKET_CONNECT: {
+      std::string_view protocol;
+      if (session.connected || !ReadString(body, len, pos, protocol) ||
+          protocol != "MQTT" || pos >= len || body[pos] != 4) {
+        return false;
+      }
+      session.connected = true;
+      stats_mutex_.Lock();
+      ++stats_.connections;
+      stats_mutex_.Unlock();
+      // no session present, accepted
+      uint8_t connack[] = {PACKET_CONNACK << 4, 2, 0, 0};
+      return Send(session, connack, sizeof(connack));
+    }
+    case PACKET_PUBLISH: {
+      uint8_t qos = (header >> 1) & 0x03;
+      std::string_view topic;
+      if (qos > 2 || !ReadString(body, len, pos, topic)) {
+        return false;
+      }
+      uint16_t packet_id = 0;
+      if (qos > 0) {
+        if (pos + 2 > len) {
+          return false;
+        }
+        packet_id = (body[pos] << 8) | body[pos + 1];
+        pos += 2;
+      }
+      stats_mutex_.Lock();
+      ++stats_.publishes_in;
+      stats_mutex_.Unlock();
+      Route(topic, std::string_view((const char*)body + pos, len - pos));
+      if (qos == 0) {
+        return true;
+      }
+      ack[0] = (qos == 1 ? PACKET_PUBACK : PACKET_PUBREC) << 4;
+      ack[1] = 2;
+      ack[2] = packet_id >> 8;
+      ack[3] = packet_id & 0xff;
+      return Send(session, ack, sizeof(ack));
+    }
+    case PACKET_PUBREL:
+      if (len < 2) {
+        return false;
+      }
+      ack[0] = PACKET_PUBCOMP << 4;
+      ack[1] = 2;
+      ack[2] = body[0];
+      ack[3] = body[1];
+      return Send(session, ack, sizeof(ack));
+    case PACKET_PUBACK:
+    case PACKET_PUBREC:
+    case PACKET_PUBCOMP:
+      // everything is delivered at qos 0, nothing to ack
+      return true;
+    case PACKET_SUBSCRIBE:
+    case PACKET_UNSUBSCRIBE: {
+      if (len < 2) {
+        return false;
+      }
+      bool subscribe = type == PACKET_SUBSCRIBE;
+      pos = 2;
+      // fixed header, packet id and one return code per filter
+      uint8_t reply[5 + 2 + MAX_SUBSCRIBE_FILTERS];
+      size_t count = 0;
+      std::string_view filter;
+      while (pos < len) {
+        if (!ReadString(body, len, pos, filter)) {
+          return false;
+        }
+        if (subscribe) {
+          // requested qos, granted 0
+          if (pos++ >= len || count == MAX_SUBSCRIBE_FILTERS) {
+            return false;
+          }
+          session.filters.emplace_back(filter);
+          ++count;
+        } else {
+          for (size_t i = 0; i < session.filters.size(); ++i) {
+            if (session.filters[i] == filter) {
+              session.filters.erase(session.filters.begin() + i);
+              break;
+            }
+          }
+        }
+      }
+      size_t reply_len = WriteHeader(
+          reply, subscribe ? (PACKET_SUBACK << 4) : (PACKET_UNSUBACK << 4),
+          2 + count);
+      reply[reply_len++] = body[0];
+      reply[reply_len++] = body[1];
+      memset(reply + reply_len, 0, count);
+      return Send(session, reply, reply_len + count);
+    }
+    case PACKET_PINGREQ:
+      ack[0] = PACKET_PINGRESP << 4;
+      ack[1] = 0;
+      return Send(session, ack, 2);
+    case PACKET_DISCONNECT:
+      return false;
+    default:
+      ESP_LOGW(TAG, "unexpected packet type:%u", type);
+      return false;
+  }
+}
+
+void MqttLoopbackBroker::Route(std::string_view topic,
+                               std::string_view payload) {
+  PooledBuffer packet;
+  for (auto& session : sessions_) {
+    if (session.failed) {
+      continue;
+    }
+    bool matched = false;
+    for (const auto& filter : session.filters) {
+      if (MqttEventBridge::TopicMatches(filter, topic)) {
+        matched = true;
+        break;
+      }
+    }
+    if (!matched) {
+      continue;
+    }
+    // built once, on the first matching subscriber
+    if (!packet.Valid()) {
+      size_t remaining = 2 + topic.size() + payload.size();
+      packet = BufferPool::Instance()->Acquire(5 + remaining);
+      if (!packet.Valid()) {
+        ESP_LOGW(TAG, "no memory to route msg to topic:%.*s",
+                 (int)topic.size(), topic.data());
+        return;
+      }
+      uint8_t header[7];
+      size_t header_len = WriteHeader(header, PACKET_PUBLISH << 4, remaining);
+      header[header_len++] = (uint8_t)(topic.size() >> 8);
+      header[header_len++] = (uint8_t)(topic.size() & 0xff);
+      packet.Append(header, header_len);
+      packet.Append(topic.data(), topic.size());
+      packet.Append(payload.data(), payload.size());
+    }
+    // a failed session is closed by Run after this round
+    if (Send(session, packet.Data(), packet.Size())) {
+      stats_mutex_.Lock();
+      ++stats_.publishes_out;
+      stats_mutex_.Unlock();
+    }
+  }
+}
+
+}  // namespace esp
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "util/mutex.h"
+
+namespace esp {
+
+// minimal mqtt 3.1.1 broker listening on the lwip loopback interface, so
+// MqttClient can be driven under load on the device without a real broker:
+//   MqttLoopbackBroker broker(1883);
+//   broker.Start();
+//   MqttClient client("mqtt://127.0.0.1:1883", "load", true, true);
+// handles CONNECT, PUBLISH qos 0/1/2, SUBSCRIBE, UNSUBSCRIBE, PINGREQ and
+// DISCONNECT. messages are routed to matching subscribers at qos 0, there
+// are no retained messages, wills or persistent sessions. sends never
+// block the broker task: what the socket does not take is queued per
+// session and flushed when it turns writable, a session whose queue
+// outgrows the limit is closed as a slow consumer
+class MqttLoopbackBroker {
+ public:
+  struct Stats {
+    uint32_t connections{0};
+    uint32_t dropped_connections{0};
+    uint32_t publishes_in{0};
+    uint32_t publishes_out{0};
+    // sessions closed because their tx queue overflowed
+    uint32_t slow_consumers{0};
+    uint64_t bytes_in{0};
+    uint64_t bytes_out{0};
+  };
+
+  explicit MqttLoopbackBroker(uint16_t port);
+
+  ~MqttLoopbackBroker();
+
+  bool Start();
+
+  void Stop();
+
+  // close every client connection from the broker side, to exercise the
+  // client reconnect path
+  void DropConnections();
+
+  Stats GetStats();
+
+  void Run();
+
+ private:
+  struct Session {
+    int fd;
+    bool connected;
+    std::vector<uint8_t> rx;
+    // bytes the socket did not take yet
+    std::vector<uint8_t> tx;
+    std::vector<std::string> filters;
+    // a send failed or tx overflowed, closed by Run
+    bool failed;
+  };
+
+  bool Accept();
+
+  // false when the session must be closed
+  bool Receive(Session& session);
+
+  bool HandlePacket(Session& session, uint8_t header, const uint8_t* body,
+                    size_t len);
+
+  void Route(std::string_view topic, std::string_view payload);
+
+  // queues what the socket does not take, false when the session failed
+  bool Send(Session& session, const uint8_t* data, size_t len);
+
+  // write queued bytes, false when the session must be closed
+  bool Flush(Session& session);
+
+  void CloseSession(size_t index);
+
+  uint16_t port_;
+  int listen_fd_{-1};
+  std::vector<Session> sessions_;
+  std::atomic<bool> drop_{false};
+  std::atomic<bool> exit_{false};
+  void* task_handle_{nullptr};
+  void* exit_sem_{nullptr};
+  Mutex stats_mutex_;
+  Stats stats_;
+};
+
+}  // namespace esp
@@ -0,0 +1,466 @@
+
+#include "mqtt_offline_queue.h"
+
+#include <cstddef>
+#include <cstring>
+#include <utility>
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "mqtt_client_wrapper.h"
+#include "util/buffer_pool.h"
+#include "util/delay.h"
+
+static const char* TAG = "mqtt_offline_queue";
+
+#define SECTOR_SIZE SPI_FLASH_SEC_SIZE
+#define RECORD_MAGIC 0x4d51
+#define RECORD_PENDING 0xffffffff
+#define RECORD_REPLAYED 0
+#define RECORD_ALIGN 4
+#define CRC_CHUNK_SIZE 64
+
+#define PARTITION ((const esp_partition_t*)partition_)
+
+namespace esp {
+
+// a record never crosses a sector, it is written header first so a torn
+// write shows up as a crc mismatch, state is cleared in place once replayed
+struct RecordHeader {
+  uint16_t magic;
+  uint16_t topic_len;
+  uint16_t payload_len;
+  uint8_t qos;
+  uint8_t retain;
+  uint32_t seq;
+  uint32_t crc;
+  uint32_t state;
+};
+
+static uint32_t RecordSize(const RecordHeader& header) {
+  uint32_t size = sizeof(RecordHeader) + header.topic_len + header.payload_len;
+  return (size + RECORD_ALIGN - 1) / RECORD_ALIGN * RECORD_ALIGN;
+}
+
+static size_t Address(uint32_t sector, uint32_t offset) {
+  return (size_t)sector * SECTOR_SIZE + offset;
+}
+
+// false when there is no complete record header at offset
+static bool ReadHeader(const esp_partition_t* partition, uint32_t sector,
+                       uint32_t offset, RecordHeader& header) {
+  if (offset + sizeof(RecordHeader) > SECTOR_SIZE) {
+    return false;
+  }
+  if (esp_partition_read(partition, Address(sector, offset), &header,
+                         sizeof(header)) != ESP_OK) {
+    return false;
+  }
+  return header.magic == RECORD_MAGIC &&
+         offset + RecordSize(header) <= SECTOR_SIZE;
+}
+
+static bool CheckRecordCrc(const esp_partition_t* partition, uint32_t sector,
+                           uint32_t offset, const RecordHeader& header) {
+  uint8_t chunk[CRC_CHUNK_SIZE];
+  size_t address = Address(sector, offset) + sizeof(RecordHeader);
+  size_t left = header.topic_len + header.payload_len;
+  uint32_t crc = 0;
+  while (left > 0) {
+    size_t len = left < sizeof(chunk) ? left : sizeof(chunk);
+    if (esp_partition_read(partition, address, chunk, len) != ESP_OK) {
+      return false;
+    }
+    crc = esp_rom_crc32_le(crc, chunk, len);
+    address += len;
+    left -= len;
+  }
+  return crc == header.crc;
+}
+
+static bool IsBlank(const esp_partition_t* partition, uint32_t sector,
+                    uint32_t offset) {
+  if (offset + sizeof(uint32_t) > SECTOR_SIZE) {
+    return true;
+  }
+  uint32_t word = 0;
+  if (esp_partition_read(partition, Address(sector, offset), &word,
+                         sizeof(word)) != ESP_OK) {
+    return false;
+  }
+  return word == 0xffffffff;
+}
+
+static void ReplayTask(void* args) {
+  auto self = (MqttOfflineQueue*)args;
+  if (self) {
+    self->ReplayLoop();
+  }
+}
+
+MqttOfflineQueue::MqttOfflineQueue(Config config)
+    : config_(std::move(config)) {}
+
+MqttOfflineQueue::~MqttOfflineQueue() {
+  if (task_handle_) {
+    exit_ = true;
+    Replay();
+    xSemaphoreTake((SemaphoreHandle_t)exit_sem_, portMAX_DELAY);
+  }
+  if (wakeup_sem_) {
+    vSemaphoreDelete((SemaphoreHandle_t)wakeup_sem_);
+  }
+  if (exit_sem_) {
+    vSemaphoreDelete((SemaphoreHandle_t)exit_sem_);
+  }
+}
+
+bool MqttOfflineQueue::Init() {
+  if (partition_) {
+    return true;
+  }
+  auto partition =
+      esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                               ESP_PARTITION_SUBTYPE_ANY,
+                               config_.partition_label.c_str());
+  if (!partition) {
+    ESP_LOGE(TAG, "partition:%s not found", config_.partition_label.c_str());
+    return false;
+  }
+  if (partition->size / SECTOR_SIZE < 2) {
+    ESP_LOGE(TAG, "partition:%s too small", config_.partition_label.c_str());
+    return false;
+  }
+  partition_ = partition;
+  sector_count_ = partition->size / SECTOR_SIZE;
+  if (!ScanLog()) {
+    partition_ = nullptr;
+    return false;
+  }
+
+  wakeup_sem_ = xSemaphoreCreateBinary();
+  exit_sem_ = xSemaphoreCreateBinary();
+  TaskHandle_t task = nullptr;
+  auto ret = xTaskCreate(ReplayTask, "mqtt_replay", config_.task_stack_size,
+                         (void*)this, config_.task_priority, &task);
+  if (ret != pdPASS) {
+    ESP_LOGE(TAG, "start replay task failed");
+    vSemaphoreDelete((SemaphoreHandle_t)wakeup_sem_);
+    vSemaphoreDelete((SemaphoreHandle_t)exit_sem_);
+    wakeup_sem_ = nullptr;
+    exit_sem_ = nullptr;
+    partition_ = nullptr;
+    return false;
+  }
+  task_handle_ = task;
+  ESP_LOGI(TAG, "offline queue init, %u sectors, %u pending", sector_count_,
+           stats_.pending);
+  return true;
+}
+
+bool MqttOfflineQueue::ScanLog() {
+  // the sector written last has the largest first seq
+  bool found = false;
+  uint32_t head = 0;
+  uint32_t head_seq = 0;
+  for (uint32_t sector = 0; sector < sector_count_; ++sector) {
+    RecordHeader header;
+    if (ReadHeader(PARTITION, sector, 0, header) &&
+        (!found || header.seq > head_seq)) {
+      head = sector;
+      head_seq = header.seq;
+      found = true;
+    }
+  }
+  if (!found) {
+    read_pos_ = write_pos_ = Position();
+    next_seq_ = 0;
+    if (!IsBlank(PARTITION, 0, 0)) {
+      return OpenSector(0);
+    }
+    return true;
+  }
+
+  // walk the log oldest sector first, ending with the head sector
+  bool has_pending = false;
+  next_seq_ = head_seq + 1;
+  for (uint32_t i = 1; i <= sector_count_; ++i) {
+    uint32_t sector = (head + i) % sector_count_;
+    uint32_t offset = 0;
+    RecordHeader header;
+    while (ReadHeader(PARTITION, sector, offset, header) &&
+           CheckRecordCrc(PARTITION, sector, offset, header)) {
+      if (header.seq >= next_seq_) {
+        next_seq_ = header.seq + 1;
+      }
+      if (header.state == RECORD_PENDING) {
+        if (!has_pending) {
+          read_pos_ = {sector, offset};
+          has_pending = true;
+        }
+        ++stats_.pending;
+      }
+      offset += RecordSize(header);
+    }
+    if (sector == head) {
+      write_pos_ = {sector, offset};
+      if (!IsBlank(PARTITION, sector, offset)) {
+        // torn write, continue in the next sector
+        ESP_LOGW(TAG, "found torn record at sector:%u offset:%u", sector,
+                 offset);
+        write_pos_.offset = SECTOR_SIZE;
+      }
+    }
+  }
+  if (!has_pending) {
+    read_pos_ = write_pos_;
+  }
+  return true;
+}
+
+bool MqttOfflineQueue::OpenSector(uint32_t sector) {
+  // log is full, drop the oldest messages
+  if (stats_.pending > 0 && read_pos_.sector == sector) {
+    uint32_t offset = read_pos_.offset;
+    uint32_t dropped = 0;
+    RecordHeader header;
+    while (ReadHeader(PARTITION, sector, offset, header)) {
+      if (header.state == RECORD_PENDING) {
+        ++dropped;
+      }
+      offset += RecordSize(header);
+    }
+    if (dropped > stats_.pending) {
+      dropped = stats_.pending;
+    }
+    stats_.pending -= dropped;
+    stats_.dropped += dropped;
+    read_pos_ = {(sector + 1) % sector_count_, 0};
+    ESP_LOGW(TAG, "offline queue full, drop %u oldest messages", dropped);
+  }
+  auto ret = esp_partition_erase_range(PARTITION, Address(sector, 0),
+                                       SECTOR_SIZE);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "erase sector:%u failed:%s", sector, esp_err_to_name(ret));
+    return false;
+  }
+  ++stats_.sector_erases;
+  write_pos_ = {sector, 0};
+  if (stats_.pending == 0) {
+    read_pos_ = write_pos_;
+  }
+  return true;
+}
+
+bool MqttOfflineQueue::Append(const char* topic, const char* data,
+                              int32_t len, int32_t qos, int32_t retain) {
+  if (!partition_ || !topic || len < 0) {
+    return false;
+  }
+  size_t topic_len = strlen(topic);
+  RecordHeader header{};
+  header.magic = RECORD_MAGIC;
+  header.topic_len = (uint16_t)topic_len;
+  header.payload_len = (uint16_t)len;
+  header.qos = (uint8_t)qos;
+  header.retain = (uint8_t)retain;
+  header.state = RECORD_PENDING;
+  uint32_t size = RecordSize(header);
+  if (topic_len > 0xffff || len > 0xffff || size > SECTOR_SIZE) {
+    ESP_LOGW(TAG, "msg to topic:%s too large for offline queue", topic);
+    return false;
+  }
+  header.crc = esp_rom_crc32_le(0, (const uint8_t*)topic, topic_len);
+  header.crc = esp_rom_crc32_le(header.crc, (const uint8_t*)data, len);
+
+  bool success = false;
+  mutex_.Lock();
+  if (write_pos_.offset + size > SECTOR_SIZE &&
+      !OpenSector((write_pos_.sector + 1) % sector_count_)) {
+    mutex_.Unlock();
+    return false;
+  }
+  header.seq = next_seq_;
+  size_t address = Address(write_pos_.sector, write_pos_.offset);
+  esp_err_t ret = esp_partition_write(PARTITION, address, &header,
+                                      sizeof(header));
+  if (ret == ESP_OK) {
+    ret = esp_partition_write(PARTITION, address + sizeof(header), topic,
+                              topic_len);
+  }
+  if (ret == ESP_OK && len > 0) {
+    ret = esp_partition_write(
+        PARTITION, address + sizeof(header) + topic_len, data, len);
+  }
+  if (ret == ESP_OK) {
+    if (stats_.pending == 0) {
+      read_pos_ = write_pos_;
+    }
+    write_pos_.offset += size;
+    ++next_seq_;
+    ++stats_.pending;
+    ++stats_.appended;
+    success = true;
+  } else {
+    // never write over a partly programmed area
+    ESP_LOGE(TAG, "write record failed:%s", esp_err_to_name(ret));
+    write_pos_.offset = SECTOR_SIZE;
+  }
+  mutex_.Unlock();
+  // publishes keep coming here while older ones are queued, the replay
+  // task may have stopped after a failed publish
+  if (success && client_ && client_->IsReady()) {
+    Replay();
+  }
+  return success;
+}
+
+bool MqttOfflineQueue::Empty() {
+  mutex_.Lock();
+  bool empty = stats_.pending == 0;
+  mutex_.Unlock();
+  return empty;
+}
+
+void MqttOfflineQueue::Replay() {
+  if (wakeup_sem_) {
+    xSemaphoreGive((SemaphoreHandle_t)wakeup_sem_);
+  }
+}
+
+MqttOfflineQueue::Stats MqttOfflineQueue::GetStats() {
+  mutex_.Lock();
+  Stats stats = stats_;
+  mutex_.Unlock();
+  return stats;
+}
+
+void MqttOfflineQueue::Attach(MqttClient* client) { client_ = client; }
+
+void MqttOfflineQueue::AdvanceRead(uint32_t record_size) {
+  --stats_.pending;
+  if (stats_.pending == 0) {
+    read_pos_ = write_pos_;
+    return;
+  }
+  read_pos_.offset += record_size;
+  RecordHeader header;
+  if (read_pos_.sector != write_pos_.sector &&
+      !ReadHeader(PARTITION, read_pos_.sector, read_pos_.offset, header)) {
+    read_pos_ = {(read_pos_.sector + 1) % sector_count_, 0};
+  }
+}
+
+bool MqttOfflineQueue::ReplayOne() {
+  mutex_.Lock();
+  if (stats_.pending == 0 || !client_ || !client_->IsReady()) {
+    mutex_.Unlock();
+    return false;
+  }
+  Position pos = read_pos_;
+  RecordHeader header;
+  if (!ReadHeader(PARTITION, pos.sector, pos.offset, header)) {
+    if (pos.sector == write_pos_.sector) {
+      ESP_LOGE(TAG, "offline queue corrupted, drop %u messages",
+               stats_.pending);
+      stats_.dropped += stats_.pending;
+      stats_.pending = 0;
+      read_pos_ = write_pos_;
+    } else {
+      read_pos_ = {(pos.sector + 1) % sector_count_, 0};
+    }
+    mutex_.Unlock();
+    return true;
+  }
+  uint32_t size = RecordSize(header);
+  if (header.state != RECORD_PENDING) {
+    read_pos_.offset += size;
+    mutex_.Unlock();
+    return true;
+  }
+  // [topic]['\0'][payload]
+  auto buffer = BufferPool::Instance()->Acquire(header.topic_len + 1 +
+                                                header.payload_len);
+  if (!buffer.Valid()) {
+    mutex_.Unlock();
+    return false;
+  }
+  size_t address = Address(pos.sector, pos.offset) + sizeof(header);
+  auto data = buffer.Data();
+  bool valid =
+      esp_partition_read(PARTITION, address, data, header.topic_len) ==
+          ESP_OK &&
+      esp_partition_read(PARTITION, address + header.topic_len,
+                         data + header.topic_len + 1,
+                         header.payload_len) == ESP_OK;
+  data[header.topic_len] = 0;
+  if (valid) {
+    uint32_t crc = esp_rom_crc32_le(0, data, header.topic_len);
+    crc = esp_rom_crc32_le(crc, data + header.topic_len + 1,
+                           header.payload_len);
+    valid = crc == header.crc;
+  }
+  mutex_.Unlock();
+
+  if (valid && !client_->DoPublish((const char*)data,
+                                   (const char*)data + header.topic_len + 1,
+                                   header.payload_len, header.qos,
+                                   header.retain)) {
+    return false;
+  }
+  if (!valid) {
+    ESP_LOGW(TAG, "drop corrupted record at sector:%u offset:%u", pos.sector,
+             pos.offset);
+  }
+
+  mutex_.Lock();
+  // the record may have been dropped by Append meanwhile
+  if (stats_.pending > 0 && read_pos_ == pos) {
+    uint32_t state = RECORD_REPLAYED;
+    esp_partition_write(PARTITION,
+                        Address(pos.sector, pos.offset) +
+                            offsetof(RecordHeader, state),
+                        &state, sizeof(state));
+    AdvanceRead(size);
+    if (valid) {
+      ++stats_.replayed;
+    } else {
+      ++stats_.dropped;
+    }
+  }
+  mutex_.Unlock();
+  return true;
+}
+
+void MqttOfflineQueue::ReplayLoop() {
+  TickType_t wait = portMAX_DELAY;
+  for (;;) {
+    xSemaphoreTake((SemaphoreHandle_t)wakeup_sem_, wait);
+    if (exit_) {
+      break;
+    }
+    uint32_t count = 0;
+    while (!exit_ && ReplayOne()) {
+      if (++count % config_.replay_burst == 0) {
+        DelayMS(config_.replay_interval_ms);
+      }
+    }
+    uint32_t pending = GetStats().pending;
+    if (count > 0) {
+      ESP_LOGI(TAG, "replay done, %u pending", pending);
+    }
+    // a publish failed while connected, try again later instead of
+    // waiting for the next connect
+    wait = pending > 0 && client_ && client_->IsReady()
+               ? pdMS_TO_TICKS(config_.replay_interval_ms) + 1
+               : portMAX_DELAY;
+  }
+  xSemaphoreGive((SemaphoreHandle_t)exit_sem_);
+  vTaskDelete(NULL);
+}
+
+}  // namespace esp
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "util/mutex.h"
+
+namespace esp {
+
+class MqttClient;
+
+// store and forward queue for publishes made while the broker is not
+// reachable. messages are appended to a dedicated flash partition used as
+// a circular log: sectors are written round robin so erases are spread over
+// the whole partition, and when the log is full the oldest sector is
+// dropped. pending messages are replayed in order, with their qos, after
+// the client is ready again.
+class MqttOfflineQueue {
+ public:
+  struct Config {
+    // data partition, see partitions.csv
+    std::string partition_label{"mqtt_queue"};
+    // messages replayed before yielding to other tasks
+    uint32_t replay_burst{10};
+    uint32_t replay_interval_ms{100};
+    uint32_t task_stack_size{4096};
+    uint32_t task_priority{5};
+  };
+
+  struct Stats {
+    uint32_t appended{0};
+    uint32_t replayed{0};
+    uint32_t dropped{0};
+    uint32_t pending{0};
+    uint32_t sector_erases{0};
+  };
+
+  explicit MqttOfflineQueue(Config config);
+
+  ~MqttOfflineQueue();
+
+  // find the partition and recover pending messages from a previous boot
+  bool Init();
+
+  bool Append(const char* topic, const char* data, int32_t len, int32_t qos,
+              int32_t retain);
+
+  bool Empty();
+
+  // wake up the replay task, called by the client when it becomes ready
+  void Replay();
+
+  Stats GetStats();
+
+  void ReplayLoop();
+
+ private:
+  friend class MqttClient;
+
+  struct Position {
+    uint32_t sector{0};
+    uint32_t offset{0};
+
+    bool operator==(const Position& other) const {
+      return sector == other.sector && offset == other.offset;
+    }
+  };
+
+  void Attach(MqttClient* client);
+
+  bool ScanLog();
+
+  bool OpenSector(uint32_t sector);
+
+  void AdvanceRead(uint32_t record_size);
+
+  bool ReplayOne();
+
+  Config config_;
+  const void* partition_{nullptr};
+  uint32_t sector_count_{0};
+  MqttClient* client_{nullptr};
+
+  Mutex mutex_;
+  Position read_pos_;
+  Position write_pos_;
+  uint32_t next_seq_{0};
+  Stats stats_;
+
+  void* task_handle_{nullptr};
+  void* wakeup_sem_{nullptr};
+  void* exit_sem_{nullptr};
+  std::atomic<bool> exit_{false};
+};
+
+}  // namespace esp
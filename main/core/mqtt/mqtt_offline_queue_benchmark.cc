@@ -0,0 +1,109 @@
+
+#include "mqtt_offline_queue_benchmark.h"
+
+#include <utility>
+#include <vector>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mqtt_client_wrapper.h"
+#include "util/delay.h"
+
+static const char* TAG = "mqtt_queue_benchmark";
+
+#define POLL_INTERVAL_MS 10
+
+namespace esp {
+
+MqttOfflineQueueBenchmark::MqttOfflineQueueBenchmark(MqttClient* client,
+                                                     MqttOfflineQueue* queue,
+                                                     Config config)
+    : client_(client), queue_(queue), config_(std::move(config)) {}
+
+MqttOfflineQueueBenchmark::Report MqttOfflineQueueBenchmark::Run() {
+  Report report;
+  if (!client_ || !queue_ || client_->IsReady()) {
+    ESP_LOGE(TAG, "needs a queue and a client that is not started");
+    return report;
+  }
+  std::vector<char> payload(config_.payload_size);
+  for (size_t i = 0; i < payload.size(); ++i) {
+    payload[i] = (char)('a' + i % 26);
+  }
+  auto before = queue_->GetStats();
+
+  // the client is offline, every publish goes to flash
+  auto start_us = esp_timer_get_time();
+  for (uint32_t i = 0; i < config_.messages; ++i) {
+    if (client_->Publish(config_.topic.c_str(), payload.data(),
+                         payload.size(), config_.qos, 0)) {
+      ++report.appended;
+    } else {
+      ++report.append_failed;
+    }
+  }
+  auto append_us = esp_timer_get_time() - start_us;
+  auto appended = queue_->GetStats();
+  report.append_ms = (uint32_t)(append_us / 1000);
+  if (append_us > 0) {
+    report.appends_per_sec = report.appended * 1000000.0f / append_us;
+    report.append_bytes_per_sec =
+        (uint32_t)((uint64_t)report.appended *
+                   (config_.topic.size() + payload.size()) * 1000000 /
+                   append_us);
+  }
+  report.sector_erases = appended.sector_erases - before.sector_erases;
+
+  // OnReady wakes the replay task
+  start_us = esp_timer_get_time();
+  if (!client_->Start()) {
+    ESP_LOGE(TAG, "start client failed");
+    return report;
+  }
+  auto timeout_us = (int64_t)config_.replay_timeout_ms * 1000;
+  int64_t ready_us = 0;
+  bool drained = false;
+  while (esp_timer_get_time() - start_us < timeout_us) {
+    if (!ready_us && client_->IsReady()) {
+      ready_us = esp_timer_get_time();
+    }
+    if (ready_us && queue_->Empty()) {
+      drained = true;
+      break;
+    }
+    DelayMS(POLL_INTERVAL_MS);
+  }
+  auto done_us = esp_timer_get_time();
+  auto replayed = queue_->GetStats();
+  report.replayed = replayed.replayed - before.replayed;
+  report.dropped = replayed.dropped - before.dropped;
+  if (ready_us) {
+    // polled, up to POLL_INTERVAL_MS late
+    report.connect_ms = (uint32_t)((ready_us - start_us) / 1000);
+    report.replay_ms = (uint32_t)((done_us - ready_us) / 1000);
+    if (done_us > ready_us) {
+      report.replays_per_sec =
+          report.replayed * 1000000.0f / (done_us - ready_us);
+    }
+  }
+  report.ok = drained;
+  if (!drained) {
+    ESP_LOGW(TAG, "replay not done in %u ms, %u pending",
+             config_.replay_timeout_ms, replayed.pending);
+  }
+  return report;
+}
+
+void MqttOfflineQueueBenchmark::LogReport(const Report& report) {
+  ESP_LOGI(TAG,
+           "append: %u msgs (%u failed) in %u ms, %.1f msg/s, %u B/s, "
+           "%u sector erases, %u dropped",
+           report.appended, report.append_failed, report.append_ms,
+           report.appends_per_sec, report.append_bytes_per_sec,
+           report.sector_erases, report.dropped);
+  ESP_LOGI(TAG, "replay: %u msgs in %u ms after a %u ms connect, %.1f msg/s%s",
+           report.replayed, report.replay_ms, report.connect_ms,
+           report.replays_per_sec, report.ok ? "" : ", not finished");
+}
+
+}  // namespace esp
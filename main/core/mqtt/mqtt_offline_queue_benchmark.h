@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "mqtt_offline_queue.h"
+
+namespace esp {
+
+class MqttClient;
+
+// measures the store and forward path on the device: appends messages to
+// the flash log while the client is offline, then starts the client and
+// times the replay after connect. pair it with MqttLoopbackBroker:
+//   broker.Start();
+//   MqttClient client("mqtt://127.0.0.1:1883", "bench", true, true);
+//   queue.Init();
+//   client.SetOfflineQueue(&queue);
+//   MqttOfflineQueueBenchmark benchmark(&client, &queue, {});
+//   MqttOfflineQueueBenchmark::LogReport(benchmark.Run());
+// the client must not be started yet, Run starts it
+class MqttOfflineQueueBenchmark {
+ public:
+  struct Config {
+    std::string topic{"queue/bench"};
+    uint32_t messages{500};
+    size_t payload_size{64};
+    int32_t qos{1};
+    // connect and replay must finish in time
+    uint32_t replay_timeout_ms{60000};
+  };
+
+  struct Report {
+    bool ok{false};
+    uint32_t appended{0};
+    uint32_t append_failed{0};
+    uint32_t append_ms{0};
+    float appends_per_sec{0};
+    uint32_t append_bytes_per_sec{0};
+    uint32_t sector_erases{0};
+    // oldest messages dropped because the log was full
+    uint32_t dropped{0};
+    uint32_t connect_ms{0};
+    uint32_t replayed{0};
+    // ready to empty queue
+    uint32_t replay_ms{0};
+    float replays_per_sec{0};
+  };
+
+  MqttOfflineQueueBenchmark(MqttClient* client, MqttOfflineQueue* queue,
+                            Config config);
+
+  // blocks the calling task for the appends, the connect and the replay
+  Report Run();
+
+  static void LogReport(const Report& report);
+
+ private:
+  MqttClient* client_;
+  MqttOfflineQueue* queue_;
+  Config config_;
+};
+
+}  // namespace esp
@@ -0,0 +1,217 @@
+
+#include "mqtt_publish_scheduler.h"
+
+#include <cstring>
+#include <utility>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+static const char* TAG = "mqtt_scheduler";
+
+// how often a congested outbox or the connection is checked again
+#define CONGESTION_RETRY_MS 20
+
+namespace esp {
+
+static void DispatchTask(void* args) {
+  auto self = (MqttPublishScheduler*)args;
+  if (self) {
+    self->DispatchLoop();
+  }
+}
+
+MqttPublishScheduler::MqttPublishScheduler(MqttClient* client, Config config)
+    : client_(client), config_(std::move(config)) {
+  for (int32_t i = 0; i < kPriorityCount; ++i) {
+    lanes_[i].entries.resize(config_.lane_capacity[i]);
+  }
+  auto now = esp_timer_get_time();
+  for (const auto& limit : config_.rate_limits) {
+    int64_t capacity = (int64_t)limit.burst * 1000;
+    buckets_.push_back(
+        {limit.topic_prefix, limit.rate_per_sec, capacity, capacity, now});
+  }
+}
+
+MqttPublishScheduler::~MqttPublishScheduler() { Stop(); }
+
+bool MqttPublishScheduler::Start() {
+  if (task_handle_) {
+    return true;
+  }
+  exit_ = false;
+  wakeup_sem_ = xSemaphoreCreateBinary();
+  exit_sem_ = xSemaphoreCreateBinary();
+  TaskHandle_t task = nullptr;
+  auto ret = xTaskCreate(DispatchTask, "mqtt_scheduler",
+                         config_.task_stack_size, (void*)this,
+                         config_.task_priority, &task);
+  if (ret != pdPASS) {
+    ESP_LOGE(TAG, "start dispatch task failed");
+    return false;
+  }
+  task_handle_ = task;
+  return true;
+}
+
+void MqttPublishScheduler::Stop() {
+  if (task_handle_) {
+    exit_ = true;
+    xSemaphoreGive((SemaphoreHandle_t)wakeup_sem_);
+    xSemaphoreTake((SemaphoreHandle_t)exit_sem_, portMAX_DELAY);
+    task_handle_ = nullptr;
+  }
+  if (wakeup_sem_) {
+    vSemaphoreDelete((SemaphoreHandle_t)wakeup_sem_);
+    wakeup_sem_ = nullptr;
+  }
+  if (exit_sem_) {
+    vSemaphoreDelete((SemaphoreHandle_t)exit_sem_);
+    exit_sem_ = nullptr;
+  }
+}
+
+bool MqttPublishScheduler::TakeToken(const char* topic) {
+  for (auto& bucket : buckets_) {
+    if (std::strncmp(topic, bucket.prefix.c_str(), bucket.prefix.size()) !=
+        0) {
+      continue;
+    }
+    auto now = esp_timer_get_time();
+    bucket.tokens_milli += (now - bucket.last_us) * bucket.rate_per_sec / 1000;
+    if (bucket.tokens_milli > bucket.capacity_milli) {
+      bucket.tokens_milli = bucket.capacity_milli;
+    }
+    bucket.last_us = now;
+    if (bucket.tokens_milli < 1000) {
+      return false;
+    }
+    bucket.tokens_milli -= 1000;
+    return true;
+  }
+  return true;
+}
+
+bool MqttPublishScheduler::Publish(const char* topic, const char* data,
+                                   int32_t len, int32_t qos, int32_t retain,
+                                   Priority priority) {
+  if (!topic || len < 0 || priority < kHigh || priority >= kPriorityCount) {
+    return false;
+  }
+  auto& lane = lanes_[priority];
+  auto& stats = stats_.lanes[priority];
+  mutex_.Lock();
+  if (priority != kHigh && !TakeToken(topic)) {
+    ++stats.rate_limited;
+    mutex_.Unlock();
+    return false;
+  }
+  if (lane.count == lane.entries.size()) {
+    ++stats.dropped;
+    mutex_.Unlock();
+    ESP_LOGW(TAG, "lane %d full, drop msg to topic:%s", priority, topic);
+    return false;
+  }
+  auto& entry = lane.entries[(lane.head + lane.count) % lane.entries.size()];
+  if (!MqttClient::CopyMessage(topic, std::string_view(data, len),
+                               entry.message)) {
+    ++stats.dropped;
+    mutex_.Unlock();
+    return false;
+  }
+  entry.qos = qos;
+  entry.retain = retain;
+  entry.delayed = false;
+  entry.held = false;
+  ++lane.count;
+  ++stats.enqueued;
+  mutex_.Unlock();
+  if (wakeup_sem_) {
+    xSemaphoreGive((SemaphoreHandle_t)wakeup_sem_);
+  }
+  return true;
+}
+
+int32_t MqttPublishScheduler::PickLane() {
+  for (int32_t i = 0; i < kPriorityCount; ++i) {
+    if (lanes_[i].count > 0) {
+      return i;
+    }
+  }
+  return kPriorityCount;
+}
+
+void MqttPublishScheduler::DispatchLoop() {
+  TickType_t wait = portMAX_DELAY;
+  for (;;) {
+    xSemaphoreTake((SemaphoreHandle_t)wakeup_sem_, wait);
+    if (exit_) {
+      break;
+    }
+    wait = portMAX_DELAY;
+    for (;;) {
+      bool ready = client_->IsReady();
+      bool congested = client_->OutboxSize() > config_.max_outbox_bytes;
+      mutex_.Lock();
+      int32_t index = PickLane();
+      if (index == kPriorityCount) {
+        mutex_.Unlock();
+        break;
+      }
+      auto& lane = lanes_[index];
+      auto& head = lane.entries[lane.head];
+      if (!ready && config_.hold_while_offline) {
+        if (!head.held) {
+          head.held = true;
+          ++stats_.lanes[index].held_offline;
+        }
+        mutex_.Unlock();
+        wait = pdMS_TO_TICKS(CONGESTION_RETRY_MS);
+        break;
+      }
+      if (index != kHigh && congested) {
+        if (!head.delayed) {
+          head.delayed = true;
+          ++stats_.lanes[index].delayed;
+        }
+        mutex_.Unlock();
+        wait = pdMS_TO_TICKS(CONGESTION_RETRY_MS);
+        break;
+      }
+      Entry entry = std::move(lane.entries[lane.head]);
+      lane.head = (lane.head + 1) % lane.entries.size();
+      --lane.count;
+      mutex_.Unlock();
+
+      auto payload = entry.message.Payload();
+      bool sent = client_->AsyncPublish(entry.message.TopicCStr(),
+                                        payload.data(), payload.size(),
+                                        entry.qos, entry.retain);
+      bool not_ready = !sent && !client_->IsReady();
+      mutex_.Lock();
+      if (sent) {
+        ++stats_.lanes[index].sent;
+      } else if (not_ready) {
+        ++stats_.lanes[index].not_ready;
+      } else {
+        ++stats_.lanes[index].dropped;
+      }
+      mutex_.Unlock();
+    }
+  }
+  xSemaphoreGive((SemaphoreHandle_t)exit_sem_);
+  vTaskDelete(NULL);
+}
+
+MqttPublishScheduler::Stats MqttPublishScheduler::GetStats() {
+  mutex_.Lock();
+  Stats stats = stats_;
+  mutex_.Unlock();
+  return stats;
+}
+
+}  // namespace esp
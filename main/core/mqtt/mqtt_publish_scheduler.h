@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "mqtt_client_wrapper.h"
+#include "util/mutex.h"
+
+namespace esp {
+
+// priority lanes and per topic prefix rate limits in front of
+// MqttClient::AsyncPublish. a dispatch task always drains the highest
+// non-empty lane first, and lower lanes wait while the esp-mqtt outbox is
+// congested, so alarms are not stuck behind bulk telemetry.
+class MqttPublishScheduler {
+ public:
+  enum Priority {
+    kHigh = 0,
+    kNormal,
+    kBulk,
+    kPriorityCount,
+  };
+
+  // token bucket, rate messages per second with bursts up to burst.
+  // kHigh messages are not rate limited
+  struct RateLimit {
+    std::string topic_prefix;
+    uint32_t rate_per_sec;
+    uint32_t burst;
+  };
+
+  struct Config {
+    std::vector<RateLimit> rate_limits;
+    // a full lane drops new messages
+    uint32_t lane_capacity[kPriorityCount]{16, 32, 64};
+    // lanes below kHigh wait while the outbox holds more bytes than this
+    int32_t max_outbox_bytes{4096};
+    // messages wait in their lane while the client is not connected. set
+    // false when the client has an offline queue, to pass them on to flash
+    bool hold_while_offline{true};
+    uint32_t task_stack_size{4096};
+    uint32_t task_priority{5};
+  };
+
+  struct LaneStats {
+    uint32_t enqueued{0};
+    uint32_t sent{0};
+    // lane full or publish failed while connected
+    uint32_t dropped{0};
+    uint32_t rate_limited{0};
+    // messages held back by outbox congestion, counted once each
+    uint32_t delayed{0};
+    // messages that waited for the client to connect, counted once each
+    uint32_t held_offline{0};
+    // publish failed because the client was not connected
+    uint32_t not_ready{0};
+  };
+
+  struct Stats {
+    LaneStats lanes[kPriorityCount];
+  };
+
+  MqttPublishScheduler(MqttClient* client, Config config);
+
+  ~MqttPublishScheduler();
+
+  bool Start();
+
+  void Stop();
+
+  bool Publish(const char* topic, const char* data, int32_t len, int32_t qos,
+               int32_t retain, Priority priority);
+
+  Stats GetStats();
+
+  void DispatchLoop();
+
+ private:
+  struct Entry {
+    MqttMessage message;
+    int32_t qos;
+    int32_t retain;
+    // already counted in delayed / held_offline
+    bool delayed;
+    bool held;
+  };
+
+  // fixed ring, no allocation per message
+  struct Lane {
+    std::vector<Entry> entries;
+    size_t head{0};
+    size_t count{0};
+  };
+
+  struct Bucket {
+    std::string prefix;
+    int64_t rate_per_sec;
+    int64_t capacity_milli;
+    int64_t tokens_milli;
+    int64_t last_us;
+  };
+
+  bool TakeToken(const char* topic);
+
+  // highest non-empty lane, kPriorityCount if all are empty
+  int32_t PickLane();
+
+  MqttClient* client_;
+  Config config_;
+  Mutex mutex_;
+  Lane lanes_[kPriorityCount];
+  std::vector<Bucket> buckets_;
+  Stats stats_;
+
+  void* task_handle_{nullptr};
+  void* wakeup_sem_{nullptr};
+  void* exit_sem_{nullptr};
+  std::atomic<bool> exit_{false};
+};
+
+}  // namespace esp
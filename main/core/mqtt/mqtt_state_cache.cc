@@ -0,0 +1,198 @@
+
+#include "mqtt_state_cache.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "mqtt_client_wrapper.h"
+
+static const char* TAG = "mqtt_state";
+
+#define MAX_NUMBER_LEN 32
+
+namespace esp {
+
+static void SnapshotTask(void* args) {
+  auto self = (MqttStateCache*)args;
+  if (self) {
+    self->SnapshotLoop();
+  }
+}
+
+MqttStateCache::MqttStateCache(MqttClient* client, Config config)
+    : client_(client), config_(std::move(config)) {
+  states_.reserve(config_.max_topics);
+}
+
+MqttStateCache::~MqttStateCache() { Stop(); }
+
+bool MqttStateCache::Start() {
+  if (task_handle_ || config_.snapshot_interval_ms == 0) {
+    return true;
+  }
+  exit_ = false;
+  wakeup_sem_ = xSemaphoreCreateBinary();
+  exit_sem_ = xSemaphoreCreateBinary();
+  TaskHandle_t task = nullptr;
+  auto ret = xTaskCreate(SnapshotTask, "mqtt_state", config_.task_stack_size,
+                         (void*)this, config_.task_priority, &task);
+  if (ret != pdPASS) {
+    ESP_LOGE(TAG, "start snapshot task failed");
+    vSemaphoreDelete((SemaphoreHandle_t)wakeup_sem_);
+    vSemaphoreDelete((SemaphoreHandle_t)exit_sem_);
+    wakeup_sem_ = nullptr;
+    exit_sem_ = nullptr;
+    return false;
+  }
+  task_handle_ = task;
+  return true;
+}
+
+void MqttStateCache::Stop() {
+  if (task_handle_) {
+    exit_ = true;
+    xSemaphoreGive((SemaphoreHandle_t)wakeup_sem_);
+    // returns after a snapshot in progress on the task is done
+    xSemaphoreTake((SemaphoreHandle_t)exit_sem_, portMAX_DELAY);
+    vSemaphoreDelete((SemaphoreHandle_t)wakeup_sem_);
+    vSemaphoreDelete((SemaphoreHandle_t)exit_sem_);
+    wakeup_sem_ = nullptr;
+    exit_sem_ = nullptr;
+    task_handle_ = nullptr;
+  }
+}
+
+void MqttStateCache::SnapshotLoop() {
+  for (;;) {
+    xSemaphoreTake((SemaphoreHandle_t)wakeup_sem_,
+                   pdMS_TO_TICKS(config_.snapshot_interval_ms) + 1);
+    if (exit_) {
+      break;
+    }
+    PublishSnapshot();
+  }
+  xSemaphoreGive((SemaphoreHandle_t)exit_sem_);
+  vTaskDelete(NULL);
+}
+
+MqttStateCache::State* MqttStateCache::Find(const char* topic) {
+  for (auto& state : states_) {
+    if (state.topic == topic) {
+      return &state;
+    }
+  }
+  if (states_.size() == config_.max_topics) {
+    return nullptr;
+  }
+  states_.push_back({topic, {}, NAN, false});
+  return &states_.back();
+}
+
+bool MqttStateCache::PublishLocked(const char* topic, const char* data,
+                                   size_t len) {
+  if (!client_->AsyncPublish(topic, data, len, config_.qos, config_.retain)) {
+    ++stats_.failed;
+    return false;
+  }
+  ++stats_.published;
+  stats_.bytes_published += strlen(topic) + len;
+  return true;
+}
+
+bool MqttStateCache::Set(const char* topic, const char* data, int32_t len) {
+  if (!topic || len < 0 || (!data && len > 0)) {
+    return false;
+  }
+  mutex_.Lock();
+  ++stats_.updates;
+  auto state = Find(topic);
+  if (!state) {
+    ESP_LOGW(TAG, "cache full, publish topic:%s uncached", topic);
+    bool ret = PublishLocked(topic, data, len);
+    mutex_.Unlock();
+    return ret;
+  }
+  if (state->published && state->payload.size() == (size_t)len &&
+      std::memcmp(state->payload.data(), data, len) == 0) {
+    ++stats_.suppressed;
+    stats_.bytes_saved += state->topic.size() + len;
+    mutex_.Unlock();
+    return true;
+  }
+  // the cached value only changes once the publish is accepted, so a
+  // failed one is retried by the next update
+  bool ret = PublishLocked(topic, data, len);
+  if (ret) {
+    state->payload.assign(data, len);
+    state->number = NAN;
+    state->published = true;
+  }
+  mutex_.Unlock();
+  return ret;
+}
+
+bool MqttStateCache::SetNumber(const char* topic, double value,
+                               double deadband) {
+  if (!topic) {
+    return false;
+  }
+  char text[MAX_NUMBER_LEN];
+  int len = snprintf(text, sizeof(text), "%.*g", config_.number_precision,
+                     value);
+  if (len < 0 || len >= (int)sizeof(text)) {
+    return false;
+  }
+  mutex_.Lock();
+  ++stats_.updates;
+  auto state = Find(topic);
+  if (state && state->published && !std::isnan(state->number) &&
+      std::fabs(value - state->number) < deadband) {
+    ++stats_.suppressed;
+    stats_.bytes_saved += state->topic.size() + len;
+    mutex_.Unlock();
+    return true;
+  }
+  bool ret = PublishLocked(topic, text, len);
+  if (ret && state) {
+    state->payload.assign(text, len);
+    state->number = value;
+    state->published = true;
+  }
+  mutex_.Unlock();
+  return ret;
+}
+
+void MqttStateCache::PublishSnapshot() {
+  // locked per topic so Set is not held up for the whole snapshot, and a
+  // newer value of a topic is never overtaken by its snapshot copy.
+  // states_ is reserved for max_topics, an index stays valid
+  for (size_t i = 0;; ++i) {
+    mutex_.Lock();
+    if (i >= states_.size()) {
+      ++stats_.snapshots;
+      mutex_.Unlock();
+      break;
+    }
+    const auto& state = states_[i];
+    if (state.published) {
+      PublishLocked(state.topic.c_str(), state.payload.data(),
+                    state.payload.size());
+    }
+    mutex_.Unlock();
+  }
+}
+
+MqttStateCache::Stats MqttStateCache::GetStats() {
+  mutex_.Lock();
+  auto stats = stats_;
+  mutex_.Unlock();
+  return stats;
+}
+
+}  // namespace esp
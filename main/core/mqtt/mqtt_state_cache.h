@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "util/mutex.h"
+
+namespace esp {
+
+class MqttClient;
+
+// device state store in front of MqttClient::AsyncPublish, keeps the last
+// published value per topic and only publishes changes: payloads are
+// compared byte for byte, numbers against a deadband. a periodic snapshot
+// republishes every value so late joiners catch up even where the broker
+// drops retained messages. the snapshot runs on its own task and holds
+// the lock for one topic at a time
+class MqttStateCache {
+ public:
+  struct Config {
+    // 0 disables periodic snapshots
+    uint32_t snapshot_interval_ms{60000};
+    // topics kept, changes to further topics are published uncached
+    size_t max_topics{32};
+    int32_t qos{1};
+    int32_t retain{1};
+    // significant digits of SetNumber payloads
+    int32_t number_precision{6};
+    uint32_t task_stack_size{3072};
+    uint32_t task_priority{5};
+  };
+
+  struct Stats {
+    uint32_t updates{0};
+    uint32_t published{0};
+    uint32_t suppressed{0};
+    uint32_t snapshots{0};
+    uint32_t failed{0};
+    uint64_t bytes_published{0};
+    // topic and payload bytes of suppressed updates
+    uint64_t bytes_saved{0};
+  };
+
+  MqttStateCache(MqttClient* client, Config config);
+
+  ~MqttStateCache();
+
+  bool Start();
+
+  void Stop();
+
+  // publishes when the payload differs from the last published one
+  bool Set(const char* topic, const char* data, int32_t len);
+
+  // publishes when the value moved by deadband or more since the last
+  // published value
+  bool SetNumber(const char* topic, double value, double deadband);
+
+  // republish every cached value, the snapshot task calls it too
+  void PublishSnapshot();
+
+  Stats GetStats();
+
+  // snapshot task loop
+  void SnapshotLoop();
+
+ private:
+  struct State {
+    std::string topic;
+    std::string payload;
+    // NAN unless set through SetNumber
+    double number;
+    bool published;
+  };
+
+  State* Find(const char* topic);
+
+  bool PublishLocked(const char* topic, const char* data, size_t len);
+
+  MqttClient* client_;
+  Config config_;
+  Mutex mutex_;
+  std::vector<State> states_;
+  void* task_handle_{nullptr};
+  void* wakeup_sem_{nullptr};
+  void* exit_sem_{nullptr};
+  std::atomic<bool> exit_{false};
+  Stats stats_;
+};
+
+}  // namespace esp
@@ -0,0 +1,261 @@
+
+#include "async_http_client.h"
+
+#include <utility>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+static const char* TAG = "async_http";
+
+namespace esp {
+
+static std::shared_ptr<HttpResponse> CancelledResponse() {
+  auto response = std::make_shared<HttpResponse>();
+  response->SetError("cancelled");
+  return response;
+}
+
+HttpFuture::HttpFuture(uint32_t id) : id_(id) {
+  done_sem_ = xSemaphoreCreateBinary();
+}
+
+HttpFuture::~HttpFuture() {
+  if (done_sem_) {
+    vSemaphoreDelete((SemaphoreHandle_t)done_sem_);
+  }
+}
+
+bool HttpFuture::Wait(int32_t timeout_ms) {
+  if (done_ || !done_sem_) {
+    return done_;
+  }
+  TickType_t ticks =
+      timeout_ms < 0 ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+  if (xSemaphoreTake((SemaphoreHandle_t)done_sem_, ticks) != pdTRUE) {
+    return done_;
+  }
+  // pass it on to the next waiter
+  xSemaphoreGive((SemaphoreHandle_t)done_sem_);
+  return true;
+}
+
+std::shared_ptr<HttpResponse> HttpFuture::GetResponse() const {
+  return done_ ? response_ : nullptr;
+}
+
+void HttpFuture::Complete(std::shared_ptr<HttpResponse> response) {
+  response_ = std::move(response);
+  done_ = true;
+  if (done_sem_) {
+    xSemaphoreGive((SemaphoreHandle_t)done_sem_);
+  }
+}
+
+static void WorkerTask(void* args) {
+  auto self = (AsyncHttpClient*)args;
+  if (self) {
+    self->WorkerLoop();
+  }
+}
+
+AsyncHttpClient::AsyncHttpClient(HttpClient* client, Config config)
+    : client_(client), config_(std::move(config)) {}
+
+AsyncHttpClient::~AsyncHttpClient() { Stop(); }
+
+bool AsyncHttpClient::Start() {
+  if (!task_handles_.empty()) {
+    return true;
+  }
+  if (!client_ || config_.worker_count == 0) {
+    return false;
+  }
+  exit_ = false;
+  // one give per queued request, plus one per worker on Stop
+  wakeup_sem_ = xSemaphoreCreateCounting(
+      config_.queue_capacity + config_.worker_count, 0);
+  exit_sem_ = xSemaphoreCreateCounting(config_.worker_count, 0);
+  if (!wakeup_sem_ || !exit_sem_) {
+    ESP_LOGE(TAG, "no memory for worker semaphores");
+    Stop();
+    return false;
+  }
+  for (uint32_t i = 0; i < config_.worker_count; ++i) {
+    TaskHandle_t task = nullptr;
+    auto ret = xTaskCreate(WorkerTask, "async_http", config_.task_stack_size,
+                           (void*)this, config_.task_priority, &task);
+    if (ret != pdPASS) {
+      ESP_LOGE(TAG, "start worker %u failed", i);
+      break;
+    }
+    task_handles_.push_back(task);
+  }
+  if (task_handles_.empty()) {
+    Stop();
+    return false;
+  }
+  return true;
+}
+
+void AsyncHttpClient::Stop() {
+  if (!task_handles_.empty()) {
+    exit_ = true;
+    for (size_t i = 0; i < task_handles_.size(); ++i) {
+      xSemaphoreGive((SemaphoreHandle_t)wakeup_sem_);
+    }
+    for (size_t i = 0; i < task_handles_.size(); ++i) {
+      xSemaphoreTake((SemaphoreHandle_t)exit_sem_, portMAX_DELAY);
+    }
+    task_handles_.clear();
+  }
+  mutex_.Lock();
+  std::deque<Job> pending;
+  pending.swap(queue_);
+  stats_.queue_depth = 0;
+  mutex_.Unlock();
+  for (auto& job : pending) {
+    job.future->cancelled_ = true;
+    Finish(job, nullptr);
+  }
+  if (wakeup_sem_) {
+    vSemaphoreDelete((SemaphoreHandle_t)wakeup_sem_);
+    wakeup_sem_ = nullptr;
+  }
+  if (exit_sem_) {
+    vSemaphoreDelete((SemaphoreHandle_t)exit_sem_);
+    exit_sem_ = nullptr;
+  }
+}
+
+std::shared_ptr<HttpFuture> AsyncHttpClient::Submit(
+    std::shared_ptr<HttpRequest> request, int32_t timeout_ms,
+    Callback callback) {
+  if (!request) {
+    return nullptr;
+  }
+  mutex_.Lock();
+  if (task_handles_.empty() || exit_ ||
+      queue_.size() >= config_.queue_capacity) {
+    ++stats_.rejected;
+    mutex_.Unlock();
+    ESP_LOGW(TAG, "queue full or not started, reject %s",
+             request->GetUrl().c_str());
+    return nullptr;
+  }
+  auto future = std::make_shared<HttpFuture>(next_id_++);
+  if (next_id_ == 0) {
+    next_id_ = 1;
+  }
+  queue_.push_back({future, std::move(request), timeout_ms,
+                    std::move(callback), esp_timer_get_time()});
+  ++stats_.submitted;
+  stats_.queue_depth = queue_.size();
+  if (stats_.queue_depth > stats_.max_queue_depth) {
+    stats_.max_queue_depth = stats_.queue_depth;
+  }
+  mutex_.Unlock();
+  xSemaphoreGive((SemaphoreHandle_t)wakeup_sem_);
+  return future;
+}
+
+bool AsyncHttpClient::Cancel(uint32_t id) {
+  mutex_.Lock();
+  for (auto it = queue_.begin(); it != queue_.end(); ++it) {
+    if (it->future->Id() == id) {
+      Job job = std::move(*it);
+      queue_.erase(it);
+      stats_.queue_depth = queue_.size();
+      job.future->cancelled_ = true;
+      mutex_.Unlock();
+      Finish(job, nullptr);
+      return true;
+    }
+  }
+  for (auto& future : running_) {
+    if (future->Id() == id) {
+      // the worker sees it when the request returns
+      future->cancelled_ = true;
+      mutex_.Unlock();
+      return true;
+    }
+  }
+  mutex_.Unlock();
+  return false;
+}
+
+void AsyncHttpClient::Finish(Job& job,
+                             std::shared_ptr<HttpResponse> response) {
+  bool cancelled = job.future->Cancelled();
+  if (cancelled) {
+    response = CancelledResponse();
+  }
+  mutex_.Lock();
+  if (cancelled) {
+    ++stats_.cancelled;
+  } else {
+    ++stats_.completed;
+    if (!response->GetError().empty() || response->GetStatusCode() == 0) {
+      ++stats_.failed;
+    }
+  }
+  mutex_.Unlock();
+  // callback first, so a waiter sees what it did
+  if (job.callback) {
+    job.callback(response);
+  }
+  job.future->Complete(std::move(response));
+}
+
+void AsyncHttpClient::WorkerLoop() {
+  for (;;) {
+    xSemaphoreTake((SemaphoreHandle_t)wakeup_sem_, portMAX_DELAY);
+    if (exit_) {
+      break;
+    }
+    mutex_.Lock();
+    if (queue_.empty()) {
+      // cancelled while queued
+      mutex_.Unlock();
+      continue;
+    }
+    Job job = std::move(queue_.front());
+    queue_.pop_front();
+    auto start_us = esp_timer_get_time();
+    stats_.queue_depth = queue_.size();
+    stats_.queue_latency.Record(
+        (uint32_t)((start_us - job.enqueued_us) / 1000));
+    running_.push_back(job.future);
+    stats_.in_flight = running_.size();
+    mutex_.Unlock();
+
+    auto response = client_->DoRequest(job.request, job.timeout_ms);
+
+    mutex_.Lock();
+    stats_.request_latency.Record(
+        (uint32_t)((esp_timer_get_time() - start_us) / 1000));
+    for (size_t i = 0; i < running_.size(); ++i) {
+      if (running_[i] == job.future) {
+        running_.erase(running_.begin() + i);
+        break;
+      }
+    }
+    stats_.in_flight = running_.size();
+    mutex_.Unlock();
+    Finish(job, std::move(response));
+  }
+  xSemaphoreGive((SemaphoreHandle_t)exit_sem_);
+  vTaskDelete(NULL);
+}
+
+AsyncHttpClient::Stats AsyncHttpClient::GetStats() {
+  mutex_.Lock();
+  Stats stats = stats_;
+  mutex_.Unlock();
+  return stats;
+}
+
+}  // namespace esp
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "http_client.h"
+#include "latency_histogram.h"
+#include "mutex.h"
+
+namespace esp {
+
+// completion of one async request, shared by the caller and the worker
+class HttpFuture {
+ public:
+  explicit HttpFuture(uint32_t id);
+
+  ~HttpFuture();
+
+  uint32_t Id() const { return id_; }
+
+  // blocks until the request completes or is cancelled, false on timeout.
+  // negative timeout waits forever
+  bool Wait(int32_t timeout_ms);
+
+  bool Done() const { return done_; }
+
+  bool Cancelled() const { return cancelled_; }
+
+  // nullptr until done, a cancelled request gets an error response
+  std::shared_ptr<HttpResponse> GetResponse() const;
+
+ private:
+  friend class AsyncHttpClient;
+
+  void Complete(std::shared_ptr<HttpResponse> response);
+
+  uint32_t id_;
+  std::atomic<bool> done_{false};
+  std::atomic<bool> cancelled_{false};
+  std::shared_ptr<HttpResponse> response_;
+  void* done_sem_{nullptr};
+};
+
+// runs HttpClient::DoRequest on worker tasks so the caller (main task,
+// event bus handlers) does not block for the request timeout. up to
+// worker_count requests are in flight at once, the rest wait in a bounded
+// fifo queue
+class AsyncHttpClient {
+ public:
+  // called on a worker task when the request completes or is cancelled,
+  // publish an event instead of doing long work here
+  using Callback = std::function<void(const std::shared_ptr<HttpResponse>&)>;
+
+  struct Config {
+    uint32_t worker_count{2};
+    // a full queue rejects new requests
+    size_t queue_capacity{8};
+    uint32_t task_stack_size{6144};
+    uint32_t task_priority{5};
+  };
+
+  struct Stats {
+    uint32_t submitted{0};
+    uint32_t completed{0};
+    // transport error or no status code
+    uint32_t failed{0};
+    uint32_t cancelled{0};
+    // queue full or not started
+    uint32_t rejected{0};
+    size_t queue_depth{0};
+    size_t max_queue_depth{0};
+    size_t in_flight{0};
+    // submit to start of the request
+    LatencyHistogram queue_latency;
+    // start of the request to the response
+    LatencyHistogram request_latency;
+  };
+
+  // client settings (certs, buffers, connection pool) apply to every
+  // request, it is shared by the workers and must outlive this
+  AsyncHttpClient(HttpClient* client, Config config);
+
+  ~AsyncHttpClient();
+
+  bool Start();
+
+  // cancels queued requests and waits for the in flight ones
+  void Stop();
+
+  // nullptr when the request is rejected, callback may be empty
+  std::shared_ptr<HttpFuture> Submit(std::shared_ptr<HttpRequest> request,
+                                     int32_t timeout_ms,
+                                     Callback callback = nullptr);
+
+  // a queued request is dropped. esp_http_client cannot be interrupted
+  // from another task, an in flight one runs to the end and its response
+  // is replaced by the cancelled one. false if the id is unknown or done
+  bool Cancel(uint32_t id);
+
+  Stats GetStats();
+
+  void WorkerLoop();
+
+ private:
+  struct Job {
+    std::shared_ptr<HttpFuture> future;
+    std::shared_ptr<HttpRequest> request;
+    int32_t timeout_ms;
+    Callback callback;
+    int64_t enqueued_us;
+  };
+
+  void Finish(Job& job, std::shared_ptr<HttpResponse> response);
+
+  HttpClient* client_;
+  Config config_;
+  Mutex mutex_;
+  std::deque<Job> queue_;
+  // in flight futures, looked up by Cancel
+  std::vector<std::shared_ptr<HttpFuture>> running_;
+  uint32_t next_id_{1};
+  Stats stats_;
+
+  std::vector<void*> task_handles_;
+  void* wakeup_sem_{nullptr};
+  void* exit_sem_{nullptr};
+  std::atomic<bool> exit_{false};
+};
+
+}  // namespace esp
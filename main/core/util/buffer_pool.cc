@@ -0,0 +1,158 @@
+
+#include "buffer_pool.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+#include "sdkconfig.h"
+
+#ifdef CONFIG_BUFFER_POOL_BLOCK_SIZE
+#define SHARED_POOL_BLOCK_SIZE CONFIG_BUFFER_POOL_BLOCK_SIZE
+#else
+#define SHARED_POOL_BLOCK_SIZE 512
+#endif
+#ifdef CONFIG_BUFFER_POOL_MAX_FREE_BLOCKS
+#define SHARED_POOL_MAX_FREE_BLOCKS CONFIG_BUFFER_POOL_MAX_FREE_BLOCKS
+#else
+#define SHARED_POOL_MAX_FREE_BLOCKS 16
+#endif
+
+namespace esp {
+
+PooledBuffer::PooledBuffer(BufferPool* pool, uint8_t* data, size_t capacity)
+    : pool_(pool), data_(data), capacity_(capacity) {}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other) noexcept
+    : pool_(other.pool_),
+      data_(other.data_),
+      size_(other.size_),
+      capacity_(other.capacity_) {
+  other.pool_ = nullptr;
+  other.data_ = nullptr;
+  other.size_ = 0;
+  other.capacity_ = 0;
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept {
+  if (this != &other) {
+    Reset();
+    std::swap(pool_, other.pool_);
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    std::swap(capacity_, other.capacity_);
+  }
+  return *this;
+}
+
+PooledBuffer::~PooledBuffer() { Reset(); }
+
+bool PooledBuffer::SetSize(size_t size) {
+  if (size > capacity_) {
+    return false;
+  }
+  size_ = size;
+  return true;
+}
+
+bool PooledBuffer::Append(const void* data, size_t len) {
+  if (size_ + len > capacity_) {
+    return false;
+  }
+  std::memcpy(data_ + size_, data, len);
+  size_ += len;
+  return true;
+}
+
+void PooledBuffer::Reset() {
+  if (data_) {
+    pool_->Release(data_, capacity_);
+  }
+  pool_ = nullptr;
+  data_ = nullptr;
+  size_ = 0;
+  capacity_ = 0;
+}
+
+BufferPool* BufferPool::Instance() {
+  static BufferPool INSTANCE(SHARED_POOL_BLOCK_SIZE,
+                             SHARED_POOL_MAX_FREE_BLOCKS);
+  return &INSTANCE;
+}
+
+BufferPool::BufferPool(size_t block_size, size_t max_free_blocks)
+    : block_size_(block_size > 0 ? block_size : 1),
+      max_free_blocks_(max_free_blocks),
+      max_free_bytes_(block_size_ * max_free_blocks) {
+  // release never allocates
+  free_blocks_.reserve(max_free_blocks_);
+}
+
+BufferPool::~BufferPool() {
+  for (const auto& block : free_blocks_) {
+    free(block.data);
+  }
+}
+
+PooledBuffer BufferPool::Acquire(size_t size) {
+  size_t capacity = (size + block_size_ - 1) / block_size_ * block_size_;
+  if (capacity == 0) {
+    capacity = block_size_;
+  }
+  uint8_t* data = nullptr;
+  mutex_.Lock();
+  ++stats_.acquire_count;
+  // best fit, the free list is short
+  size_t best = free_blocks_.size();
+  for (size_t i = 0; i < free_blocks_.size(); ++i) {
+    if (free_blocks_[i].capacity >= capacity &&
+        (best == free_blocks_.size() ||
+         free_blocks_[i].capacity < free_blocks_[best].capacity)) {
+      best = i;
+    }
+  }
+  if (best != free_blocks_.size()) {
+    data = free_blocks_[best].data;
+    capacity = free_blocks_[best].capacity;
+    free_bytes_ -= capacity;
+    free_blocks_[best] = free_blocks_.back();
+    free_blocks_.pop_back();
+  } else {
+    ++stats_.alloc_count;
+  }
+  mutex_.Unlock();
+
+  if (!data) {
+    data = (uint8_t*)malloc(capacity);
+    if (!data) {
+      return PooledBuffer();
+    }
+  }
+  return PooledBuffer(this, data, capacity);
+}
+
+BufferPool::Stats BufferPool::GetStats() {
+  mutex_.Lock();
+  Stats stats = stats_;
+  stats.free_blocks = free_blocks_.size();
+  stats.free_bytes = free_bytes_;
+  mutex_.Unlock();
+  return stats;
+}
+
+void BufferPool::Release(uint8_t* data, size_t capacity) {
+  mutex_.Lock();
+  // large one-off blocks (reassembled messages) are not kept
+  if (free_blocks_.size() < max_free_blocks_ &&
+      free_bytes_ + capacity <= max_free_bytes_) {
+    free_blocks_.push_back({data, capacity});
+    free_bytes_ += capacity;
+    data = nullptr;
+  }
+  mutex_.Unlock();
+  if (data) {
+    free(data);
+  }
+}
+
+}  // namespace esp
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "mutex.h"
+
+namespace esp {
+
+class BufferPool;
+
+// move only, block is given back to the pool when destroyed
+class PooledBuffer {
+ public:
+  PooledBuffer() = default;
+
+  PooledBuffer(PooledBuffer&& other) noexcept;
+
+  PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+
+  PooledBuffer(const PooledBuffer&) = delete;
+
+  PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+  ~PooledBuffer();
+
+  bool Valid() const { return data_ != nullptr; }
+
+  uint8_t* Data() { return data_; }
+
+  const uint8_t* Data() const { return data_; }
+
+  size_t Size() const { return size_; }
+
+  size_t Capacity() const { return capacity_; }
+
+  // size must not exceed capacity
+  bool SetSize(size_t size);
+
+  bool Append(const void* data, size_t len);
+
+  // give the block back to the pool
+  void Reset();
+
+ private:
+  friend class BufferPool;
+
+  PooledBuffer(BufferPool* pool, uint8_t* data, size_t capacity);
+
+  BufferPool* pool_{nullptr};
+  uint8_t* data_{nullptr};
+  size_t size_{0};
+  size_t capacity_{0};
+};
+
+// recycles heap blocks so hot paths do not malloc/free per message.
+// block capacity is rounded up to block_size, at most max_free_blocks
+// released blocks (and block_size * max_free_blocks bytes) are kept for
+// reuse, the rest are freed.
+class BufferPool {
+ public:
+  struct Stats {
+    uint32_t acquire_count{0};
+    uint32_t alloc_count{0};
+    uint32_t free_blocks{0};
+    size_t free_bytes{0};
+  };
+
+  // shared by mqtt and http wrappers
+  static BufferPool* Instance();
+
+  BufferPool(size_t block_size, size_t max_free_blocks);
+
+  ~BufferPool();
+
+  // returns an invalid buffer if out of memory
+  PooledBuffer Acquire(size_t size);
+
+  size_t BlockSize() const { return block_size_; }
+
+  Stats GetStats();
+
+ private:
+  friend class PooledBuffer;
+
+  void Release(uint8_t* data, size_t capacity);
+
+  struct Block {
+    uint8_t* data;
+    size_t capacity;
+  };
+
+  size_t block_size_;
+  size_t max_free_blocks_;
+  size_t max_free_bytes_;
+  size_t free_bytes_{0};
+  Mutex mutex_;
+  std::vector<Block> free_blocks_;
+  Stats stats_;
+};
+
+}  // namespace esp
@@ -0,0 +1,314 @@
+
+#include "cbor.h"
+
+#include <cmath>
+#include <cstring>
+
+#define MAJOR_UINT 0
+#define MAJOR_NEGINT 1
+#define MAJOR_BYTES 2
+#define MAJOR_TEXT 3
+#define MAJOR_ARRAY 4
+#define MAJOR_MAP 5
+#define MAJOR_TAG 6
+#define MAJOR_SIMPLE 7
+
+#define SIMPLE_FALSE 20
+#define SIMPLE_TRUE 21
+#define SIMPLE_NULL 22
+#define SIMPLE_UNDEFINED 23
+#define SIMPLE_HALF 25
+#define SIMPLE_FLOAT 26
+#define SIMPLE_DOUBLE 27
+
+// nested containers skipped by CborReader::Skip
+#define MAX_SKIP_DEPTH 16
+
+namespace esp {
+
+CborWriter::CborWriter(uint8_t* buffer, size_t capacity)
+    : buffer_(buffer), capacity_(capacity) {}
+
+void CborWriter::Reset() {
+  size_ = 0;
+  ok_ = true;
+}
+
+bool CborWriter::Put(const void* data, size_t len) {
+  if (!ok_ || size_ + len > capacity_) {
+    ok_ = false;
+    return false;
+  }
+  std::memcpy(buffer_ + size_, data, len);
+  size_ += len;
+  return true;
+}
+
+bool CborWriter::WriteHead(uint8_t major, uint64_t value) {
+  uint8_t head[9];
+  size_t len = 1;
+  major <<= 5;
+  if (value < 24) {
+    head[0] = major | (uint8_t)value;
+  } else if (value <= 0xff) {
+    head[0] = major | 24;
+    len = 2;
+  } else if (value <= 0xffff) {
+    head[0] = major | 25;
+    len = 3;
+  } else if (value <= 0xffffffff) {
+    head[0] = major | 26;
+    len = 5;
+  } else {
+    head[0] = major | 27;
+    len = 9;
+  }
+  // big endian argument
+  for (size_t i = len - 1; i > 0; --i) {
+    head[i] = (uint8_t)value;
+    value >>= 8;
+  }
+  return Put(head, len);
+}
+
+bool CborWriter::WriteUint(uint64_t value) {
+  return WriteHead(MAJOR_UINT, value);
+}
+
+bool CborWriter::WriteInt(int64_t value) {
+  if (value >= 0) {
+    return WriteHead(MAJOR_UINT, (uint64_t)value);
+  }
+  return WriteHead(MAJOR_NEGINT, (uint64_t)(-(value + 1)));
+}
+
+bool CborWriter::WriteBool(bool value) {
+  uint8_t head = (MAJOR_SIMPLE << 5) | (value ? SIMPLE_TRUE : SIMPLE_FALSE);
+  return Put(&head, 1);
+}
+
+bool CborWriter::WriteNull() {
+  uint8_t head = (MAJOR_SIMPLE << 5) | SIMPLE_NULL;
+  return Put(&head, 1);
+}
+
+bool CborWriter::WriteFloat(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  uint8_t head[5] = {(MAJOR_SIMPLE << 5) | SIMPLE_FLOAT, (uint8_t)(bits >> 24),
+                     (uint8_t)(bits >> 16), (uint8_t)(bits >> 8),
+                     (uint8_t)bits};
+  return Put(head, sizeof(head));
+}
+
+bool CborWriter::WriteDouble(double value) {
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  uint8_t head[9];
+  head[0] = (MAJOR_SIMPLE << 5) | SIMPLE_DOUBLE;
+  for (size_t i = 8; i > 0; --i) {
+    head[i] = (uint8_t)bits;
+    bits >>= 8;
+  }
+  return Put(head, sizeof(head));
+}
+
+bool CborWriter::WriteText(std::string_view text) {
+  return WriteHead(MAJOR_TEXT, text.size()) && Put(text.data(), text.size());
+}
+
+bool CborWriter::WriteBytes(const uint8_t* data, size_t len) {
+  return WriteHead(MAJOR_BYTES, len) && Put(data, len);
+}
+
+bool CborWriter::BeginArray(size_t count) {
+  return WriteHead(MAJOR_ARRAY, count);
+}
+
+bool CborWriter::BeginMap(size_t count) { return WriteHead(MAJOR_MAP, count); }
+
+bool CborReader::Item::AsInt(int64_t& out) const {
+  if (type == kUint && value <= (uint64_t)INT64_MAX) {
+    out = (int64_t)value;
+    return true;
+  }
+  if (type == kNegInt && value <= (uint64_t)INT64_MAX) {
+    out = -1 - (int64_t)value;
+    return true;
+  }
+  return false;
+}
+
+CborReader::CborReader(const uint8_t* data, size_t len)
+    : data_(data), len_(len) {}
+
+bool CborReader::ReadArgument(uint8_t info, uint64_t& value) {
+  if (info < 24) {
+    value = info;
+    return true;
+  }
+  if (info > 27) {
+    // reserved or indefinite length
+    return false;
+  }
+  size_t len = (size_t)1 << (info - 24);
+  if (offset_ + len > len_) {
+    return false;
+  }
+  value = 0;
+  for (size_t i = 0; i < len; ++i) {
+    value = (value << 8) | data_[offset_ + i];
+  }
+  offset_ += len;
+  return true;
+}
+
+static double HalfToDouble(uint16_t half) {
+  int exponent = (half >> 10) & 0x1f;
+  int mantissa = half & 0x3ff;
+  double value;
+  if (exponent == 0) {
+    value = std::ldexp(mantissa, -24);
+  } else if (exponent != 31) {
+    value = std::ldexp(mantissa + 1024, exponent - 25);
+  } else {
+    value = mantissa == 0 ? INFINITY : NAN;
+  }
+  return (half & 0x8000) ? -value : value;
+}
+
+bool CborReader::Next(Item& item) {
+  if (error_ || offset_ >= len_) {
+    return false;
+  }
+  uint8_t head = data_[offset_++];
+  uint8_t major = head >> 5;
+  uint8_t info = head & 0x1f;
+  item = Item();
+
+  if (major == MAJOR_SIMPLE) {
+    uint64_t bits = 0;
+    switch (info) {
+      case SIMPLE_FALSE:
+      case SIMPLE_TRUE:
+        item.type = kBool;
+        item.bool_value = info == SIMPLE_TRUE;
+        return true;
+      case SIMPLE_NULL:
+        item.type = kNull;
+        return true;
+      case SIMPLE_UNDEFINED:
+        item.type = kUndefined;
+        return true;
+      case SIMPLE_HALF:
+      case SIMPLE_FLOAT:
+      case SIMPLE_DOUBLE:
+        if (!ReadArgument(info, bits)) {
+          break;
+        }
+        item.type = kFloat;
+        if (info == SIMPLE_HALF) {
+          item.float_value = HalfToDouble((uint16_t)bits);
+        } else if (info == SIMPLE_FLOAT) {
+          uint32_t bits32 = (uint32_t)bits;
+          float value;
+          std::memcpy(&value, &bits32, sizeof(value));
+          item.float_value = value;
+        } else {
+          std::memcpy(&item.float_value, &bits, sizeof(bits));
+        }
+        return true;
+      default:
+        break;
+    }
+    error_ = true;
+    return false;
+  }
+
+  uint64_t value = 0;
+  if (!ReadArgument(info, value)) {
+    error_ = true;
+    return false;
+  }
+  switch (major) {
+    case MAJOR_UINT:
+      item.type = kUint;
+      item.value = value;
+      return true;
+    case MAJOR_NEGINT:
+      item.type = kNegInt;
+      item.value = value;
+      return true;
+    case MAJOR_BYTES:
+    case MAJOR_TEXT:
+      if (value > len_ - offset_) {
+        break;
+      }
+      item.type = major == MAJOR_TEXT ? kText : kBytes;
+      item.data = std::string_view((const char*)data_ + offset_, value);
+      offset_ += value;
+      return true;
+    case MAJOR_ARRAY:
+      item.type = kArray;
+      item.count = value;
+      return true;
+    case MAJOR_MAP:
+      item.type = kMap;
+      item.count = value;
+      return true;
+    case MAJOR_TAG:
+      item.type = kTag;
+      item.value = value;
+      return true;
+    default:
+      break;
+  }
+  error_ = true;
+  return false;
+}
+
+bool CborReader::Skip(const Item& item) {
+  // items still to read on each open container level
+  uint64_t pending[MAX_SKIP_DEPTH];
+  size_t depth = 0;
+  auto push = [&](const Item& container) {
+    uint64_t count = 1;
+    if (container.type == kArray) {
+      count = container.count;
+    } else if (container.type == kMap) {
+      count = (uint64_t)container.count * 2;
+    } else if (container.type != kTag) {
+      return true;
+    }
+    if (count == 0) {
+      return true;
+    }
+    if (depth == MAX_SKIP_DEPTH) {
+      return false;
+    }
+    pending[depth++] = count;
+    return true;
+  };
+  if (!push(item)) {
+    error_ = true;
+    return false;
+  }
+  while (depth > 0) {
+    Item child;
+    if (!Next(child)) {
+      error_ = true;
+      return false;
+    }
+    --pending[depth - 1];
+    while (depth > 0 && pending[depth - 1] == 0) {
+      --depth;
+    }
+    if (!push(child)) {
+      error_ = true;
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace esp
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace esp {
+
+// allocation free CBOR (RFC 8949) encoder writing into a caller buffer.
+// on overflow the writer stops and Ok() returns false.
+// only definite length items are produced
+class CborWriter {
+ public:
+  CborWriter(uint8_t* buffer, size_t capacity);
+
+  bool WriteUint(uint64_t value);
+
+  bool WriteInt(int64_t value);
+
+  bool WriteBool(bool value);
+
+  bool WriteNull();
+
+  // encoded as single precision
+  bool WriteFloat(float value);
+
+  bool WriteDouble(double value);
+
+  bool WriteText(std::string_view text);
+
+  bool WriteBytes(const uint8_t* data, size_t len);
+
+  // followed by count items
+  bool BeginArray(size_t count);
+
+  // followed by count key/value pairs
+  bool BeginMap(size_t count);
+
+  bool Ok() const { return ok_; }
+
+  const uint8_t* Data() const { return buffer_; }
+
+  size_t Size() const { return size_; }
+
+  void Reset();
+
+ private:
+  bool WriteHead(uint8_t major, uint64_t value);
+
+  bool Put(const void* data, size_t len);
+
+  uint8_t* buffer_;
+  size_t capacity_;
+  size_t size_{0};
+  bool ok_{true};
+};
+
+// pull decoder over a borrowed buffer, text and bytes are views into it.
+// indefinite length items are reported as errors
+class CborReader {
+ public:
+  enum Type {
+    kUint,
+    kNegInt,
+    kBytes,
+    kText,
+    kArray,
+    kMap,
+    kTag,
+    kBool,
+    kNull,
+    kUndefined,
+    kFloat,
+  };
+
+  struct Item {
+    Type type{kNull};
+    // kUint/kNegInt/kTag, kNegInt is -1 - value
+    uint64_t value{0};
+    // kArray: items, kMap: pairs
+    size_t count{0};
+    bool bool_value{false};
+    double float_value{0};
+    // kText/kBytes
+    std::string_view data;
+
+    bool AsInt(int64_t& out) const;
+  };
+
+  CborReader(const uint8_t* data, size_t len);
+
+  // false at the end of input or on malformed input, see Error()
+  bool Next(Item& item);
+
+  // skip the content of an array/map/tag item just returned by Next
+  bool Skip(const Item& item);
+
+  bool Error() const { return error_; }
+
+  size_t Offset() const { return offset_; }
+
+ private:
+  bool ReadArgument(uint8_t info, uint64_t& value);
+
+  const uint8_t* data_;
+  size_t len_;
+  size_t offset_{0};
+  bool error_{false};
+};
+
+}  // namespace esp
@@ -0,0 +1,167 @@
+#include "cbor_benchmark.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <utility>
+
+#include "cbor.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "json_reader.h"
+
+static const char* TAG = "cbor_benchmark";
+
+#define DEVICE_ID "esp32-0a1b2c"
+#define BASE_TIMESTAMP_MS 1700000000000ULL
+// worst case json text per reading, "-1234.57,"
+#define JSON_BYTES_PER_READING 16
+#define RECORD_OVERHEAD_BYTES 128
+
+namespace esp {
+
+static float ReadingAt(uint32_t seq, uint32_t index) {
+  return (float)((seq * 7 + index * 13) % 5000) / 4.0f - 200.0f;
+}
+
+static bool EncodeCbor(uint32_t seq, uint32_t readings, uint8_t* buffer,
+                       size_t capacity, size_t& size) {
+  CborWriter writer(buffer, capacity);
+  writer.BeginMap(5);
+  writer.WriteText("id");
+  writer.WriteText(DEVICE_ID);
+  writer.WriteText("ts");
+  writer.WriteUint(BASE_TIMESTAMP_MS + seq);
+  writer.WriteText("seq");
+  writer.WriteUint(seq);
+  writer.WriteText("ok");
+  writer.WriteBool(true);
+  writer.WriteText("values");
+  writer.BeginArray(readings);
+  for (uint32_t i = 0; i < readings; ++i) {
+    writer.WriteFloat(ReadingAt(seq, i));
+  }
+  size = writer.Size();
+  return writer.Ok();
+}
+
+// what the app would write with snprintf, two decimals per reading
+static bool EncodeJson(uint32_t seq, uint32_t readings, char* buffer,
+                       size_t capacity, size_t& size) {
+  int len = snprintf(buffer, capacity,
+                     "{\"id\":\"" DEVICE_ID "\",\"ts\":%" PRIu64
+                     ",\"seq\":%u,\"ok\":true,\"values\":[",
+                     (uint64_t)(BASE_TIMESTAMP_MS + seq), (unsigned)seq);
+  if (len < 0 || (size_t)len >= capacity) {
+    return false;
+  }
+  size_t pos = len;
+  for (uint32_t i = 0; i < readings; ++i) {
+    len = snprintf(buffer + pos, capacity - pos, i == 0 ? "%.2f" : ",%.2f",
+                   (double)ReadingAt(seq, i));
+    if (len < 0 || pos + len >= capacity) {
+      return false;
+    }
+    pos += len;
+  }
+  if (pos + 2 >= capacity) {
+    return false;
+  }
+  buffer[pos++] = ']';
+  buffer[pos++] = '}';
+  size = pos;
+  return true;
+}
+
+// sum of the numbers, so the decoder work is not optimized away
+static bool DecodeCbor(const uint8_t* data, size_t len, double& sum) {
+  CborReader reader(data, len);
+  CborReader::Item item;
+  while (reader.Next(item)) {
+    if (item.type == CborReader::kUint) {
+      sum += (double)item.value;
+    } else if (item.type == CborReader::kFloat) {
+      sum += item.float_value;
+    }
+  }
+  return !reader.Error();
+}
+
+static bool DecodeJson(const char* data, size_t len, double& sum) {
+  JsonReader reader(data, len);
+  for (;;) {
+    auto token = reader.Next();
+    if (token == JsonReader::kEnd) {
+      return true;
+    }
+    if (token == JsonReader::kError) {
+      return false;
+    }
+    double value = 0;
+    if (token == JsonReader::kNumber &&
+        JsonReader::ParseDouble(reader.Value(), value)) {
+      sum += value;
+    }
+  }
+}
+
+CborBenchmark::CborBenchmark(Config config) : config_(std::move(config)) {}
+
+CborBenchmark::Result CborBenchmark::RunOne(uint32_t readings, bool cbor) {
+  Result result;
+  result.readings = readings;
+  result.cbor = cbor;
+  if (config_.iterations == 0) {
+    return result;
+  }
+  std::vector<uint8_t> buffer(RECORD_OVERHEAD_BYTES +
+                              readings * JSON_BYTES_PER_READING);
+  size_t size = 0;
+  size_t total_size = 0;
+  bool ok = true;
+
+  auto start_us = esp_timer_get_time();
+  for (uint32_t seq = 0; seq < config_.iterations && ok; ++seq) {
+    ok = cbor ? EncodeCbor(seq, readings, buffer.data(), buffer.size(), size)
+              : EncodeJson(seq, readings, (char*)buffer.data(),
+                           buffer.size(), size);
+    total_size += size;
+  }
+  auto encode_us = esp_timer_get_time() - start_us;
+
+  // the last record, decoded over and over
+  double sum = 0;
+  start_us = esp_timer_get_time();
+  for (uint32_t i = 0; i < config_.iterations && ok; ++i) {
+    ok = cbor ? DecodeCbor(buffer.data(), size, sum)
+              : DecodeJson((const char*)buffer.data(), size, sum);
+  }
+  auto decode_us = esp_timer_get_time() - start_us;
+
+  result.ok = ok;
+  result.payload_bytes = total_size / config_.iterations;
+  result.encode_ns = (uint32_t)(encode_us * 1000 / config_.iterations);
+  result.decode_ns = (uint32_t)(decode_us * 1000 / config_.iterations);
+  ESP_LOGD(TAG, "checksum %f", sum);
+  return result;
+}
+
+std::vector<CborBenchmark::Result> CborBenchmark::Run() {
+  std::vector<Result> results;
+  for (auto readings : config_.reading_counts) {
+    results.push_back(RunOne(readings, false));
+    results.push_back(RunOne(readings, true));
+  }
+  return results;
+}
+
+void CborBenchmark::LogReport(const std::vector<Result>& results) {
+  ESP_LOGI(TAG, "readings  format  bytes  encode ns  decode ns");
+  for (const auto& result : results) {
+    ESP_LOGI(TAG, "%8u  %-6s  %5u  %9u  %9u%s", (unsigned)result.readings,
+             result.cbor ? "cbor" : "json", (unsigned)result.payload_bytes,
+             (unsigned)result.encode_ns, (unsigned)result.decode_ns,
+             result.ok ? "" : "  failed");
+  }
+}
+
+}  // namespace esp
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace esp {
+
+// encodes and decodes one telemetry record (device id, timestamp,
+// sequence, status flag and an array of readings) as CBOR and as JSON,
+// and reports payload size and time per record, so the wire and cpu cost
+// of both formats can be compared on the device:
+//   CborBenchmark::LogReport(CborBenchmark({}).Run());
+class CborBenchmark {
+ public:
+  struct Config {
+    uint32_t iterations{1000};
+    // float readings per record
+    std::vector<uint32_t> reading_counts{1, 8, 32};
+  };
+
+  struct Result {
+    uint32_t readings{0};
+    bool cbor{false};
+    bool ok{false};
+    size_t payload_bytes{0};
+    uint32_t encode_ns{0};
+    uint32_t decode_ns{0};
+  };
+
+  explicit CborBenchmark(Config config);
+
+  // blocks the calling task for all the runs
+  std::vector<Result> Run();
+
+  static void LogReport(const std::vector<Result>& results);
+
+ private:
+  Result RunOne(uint32_t readings, bool cbor);
+
+  Config config_;
+};
+
+}  // namespace esp
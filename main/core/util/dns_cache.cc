@@ -0,0 +1,498 @@
+
+#include "dns_cache.h"
+
+#include <cstring>
+#include <strings.h>
+#include <utility>
+
+#include "delay.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "lwip/dns.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+#include "url.h"
+
+static const char* TAG = "dns_cache";
+
+#define DNS_PORT 53
+#define DNS_HEADER_SIZE 12
+#define DNS_MAX_MESSAGE_SIZE 512
+#define DNS_MAX_NAME_SIZE 253
+#define DNS_MAX_LABEL_SIZE 63
+#define DNS_TYPE_A 1
+#define DNS_CLASS_IN 1
+#define DNS_RCODE_NXDOMAIN 3
+#define PREFETCH_INTERVAL_MS 1000
+
+namespace esp {
+
+static void PrefetchTask(void* args) {
+  auto self = (DnsCache*)args;
+  if (self) {
+    self->PrefetchLoop();
+  }
+}
+
+static uint16_t Read16(const uint8_t* data) {
+  return (uint16_t)((data[0] << 8) | data[1]);
+}
+
+static uint32_t Read32(const uint8_t* data) {
+  return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+         ((uint32_t)data[2] << 8) | data[3];
+}
+
+// offset past the name at offset, 0 if malformed. a compression pointer
+// ends the name
+static size_t SkipName(const uint8_t* data, size_t size, size_t offset) {
+  while (offset < size) {
+    uint8_t len = data[offset];
+    if (len == 0) {
+      return offset + 1;
+    }
+    if ((len & 0xc0) == 0xc0) {
+      return offset + 2 <= size ? offset + 2 : 0;
+    }
+    if (len & 0xc0) {
+      return 0;
+    }
+    offset += len + 1;
+  }
+  return 0;
+}
+
+// standard query for the A record of host, 0 if the name is invalid
+static size_t BuildQuery(uint16_t id, const char* host, uint8_t* data) {
+  size_t host_len = strlen(host);
+  if (host_len == 0 || host_len > DNS_MAX_NAME_SIZE) {
+    return 0;
+  }
+  memset(data, 0, DNS_HEADER_SIZE);
+  data[0] = id >> 8;
+  data[1] = id & 0xff;
+  // recursion desired
+  data[2] = 0x01;
+  // one question
+  data[5] = 1;
+  size_t offset = DNS_HEADER_SIZE;
+  const char* label = host;
+  while (*label) {
+    const char* dot = strchr(label, '.');
+    size_t len = dot ? (size_t)(dot - label) : strlen(label);
+    if (len == 0 || len > DNS_MAX_LABEL_SIZE) {
+      return 0;
+    }
+    data[offset++] = (uint8_t)len;
+    memcpy(data + offset, label, len);
+    offset += len;
+    label = dot ? dot + 1 : label + len;
+  }
+  data[offset++] = 0;
+  data[offset++] = 0;
+  data[offset++] = DNS_TYPE_A;
+  data[offset++] = 0;
+  data[offset++] = DNS_CLASS_IN;
+  return offset;
+}
+
+static bool IsIpLiteral(const char* host) {
+  struct in_addr addr;
+  return inet_pton(AF_INET, host, &addr) == 1 || strchr(host, ':');
+}
+
+static std::string FormatAddress(uint32_t address) {
+  char text[INET_ADDRSTRLEN];
+  struct in_addr addr;
+  addr.s_addr = address;
+  inet_ntop(AF_INET, &addr, text, sizeof(text));
+  return text;
+}
+
+DnsCache* DnsCache::Instance() {
+  static DnsCache INSTANCE(Config{});
+  return &INSTANCE;
+}
+
+DnsCache::DnsCache(Config config) : config_(std::move(config)) {
+  entries_.reserve(config_.max_entries);
+}
+
+DnsCache::~DnsCache() { Stop(); }
+
+bool DnsCache::Start() {
+  if (task_handle_) {
+    return true;
+  }
+  exit_ = false;
+  exit_sem_ = xSemaphoreCreateBinary();
+  TaskHandle_t task = nullptr;
+  auto ret = xTaskCreate(PrefetchTask, "dns_prefetch", config_.task_stack_size,
+                         (void*)this, config_.task_priority, &task);
+  if (ret != pdPASS) {
+    ESP_LOGE(TAG, "start prefetch task failed");
+    vSemaphoreDelete((SemaphoreHandle_t)exit_sem_);
+    exit_sem_ = nullptr;
+    return false;
+  }
+  task_handle_ = task;
+  return true;
+}
+
+void DnsCache::Stop() {
+  if (!task_handle_) {
+    return;
+  }
+  exit_ = true;
+  xSemaphoreTake((SemaphoreHandle_t)exit_sem_, portMAX_DELAY);
+  vSemaphoreDelete((SemaphoreHandle_t)exit_sem_);
+  exit_sem_ = nullptr;
+  task_handle_ = nullptr;
+}
+
+int DnsCache::FindLocked(const char* host) {
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    if (strcasecmp(entries_[i].host.c_str(), host) == 0) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+void DnsCache::StoreLocked(const char* host, uint32_t address,
+                           uint32_t ttl_ms, int64_t now) {
+  int index = FindLocked(host);
+  if (index < 0) {
+    if (config_.max_entries == 0) {
+      return;
+    }
+    if (entries_.size() >= config_.max_entries) {
+      // dead entries go first, before a live one is pushed out
+      EvictDeadLocked(now);
+    }
+    if (entries_.size() >= config_.max_entries) {
+      size_t oldest = 0;
+      for (size_t i = 1; i < entries_.size(); ++i) {
+        if (entries_[i].last_used_us < entries_[oldest].last_used_us) {
+          oldest = i;
+        }
+      }
+      entries_.erase(entries_.begin() + oldest);
+    }
+    entries_.push_back(Entry{host, 0, 0, now, 0});
+    index = (int)entries_.size() - 1;
+  }
+  auto& entry = entries_[index];
+  entry.address = address;
+  entry.expires_us = now + (int64_t)ttl_ms * 1000;
+  entry.refreshed_us = now;
+  stats_.entries = entries_.size();
+}
+
+void DnsCache::EvictDeadLocked(int64_t now) {
+  int64_t stale_us = (int64_t)config_.stale_ms * 1000;
+  for (size_t i = entries_.size(); i > 0; --i) {
+    if (now >= entries_[i - 1].expires_us + stale_us) {
+      entries_.erase(entries_.begin() + (i - 1));
+      stats_.evicted_dead++;
+    }
+  }
+  stats_.entries = entries_.size();
+}
+
+void DnsCache::RecordLocked(int64_t start_us) {
+  stats_.lookup_latency.Record(
+      (uint32_t)((esp_timer_get_time() - start_us) / 1000));
+}
+
+bool DnsCache::Resolve(const char* host, std::string& address) {
+  if (IsIpLiteral(host)) {
+    address = host;
+    return true;
+  }
+  int64_t start = esp_timer_get_time();
+  mutex_.Lock();
+  stats_.lookups++;
+  int index = FindLocked(host);
+  if (index >= 0 && start < entries_[index].expires_us) {
+    stats_.hits++;
+    entries_[index].last_used_us = start;
+    address = FormatAddress(entries_[index].address);
+    RecordLocked(start);
+    mutex_.Unlock();
+    return true;
+  }
+  stats_.misses++;
+  mutex_.Unlock();
+
+  uint32_t resolved = 0;
+  uint32_t ttl_ms = 0;
+  auto result = Query(host, resolved, ttl_ms);
+
+  mutex_.Lock();
+  int64_t now = esp_timer_get_time();
+  // the entry may have moved while the query was in flight
+  index = FindLocked(host);
+  bool ok = false;
+  if (result == kQueryOk) {
+    StoreLocked(host, resolved, ttl_ms, now);
+    address = FormatAddress(resolved);
+    ok = true;
+  } else if (result == kQueryFailed && index >= 0 &&
+             now < entries_[index].expires_us +
+                       (int64_t)config_.stale_ms * 1000) {
+    stats_.stale_served++;
+    entries_[index].last_used_us = now;
+    address = FormatAddress(entries_[index].address);
+    ok = true;
+  } else {
+    if (index >= 0) {
+      entries_.erase(entries_.begin() + index);
+      stats_.entries = entries_.size();
+    }
+    stats_.failures++;
+  }
+  RecordLocked(start);
+  mutex_.Unlock();
+  if (!ok) {
+    ESP_LOGW(TAG, "resolve %s failed", host);
+  }
+  return ok;
+}
+
+bool DnsCache::RewriteUrl(std::string_view url, std::string& rewritten) {
+  Url parsed;
+  if (!ParseUrl(url, parsed) || parsed.secure) {
+    return false;
+  }
+  if (parsed.scheme.size() != 4 ||
+      (strncasecmp(parsed.scheme.data(), "http", 4) != 0 &&
+       strncasecmp(parsed.scheme.data(), "mqtt", 4) != 0)) {
+    return false;
+  }
+  std::string host(parsed.host);
+  if (IsIpLiteral(host.c_str())) {
+    return false;
+  }
+  std::string address;
+  if (!Resolve(host.c_str(), address)) {
+    return false;
+  }
+  size_t host_start = parsed.host.data() - url.data();
+  rewritten.assign(url.substr(0, host_start));
+  rewritten.append(address);
+  rewritten.append(url.substr(host_start + parsed.host.size()));
+  return true;
+}
+
+DnsCache::QueryResult DnsCache::Query(const char* host, uint32_t& address,
+                                      uint32_t& ttl_ms) {
+  uint32_t servers[DNS_MAX_SERVERS];
+  uint32_t server_count = 0;
+  for (uint8_t i = 0; i < DNS_MAX_SERVERS; ++i) {
+    const ip_addr_t* server = dns_getserver(i);
+    if (server && IP_IS_V4(server) && !ip_addr_isany(server)) {
+      servers[server_count++] = ip_2_ip4(server)->addr;
+    }
+  }
+  for (uint32_t i = 0; i < server_count; ++i) {
+    auto result = QueryServer(servers[i], host, address, ttl_ms);
+    if (result != kQueryFailed) {
+      return result;
+    }
+  }
+  if (server_count > 0) {
+    return kQueryFailed;
+  }
+
+  // no server known to lwip, getaddrinfo may still answer from hosts or
+  // mdns, it hides the ttl
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* info = nullptr;
+  int err = getaddrinfo(host, nullptr, &hints, &info);
+  if (err != 0 || !info) {
+    return kQueryFailed;
+  }
+  address = ((struct sockaddr_in*)info->ai_addr)->sin_addr.s_addr;
+  freeaddrinfo(info);
+  ttl_ms = config_.default_ttl_ms;
+  return kQueryOk;
+}
+
+DnsCache::QueryResult DnsCache::QueryServer(uint32_t server,
+                                            const char* host,
+                                            uint32_t& address,
+                                            uint32_t& ttl_ms) {
+  uint8_t message[DNS_MAX_MESSAGE_SIZE];
+  auto id = (uint16_t)esp_random();
+  size_t query_size = BuildQuery(id, host, message);
+  if (query_size == 0) {
+    return kQueryNoName;
+  }
+  int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (fd < 0) {
+    ESP_LOGE(TAG, "create socket failed");
+    return kQueryFailed;
+  }
+  struct timeval timeout;
+  timeout.tv_sec = config_.query_timeout_ms / 1000;
+  timeout.tv_usec = (config_.query_timeout_ms % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(DNS_PORT);
+  addr.sin_addr.s_addr = server;
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      send(fd, message, query_size, 0) != (int)query_size) {
+    close(fd);
+    return kQueryFailed;
+  }
+  // skip late answers to an earlier query
+  int received = 0;
+  do {
+    received = recv(fd, message, sizeof(message), 0);
+  } while (received >= DNS_HEADER_SIZE && Read16(message) != id);
+  close(fd);
+  if (received < DNS_HEADER_SIZE || !(message[2] & 0x80)) {
+    return kQueryFailed;
+  }
+  size_t size = received;
+  uint8_t rcode = message[3] & 0x0f;
+  if (rcode == DNS_RCODE_NXDOMAIN) {
+    return kQueryNoName;
+  }
+  if (rcode != 0) {
+    return kQueryFailed;
+  }
+
+  uint16_t questions = Read16(message + 4);
+  uint16_t answers = Read16(message + 6);
+  size_t offset = DNS_HEADER_SIZE;
+  for (uint16_t i = 0; i < questions && offset; ++i) {
+    offset = SkipName(message, size, offset);
+    offset = offset && offset + 4 <= size ? offset + 4 : 0;
+  }
+  bool found = false;
+  uint32_t min_ttl = UINT32_MAX;
+  // the lowest ttl along the cname chain bounds the answer
+  for (uint16_t i = 0; i < answers && offset; ++i) {
+    offset = SkipName(message, size, offset);
+    if (!offset || offset + 10 > size) {
+      break;
+    }
+    uint16_t type = Read16(message + offset);
+    uint16_t rclass = Read16(message + offset + 2);
+    uint32_t ttl = Read32(message + offset + 4);
+    uint16_t len = Read16(message + offset + 8);
+    offset += 10;
+    if (offset + len > size) {
+      break;
+    }
+    if (rclass == DNS_CLASS_IN && ttl < min_ttl) {
+      min_ttl = ttl;
+    }
+    if (!found && type == DNS_TYPE_A && rclass == DNS_CLASS_IN &&
+        len == 4) {
+      memcpy(&address, message + offset, 4);
+      found = true;
+    }
+    offset += len;
+  }
+  if (!found) {
+    return kQueryFailed;
+  }
+  uint64_t ms = (uint64_t)min_ttl * 1000;
+  if (ms < config_.min_ttl_ms) {
+    ms = config_.min_ttl_ms;
+  } else if (ms > config_.max_ttl_ms) {
+    ms = config_.max_ttl_ms;
+  }
+  ttl_ms = (uint32_t)ms;
+  return kQueryOk;
+}
+
+void DnsCache::Remove(const char* host) {
+  mutex_.Lock();
+  int index = FindLocked(host);
+  if (index >= 0) {
+    entries_.erase(entries_.begin() + index);
+    stats_.entries = entries_.size();
+  }
+  mutex_.Unlock();
+}
+
+void DnsCache::Clear() {
+  mutex_.Lock();
+  entries_.clear();
+  stats_.entries = 0;
+  mutex_.Unlock();
+}
+
+DnsCache::Stats DnsCache::GetStats() {
+  mutex_.Lock();
+  auto stats = stats_;
+  mutex_.Unlock();
+  return stats;
+}
+
+void DnsCache::PrefetchLoop() {
+  std::vector<std::string> hosts;
+  while (!exit_) {
+    DelayMS(PREFETCH_INTERVAL_MS);
+    mutex_.Lock();
+    int64_t now = esp_timer_get_time();
+    EvictDeadLocked(now);
+    if (config_.prefetch_ms == 0) {
+      mutex_.Unlock();
+      continue;
+    }
+    hosts.clear();
+    int64_t window = (int64_t)config_.prefetch_ms * 1000;
+    for (auto& entry : entries_) {
+      if (entry.last_used_us > entry.refreshed_us &&
+          entry.expires_us - now < window) {
+        hosts.push_back(entry.host);
+      }
+    }
+    mutex_.Unlock();
+
+    for (auto& host : hosts) {
+      if (exit_) {
+        break;
+      }
+      uint32_t address = 0;
+      uint32_t ttl_ms = 0;
+      auto result = Query(host.c_str(), address, ttl_ms);
+      mutex_.Lock();
+      if (result == kQueryOk) {
+        StoreLocked(host.c_str(), address, ttl_ms, esp_timer_get_time());
+        stats_.prefetches++;
+      } else {
+        int index = FindLocked(host.c_str());
+        if (index >= 0 && result == kQueryNoName) {
+          entries_.erase(entries_.begin() + index);
+          stats_.entries = entries_.size();
+        } else if (index >= 0) {
+          // not again until the entry is used, a dead server is not
+          // queried every interval
+          entries_[index].refreshed_us = esp_timer_get_time();
+        }
+      }
+      mutex_.Unlock();
+      ESP_LOGD(TAG, "prefetch %s %s", host.c_str(),
+               result == kQueryOk ? "ok" : "failed");
+    }
+  }
+  xSemaphoreGive((SemaphoreHandle_t)exit_sem_);
+  vTaskDelete(NULL);
+}
+
+}  // namespace esp
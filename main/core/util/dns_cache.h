@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "latency_histogram.h"
+#include "mutex.h"
+
+namespace esp {
+
+// process wide ipv4 cache in front of lwip dns, keyed by host name:
+//   DnsCache::Instance()->Start();
+//   client.SetDnsCache(DnsCache::Instance());
+// answers keep the ttl of the A record (clamped to [min_ttl_ms,
+// max_ttl_ms]), so repeated connects skip the round trip to the resolver.
+// an expired entry is refreshed on use, when the refresh fails it is
+// served stale for up to stale_ms. the prefetch task refreshes entries
+// used since their last refresh before they expire, so a busy host never
+// waits on a lookup. a failed prefetch is not repeated until the entry is
+// used again, entries past stale_ms are dropped
+class DnsCache {
+ public:
+  struct Config {
+    size_t max_entries{8};
+    uint32_t min_ttl_ms{30 * 1000};
+    uint32_t max_ttl_ms{3600 * 1000};
+    // ttl of answers from getaddrinfo, used when no dns server is known
+    uint32_t default_ttl_ms{300 * 1000};
+    // 0 never serves an expired answer
+    uint32_t stale_ms{3600 * 1000};
+    // refresh when less than this is left of the ttl, 0 disables prefetch
+    uint32_t prefetch_ms{10 * 1000};
+    // per server, the query goes to the second server on timeout
+    uint32_t query_timeout_ms{2000};
+    uint32_t task_stack_size{3072};
+    uint32_t task_priority{3};
+  };
+
+  struct Stats {
+    uint32_t lookups{0};
+    // answered from a live entry
+    uint32_t hits{0};
+    uint32_t misses{0};
+    // expired entry returned because the refresh failed
+    uint32_t stale_served{0};
+    uint32_t failures{0};
+    uint32_t prefetches{0};
+    // entries dropped after expiring for longer than stale_ms
+    uint32_t evicted_dead{0};
+    // Resolve, including the ones answered from the cache
+    LatencyHistogram lookup_latency;
+    size_t entries{0};
+  };
+
+  // shared by all clients, the prefetch task is not started
+  static DnsCache* Instance();
+
+  explicit DnsCache(Config config);
+
+  ~DnsCache();
+
+  // start the prefetch task
+  bool Start();
+
+  void Stop();
+
+  // dotted ipv4 address of host, an ip literal is returned as is
+  bool Resolve(const char* host, std::string& address);
+
+  // url with the host replaced by its cached address, false when the url
+  // is left alone: ip literals, and https/mqtts/wss which need the name
+  // for sni and certificate checks
+  bool RewriteUrl(std::string_view url, std::string& rewritten);
+
+  void Remove(const char* host);
+
+  void Clear();
+
+  Stats GetStats();
+
+  // prefetch task loop
+  void PrefetchLoop();
+
+ private:
+  struct Entry {
+    std::string host;
+    uint32_t address;
+    int64_t expires_us;
+    int64_t last_used_us;
+    int64_t refreshed_us;
+  };
+
+  enum QueryResult {
+    kQueryOk = 0,
+    // the name does not exist, the entry is dropped
+    kQueryNoName,
+    // no answer, a stale entry may still be served
+    kQueryFailed,
+  };
+
+  // A query to the lwip dns servers, getaddrinfo when none is set
+  QueryResult Query(const char* host, uint32_t& address, uint32_t& ttl_ms);
+
+  QueryResult QueryServer(uint32_t server, const char* host,
+                          uint32_t& address, uint32_t& ttl_ms);
+
+  // index of host, -1 if missing
+  int FindLocked(const char* host);
+
+  void StoreLocked(const char* host, uint32_t address, uint32_t ttl_ms,
+                   int64_t now);
+
+  void RecordLocked(int64_t start_us);
+
+  // drop entries expired for longer than stale_ms, they are never served
+  void EvictDeadLocked(int64_t now);
+
+  Config config_;
+  Mutex mutex_;
+  std::vector<Entry> entries_;
+  std::atomic<bool> exit_{false};
+  void* task_handle_{nullptr};
+  void* exit_sem_{nullptr};
+  Stats stats_;
+};
+
+}  // namespace esp
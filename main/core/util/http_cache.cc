@@ -0,0 +1,333 @@
+#include "http_cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <utility>
+
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "http_response.h"
+#include "nvs.h"
+
+static const char* TAG = "http_cache";
+
+#define SHARED_CACHE_MAX_ENTRIES 8
+#define SHARED_CACHE_MAX_BYTES (32 * 1024)
+#define SHARED_CACHE_MAX_BODY_SIZE (8 * 1024)
+#define CACHE_NVS_NAMESPACE "http_cache"
+// one byte length in the flash record
+#define MAX_FLASH_VALIDATOR_LEN 255
+
+namespace esp {
+
+// flash slot blob: record, url, etag, last modified, body
+struct FlashRecord {
+  uint32_t url_crc;
+  uint16_t url_len;
+  uint8_t etag_len;
+  uint8_t last_modified_len;
+  uint32_t body_len;
+};
+
+static uint32_t UrlCrc(const std::string& url) {
+  return esp_rom_crc32_le(0, (const uint8_t*)url.data(), url.size());
+}
+
+HttpCache* HttpCache::Instance() {
+  static HttpCache INSTANCE(Config{SHARED_CACHE_MAX_ENTRIES,
+                                   SHARED_CACHE_MAX_BYTES,
+                                   SHARED_CACHE_MAX_BODY_SIZE, 0});
+  return &INSTANCE;
+}
+
+HttpCache::HttpCache(Config config) : config_(std::move(config)) {
+  entries_.reserve(config_.max_entries);
+}
+
+int HttpCache::FindLocked(const std::string& url) {
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    if (entries_[i].url == url) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool HttpCache::Matches(const Entry& entry, const Validators& validators,
+                        HttpResponse* response) {
+  if (entry.etag != validators.etag ||
+      entry.last_modified != validators.last_modified ||
+      entry.body.size() != response->ResponseDataSize()) {
+    return false;
+  }
+  size_t offset = 0;
+  for (size_t i = 0; i < response->ResponseChunkCount(); ++i) {
+    auto chunk = response->ResponseChunk(i);
+    if (memcmp(entry.body.data() + offset, chunk.data(), chunk.size()) != 0) {
+      return false;
+    }
+    offset += chunk.size();
+  }
+  return true;
+}
+
+void HttpCache::EraseLocked(size_t index) {
+  stats_.bytes -= entries_[index].Bytes();
+  entries_.erase(entries_.begin() + index);
+  stats_.entries = entries_.size();
+}
+
+void HttpCache::InsertLocked(Entry entry) {
+  int index = FindLocked(entry.url);
+  if (index >= 0) {
+    EraseLocked(index);
+  }
+  // least recently used first
+  while (!entries_.empty() &&
+         (entries_.size() >= config_.max_entries ||
+          stats_.bytes + entry.Bytes() > config_.max_bytes)) {
+    size_t oldest = 0;
+    for (size_t i = 1; i < entries_.size(); ++i) {
+      if (entries_[i].last_used_us < entries_[oldest].last_used_us) {
+        oldest = i;
+      }
+    }
+    EraseLocked(oldest);
+    ++stats_.evicted;
+  }
+  if (entry.Bytes() > config_.max_bytes) {
+    return;
+  }
+  stats_.bytes += entry.Bytes();
+  entries_.push_back(std::move(entry));
+  stats_.entries = entries_.size();
+}
+
+bool HttpCache::Lookup(const std::string& url, Validators& validators) {
+  mutex_.Lock();
+  int index = FindLocked(url);
+  if (index >= 0) {
+    validators.etag = entries_[index].etag;
+    validators.last_modified = entries_[index].last_modified;
+    validators.body = entries_[index].body;
+  }
+  mutex_.Unlock();
+  if (index >= 0) {
+    return true;
+  }
+
+  Entry entry;
+  if (config_.flash_slots == 0 || !LoadFlash(url, entry)) {
+    return false;
+  }
+  validators.etag = entry.etag;
+  validators.last_modified = entry.last_modified;
+  validators.body = entry.body;
+  entry.last_used_us = esp_timer_get_time();
+  mutex_.Lock();
+  ++stats_.flash_loads;
+  InsertLocked(std::move(entry));
+  mutex_.Unlock();
+  return true;
+}
+
+void HttpCache::Complete(const std::string& url, Validators* cached,
+                         const Validators& validators,
+                         HttpResponse* response) {
+  if (!response) {
+    return;
+  }
+  auto status = response->GetStatusCode();
+  auto now = esp_timer_get_time();
+  mutex_.Lock();
+  ++stats_.requests;
+  if (status == 304 && cached) {
+    // the entry may be gone by now, the body sent along with the
+    // validators is the one the server confirmed
+    int index = FindLocked(url);
+    if (index >= 0) {
+      entries_[index].last_used_us = now;
+    }
+    ++stats_.hits;
+    stats_.bytes_saved += cached->body.size();
+    mutex_.Unlock();
+    response->SetResponseData(std::move(cached->body));
+    response->SetStatusCode(200);
+    return;
+  }
+  ++stats_.misses;
+  if (status != 200) {
+    mutex_.Unlock();
+    return;
+  }
+  if (validators.no_store ||
+      (validators.etag.empty() && validators.last_modified.empty()) ||
+      response->ResponseDataSize() > config_.max_body_size) {
+    ++stats_.uncacheable;
+    // a stale entry would be revalidated for nothing
+    mutex_.Unlock();
+    Remove(url);
+    return;
+  }
+  bool flash = config_.flash_slots > 0 &&
+               response->ResponseDataSize() <= config_.flash_max_body_size;
+  int index = FindLocked(url);
+  if (index >= 0 && (entries_[index].in_flash || !flash) &&
+      Matches(entries_[index], validators, response)) {
+    // a 200 repeating what is cached, keep the entry and spare the flash
+    entries_[index].last_used_us = now;
+    ++stats_.stored;
+    mutex_.Unlock();
+    return;
+  }
+  mutex_.Unlock();
+
+  Entry entry{url, validators.etag, validators.last_modified, {}, now};
+  entry.body.reserve(response->ResponseDataSize());
+  for (size_t i = 0; i < response->ResponseChunkCount(); ++i) {
+    auto chunk = response->ResponseChunk(i);
+    entry.body.insert(entry.body.end(), chunk.begin(), chunk.end());
+  }
+  if (flash) {
+    entry.in_flash = SaveFlash(entry);
+  }
+  mutex_.Lock();
+  ++stats_.stored;
+  InsertLocked(std::move(entry));
+  mutex_.Unlock();
+}
+
+void HttpCache::Remove(const std::string& url) {
+  mutex_.Lock();
+  int index = FindLocked(url);
+  if (index >= 0) {
+    EraseLocked(index);
+  }
+  mutex_.Unlock();
+  if (config_.flash_slots > 0) {
+    EraseFlash(url);
+  }
+}
+
+void HttpCache::Clear() {
+  mutex_.Lock();
+  entries_.clear();
+  stats_.entries = 0;
+  stats_.bytes = 0;
+  mutex_.Unlock();
+}
+
+HttpCache::Stats HttpCache::GetStats() {
+  mutex_.Lock();
+  auto stats = stats_;
+  mutex_.Unlock();
+  return stats;
+}
+
+bool HttpCache::LoadFlash(const std::string& url, Entry& entry) {
+  uint32_t crc = UrlCrc(url);
+  char key[16];
+  snprintf(key, sizeof(key), "slot%u", (unsigned)(crc % config_.flash_slots));
+  nvs_handle_t handle;
+  if (nvs_open(CACHE_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+    return false;
+  }
+  size_t len = 0;
+  std::vector<uint8_t> blob;
+  auto err = nvs_get_blob(handle, key, nullptr, &len);
+  if (err == ESP_OK && len >= sizeof(FlashRecord)) {
+    blob.resize(len);
+    err = nvs_get_blob(handle, key, blob.data(), &len);
+  }
+  nvs_close(handle);
+  if (err != ESP_OK || blob.size() < sizeof(FlashRecord)) {
+    return false;
+  }
+  FlashRecord record;
+  memcpy(&record, blob.data(), sizeof(record));
+  // the slot may hold another url
+  if (record.url_crc != crc ||
+      blob.size() != sizeof(record) + record.url_len + record.etag_len +
+                         record.last_modified_len + record.body_len) {
+    return false;
+  }
+  auto data = (const char*)blob.data() + sizeof(record);
+  if (url.compare(0, std::string::npos, data, record.url_len) != 0) {
+    return false;
+  }
+  data += record.url_len;
+  entry.url = url;
+  entry.etag.assign(data, record.etag_len);
+  data += record.etag_len;
+  entry.last_modified.assign(data, record.last_modified_len);
+  data += record.last_modified_len;
+  entry.body.assign(data, data + record.body_len);
+  entry.in_flash = true;
+  return true;
+}
+
+bool HttpCache::SaveFlash(const Entry& entry) {
+  if (entry.url.size() > UINT16_MAX ||
+      entry.etag.size() > MAX_FLASH_VALIDATOR_LEN ||
+      entry.last_modified.size() > MAX_FLASH_VALIDATOR_LEN) {
+    return false;
+  }
+  FlashRecord record;
+  record.url_crc = UrlCrc(entry.url);
+  record.url_len = entry.url.size();
+  record.etag_len = entry.etag.size();
+  record.last_modified_len = entry.last_modified.size();
+  record.body_len = entry.body.size();
+  std::vector<uint8_t> blob(sizeof(record));
+  memcpy(blob.data(), &record, sizeof(record));
+  blob.insert(blob.end(), entry.url.begin(), entry.url.end());
+  blob.insert(blob.end(), entry.etag.begin(), entry.etag.end());
+  blob.insert(blob.end(), entry.last_modified.begin(),
+              entry.last_modified.end());
+  blob.insert(blob.end(), entry.body.begin(), entry.body.end());
+
+  char key[16];
+  snprintf(key, sizeof(key), "slot%u",
+           (unsigned)(record.url_crc % config_.flash_slots));
+  nvs_handle_t handle;
+  if (nvs_open(CACHE_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+    ESP_LOGE(TAG, "open nvs for the cache failed");
+    return false;
+  }
+  auto err = nvs_set_blob(handle, key, blob.data(), blob.size());
+  if (err == ESP_OK) {
+    err = nvs_commit(handle);
+  }
+  nvs_close(handle);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "save %s to flash failed:%s", entry.url.c_str(),
+             esp_err_to_name(err));
+    return false;
+  }
+  mutex_.Lock();
+  ++stats_.flash_writes;
+  mutex_.Unlock();
+  return true;
+}
+
+void HttpCache::EraseFlash(const std::string& url) {
+  Entry entry;
+  // only if the slot holds this url
+  if (!LoadFlash(url, entry)) {
+    return;
+  }
+  char key[16];
+  snprintf(key, sizeof(key), "slot%u",
+           (unsigned)(UrlCrc(url) % config_.flash_slots));
+  nvs_handle_t handle;
+  if (nvs_open(CACHE_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+    return;
+  }
+  if (nvs_erase_key(handle, key) == ESP_OK) {
+    nvs_commit(handle);
+  }
+  nvs_close(handle);
+}
+
+}  // namespace esp
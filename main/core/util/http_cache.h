@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "mutex.h"
+
+namespace esp {
+
+class HttpResponse;
+
+// response cache for polled GET endpoints. HttpClient sends the stored
+// ETag / Last-Modified as If-None-Match / If-Modified-Since, and a 304 is
+// answered with the stored body (status 200) instead of downloading it
+// again. a bounded ram tier (lru) and an optional flash tier in nvs, so
+// the first poll after a reboot is a 304 too:
+//   client.SetCache(HttpCache::Instance());
+class HttpCache {
+ public:
+  struct Config {
+    size_t max_entries{8};
+    // ram tier, bodies plus validators
+    size_t max_bytes{32 * 1024};
+    // larger bodies are not cached
+    size_t max_body_size{8 * 1024};
+    // nvs slots, 0 disables the flash tier. the nvs partition is small
+    // (see partitions.csv), keep it to a few small bodies
+    size_t flash_slots{0};
+    size_t flash_max_body_size{2048};
+  };
+
+  struct Stats {
+    // cacheable requests, GET without a sink
+    uint32_t requests{0};
+    // 304 served from the cache
+    uint32_t hits{0};
+    uint32_t misses{0};
+    uint32_t stored{0};
+    uint32_t evicted{0};
+    // responses without a validator or with Cache-Control: no-store
+    uint32_t uncacheable{0};
+    uint32_t flash_loads{0};
+    uint32_t flash_writes{0};
+    // body bytes not downloaded thanks to a 304
+    uint64_t bytes_saved{0};
+    size_t entries{0};
+    size_t bytes{0};
+  };
+
+  struct Validators {
+    std::string etag;
+    std::string last_modified;
+    // Cache-Control: no-store, response only
+    bool no_store{false};
+    // body stored with the validators, set by Lookup, so a 304 is answered
+    // even when the entry is evicted or replaced before Complete
+    std::vector<char> body;
+  };
+
+  // shared by the http clients, ram tier only
+  static HttpCache* Instance();
+
+  explicit HttpCache(Config config);
+
+  // validators to send for url and a copy of the body they belong to,
+  // false if nothing is cached
+  bool Lookup(const std::string& url, Validators& validators);
+
+  // response to a GET of url. cached is what Lookup returned when the
+  // request was sent with its validators, nullptr otherwise. a 304 gets
+  // the body from cached (moved out) and status 200, a 200 with a
+  // validator is stored
+  void Complete(const std::string& url, Validators* cached,
+                const Validators& validators, HttpResponse* response);
+
+  // ram and flash tier
+  void Remove(const std::string& url);
+
+  // ram tier only, flash slots are overwritten as they are reused
+  void Clear();
+
+  Stats GetStats();
+
+ private:
+  struct Entry {
+    std::string url;
+    std::string etag;
+    std::string last_modified;
+    std::vector<char> body;
+    int64_t last_used_us;
+    // the flash slot holds this entry, as of the last load or save
+    bool in_flash{false};
+
+    size_t Bytes() const {
+      return url.size() + etag.size() + last_modified.size() + body.size();
+    }
+  };
+
+  // index in entries_, -1 if missing
+  int FindLocked(const std::string& url);
+
+  // same validators and body as the response
+  static bool Matches(const Entry& entry, const Validators& validators,
+                      HttpResponse* response);
+
+  void InsertLocked(Entry entry);
+
+  void EraseLocked(size_t index);
+
+  bool LoadFlash(const std::string& url, Entry& entry);
+
+  bool SaveFlash(const Entry& entry);
+
+  void EraseFlash(const std::string& url);
+
+  Config config_;
+  Mutex mutex_;
+  std::vector<Entry> entries_;
+  Stats stats_;
+};
+
+}  // namespace esp
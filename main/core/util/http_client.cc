@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <cstdint>
 #include <cstring>
 
@@ -10,37 +11,123 @@
 
 #include "esp_crt_bundle.h"
 #include "esp_http_client.h"
+#include "esp_timer.h"
 #include "esp_tls.h"
 #include "esp_log.h"
+#include "buffer_pool.h"
+#include "dns_cache.h"
+#include "http_cache.h"
+#include "http_connection_pool.h"
+#include "inflate_stream.h"
+#include "tls_handshake_metrics.h"
+#include "url.h"
 
 #define MAX_HTTP_RECV_BUFFER 512
 #define MAX_HTTP_OUTPUT_BUFFER 2048
+// esp_http_client default, restored on pooled handles
+#define DEFAULT_HTTP_TIMEOUT_MS 5000
+#define ACCEPT_ENCODING "gzip, deflate"
 
 static const char* TAG = "HTTP";
 
 namespace esp {
 
+struct RequestContext {
+  HttpResponse* response;
+  // new connections made during the request
+  uint32_t connects;
+  int64_t connected_us;
+  // body goes to a sink, not into the response
+  bool streaming;
+  bool accept_encoding;
+  // set by a Content-Encoding response header
+  std::unique_ptr<InflateStream> inflater;
+  bool body_started;
+  // a header or body byte arrived, the request cannot be retried
+  bool response_started;
+  bool inflate_failed;
+  // response validators for the cache
+  HttpCache::Validators validators;
+};
+
+static bool AppendInflated(HttpResponse* response, const uint8_t* data,
+                           size_t len) {
+  response->AppendResponseData((const char*)data, len);
+  return true;
+}
+
 static esp_err_t HttpEventHandler(esp_http_client_event_t* evt) {
-  auto response = (HttpResponse*)evt->user_data;
+  auto context = (RequestContext*)evt->user_data;
+  if (!context) {
+    // idle pooled handle being closed
+    return ESP_OK;
+  }
+  auto response = context->response;
   switch (evt->event_id) {
     case HTTP_EVENT_ERROR:
       ESP_LOGE(TAG, "HTTP_EVENT_ERROR");
       break;
     case HTTP_EVENT_ON_CONNECTED:
       ESP_LOGI(TAG, "HTTP_EVENT_ON_CONNECTED");
+      ++context->connects;
+      context->connected_us = esp_timer_get_time();
       break;
     case HTTP_EVENT_HEADER_SENT:
       break;
     case HTTP_EVENT_ON_HEADER:
       ESP_LOGI(TAG, "HTTP_EVENT_ON_HEADER");
+      context->response_started = true;
       // ESP_LOGI(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s",
       // evt->header_key, evt->header_value);
+      if (context->body_started) {
+        // headers after a body are a new response, a redirect was followed
+        context->inflater.reset();
+        context->validators = HttpCache::Validators();
+        context->body_started = false;
+      }
       response->AddHeader(evt->header_key, evt->header_value);
+      if (context->accept_encoding &&
+          strcasecmp(evt->header_key, "Content-Encoding") == 0) {
+        InflateStream::Format format;
+        if (InflateStream::FormatOf(evt->header_value, format)) {
+          context->inflater = std::make_unique<InflateStream>(format);
+        }
+      }
+      if (strcasecmp(evt->header_key, "ETag") == 0) {
+        context->validators.etag = evt->header_value;
+      } else if (strcasecmp(evt->header_key, "Last-Modified") == 0) {
+        context->validators.last_modified = evt->header_value;
+      } else if (strcasecmp(evt->header_key, "Cache-Control") == 0 &&
+                 strstr(evt->header_value, "no-store")) {
+        context->validators.no_store = true;
+      }
+      if (!context->streaming &&
+          strcasecmp(evt->header_key, "Content-Length") == 0) {
+        // body lands in one or few large blocks instead of growing chunk
+        // by chunk
+        auto length = strtoul(evt->header_value, nullptr, 10);
+        if (length > 0) {
+          response->SetResponseDataCapacity(length);
+        }
+      }
       break;
     case HTTP_EVENT_ON_DATA:
+      if (context->streaming) {
+        break;
+      }
       ESP_LOGI(TAG, "HTTP_EVENT_ON_DATA");
       ESP_LOGI(TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-      if (!esp_http_client_is_chunked_response(evt->client)) {
+      context->body_started = true;
+      context->response_started = true;
+      if (context->inflater) {
+        if (!context->inflater->Write(
+                (const uint8_t*)evt->data, evt->data_len,
+                [response](const uint8_t* data, size_t len) {
+                  return AppendInflated(response, data, len);
+                })) {
+          context->inflate_failed = true;
+        }
+      } else if (!esp_http_client_is_chunked_response(evt->client)) {
         response->AppendResponseData((const char*)evt->data, evt->data_len);
       } else {
         // LOGT(TAG, ERROR) << "response chunk data, not support!!!" <<
@@ -91,14 +178,110 @@ void HttpClient::SetCertPem(char* pem) { cert_pem_ = pem; }
 void HttpClient::SetClientPem(char* pem) { client_pem_ = pem; }
 void HttpClient::SetClientKey(char* pem) { client_key_pem = pem; }
 
+// open/write/fetch_headers/read instead of perform, so the body is pulled
+// chunk by chunk into one pooled buffer
+static bool StreamResponse(esp_http_client_handle_t client, const char* body,
+                           size_t body_len, bool head,
+                           const HttpClient::BodySink& sink,
+                           RequestContext* context) {
+  auto response = context->response;
+  auto err = esp_http_client_open(client, body_len);
+  if (err != ESP_OK) {
+    response->SetError(esp_err_to_name(err));
+    return false;
+  }
+  size_t written = 0;
+  while (written < body_len) {
+    int ret = esp_http_client_write(client, body + written, body_len - written);
+    if (ret <= 0) {
+      response->SetError("write request body failed");
+      return false;
+    }
+    written += ret;
+  }
+  if (esp_http_client_fetch_headers(client) < 0) {
+    response->SetError("fetch headers failed");
+    return false;
+  }
+  response->SetStatusCode(esp_http_client_get_status_code(client));
+  auto buffer = BufferPool::Instance()->Acquire(MAX_HTTP_RECV_BUFFER);
+  if (!buffer.Valid()) {
+    response->SetError(esp_err_to_name(ESP_ERR_NO_MEM));
+    return false;
+  }
+  bool aborted = false;
+  auto inflated = [&](const uint8_t* data, size_t len) {
+    aborted = !sink((const char*)data, len);
+    return !aborted;
+  };
+  auto inflater = context->inflater.get();
+  for (;;) {
+    int len = esp_http_client_read(client, (char*)buffer.Data(),
+                                   buffer.Capacity());
+    if (len < 0) {
+      response->SetError("read response body failed");
+      return false;
+    }
+    if (len == 0) {
+      // complete, or the server closed the connection. only a body without
+      // Content-Length or chunking is delimited by the close
+      // HEAD, 204 and 304 carry a length but no body
+      int status = esp_http_client_get_status_code(client);
+      bool delimited = !head && status != 204 && status != 304 &&
+                       (esp_http_client_is_chunked_response(client) ||
+                        esp_http_client_get_content_length(client) >= 0);
+      if (delimited && !esp_http_client_is_complete_data_received(client)) {
+        response->SetError("response body truncated");
+        return false;
+      }
+      // HEAD, 204 and 304 may name an encoding without sending a body
+      if (inflater && inflater->GetStats().in_bytes > 0 &&
+          !inflater->Finish(inflated)) {
+        response->SetError("compressed body truncated");
+        return false;
+      }
+      return true;
+    }
+    bool ok = inflater ? inflater->Write(buffer.Data(), len, inflated)
+                       : sink((const char*)buffer.Data(), len);
+    if (!ok) {
+      response->SetError(inflater && !aborted ? "inflate response body failed"
+                                              : "aborted by sink");
+      return false;
+    }
+  }
+}
+
 std::shared_ptr<HttpResponse> HttpClient::DoRequest(
     const std::shared_ptr<HttpRequest>& request, int32_t timeoutMS) {
+  return Execute(request, timeoutMS, nullptr);
+}
+
+std::shared_ptr<HttpResponse> HttpClient::DoRequest(
+    const std::shared_ptr<HttpRequest>& request, int32_t timeoutMS,
+    const BodySink& sink) {
+  return Execute(request, timeoutMS, &sink);
+}
+
+std::shared_ptr<HttpResponse> HttpClient::Execute(
+    const std::shared_ptr<HttpRequest>& request, int32_t timeoutMS,
+    const BodySink* sink) {
   std::shared_ptr<HttpResponse> response = std::make_shared<HttpResponse>();
+  RequestContext context{};
+  context.response = response.get();
+  context.streaming = sink != nullptr;
+  context.accept_encoding = accept_encoding_;
   auto url = request->GetUrl();
+  // connect to the cached address, url stays the cache key and the Host
+  std::string connect_url;
+  bool rewritten = dns_cache_ && dns_cache_->RewriteUrl(url, connect_url);
+  if (!rewritten) {
+    connect_url = url;
+  }
   esp_http_client_config_t config{};
-  config.url = url.c_str();
+  config.url = connect_url.c_str();
   config.event_handler = HttpEventHandler;
-  config.user_data = (void*)response.get();
+  config.user_data = (void*)&context;
   config.skip_cert_common_name_check = skip_cert_common_name_check_;
   if (tx_size_ > 0) {
     // config.buffer_size_tx = 2048;  // tx_size_;
@@ -120,49 +303,181 @@ std::shared_ptr<HttpResponse> HttpClient::DoRequest(
   if (client_key_pem) {
     config.client_key_pem = client_key_pem;
   }
-  EspHttpClient c(&config);
-  if (!c.Valid()) {
-    ESP_LOGE(TAG, "esp http client init failed, check request params");
-    return response;
+  if (pool_) {
+    config.keep_alive_enable = true;
   }
 
-  // set method
-  esp_http_client_set_method(c.Client(),
-                             (esp_http_client_method_t)request->GetMethod());
-  // set headers
-  auto headers = request->GetHeaders();
-  for (const auto& header : headers) {
-    esp_http_client_set_header(c.Client(), header.first.c_str(),
-                               header.second.c_str());
-  }
-  auto raw_headers = request->GetRawHeaders();
-  for (const auto& header : raw_headers) {
-    esp_http_client_set_header(c.Client(), header.first, header.second);
+  bool cacheable = cache_ && !sink && request->GetMethod() == HttpRequest::GET;
+  bool conditional = false;
+  HttpCache::Validators cached;
+  if (cacheable && cache_->Lookup(url, cached)) {
+    conditional = true;
   }
 
   // set body
   HttpRequest::RequestBody body;
   request->ReleaseGetRequestBody(body);
-  if (!body.empty()) {
-    esp_http_client_set_post_field(c.Client(), (const char*)body.data(),
-                                   body.size());
-  } else {
-    auto raw_request_data = request->RawRequestBody();
-    if (raw_request_data) {
-      esp_http_client_set_post_field(c.Client(), raw_request_data,
-                                     std::strlen(raw_request_data));
+  const char* body_data = (const char*)body.data();
+  size_t body_len = body.size();
+  if (body.empty() && request->RawRequestBody()) {
+    body_data = request->RawRequestBody();
+    body_len = std::strlen(body_data);
+  }
+  const auto& headers = request->GetHeaders();
+  bool host_override = rewritten && request->GetHeader("Host").empty();
+
+  auto start_us = esp_timer_get_time();
+  bool ok = false;
+  // a pooled connection the server closed while idle fails before any
+  // response byte, the request is sent once more on a new connection
+  for (int attempt = 0;; ++attempt) {
+    std::unique_ptr<EspHttpClient> owned;
+    esp_http_client_handle_t client = nullptr;
+    bool reused = false;
+    if (pool_) {
+      client = (esp_http_client_handle_t)pool_->Acquire(
+          connect_url.c_str(), &config, attempt == 0, &reused);
+      if (client) {
+        esp_http_client_set_user_data(client, (void*)&context);
+        esp_http_client_set_timeout_ms(
+            client, timeoutMS > 0 ? timeoutMS : DEFAULT_HTTP_TIMEOUT_MS);
+      }
+    } else {
+      owned = std::make_unique<EspHttpClient>(&config);
+      client = owned->Valid() ? owned->Client() : nullptr;
+    }
+    if (!client) {
+      ESP_LOGE(TAG, "esp http client init failed, check request params");
+      return response;
+    }
+
+    // set method
+    esp_http_client_set_method(client,
+                               (esp_http_client_method_t)request->GetMethod());
+    // set headers
+    // names and values in the arena are nul terminated, no copy here
+    for (size_t i = 0; i < headers.Size(); ++i) {
+      auto header = headers.At(i);
+      esp_http_client_set_header(client, header.name.data(),
+                                 header.value.data());
+    }
+    if (accept_encoding_) {
+      esp_http_client_set_header(client, "Accept-Encoding", ACCEPT_ENCODING);
+    }
+    if (host_override) {
+      Url parsed;
+      ParseUrl(url, parsed);
+      esp_http_client_set_header(client, "Host", HostHeader(parsed).c_str());
+    }
+    if (conditional) {
+      if (!cached.etag.empty()) {
+        esp_http_client_set_header(client, "If-None-Match",
+                                   cached.etag.c_str());
+      }
+      if (!cached.last_modified.empty()) {
+        esp_http_client_set_header(client, "If-Modified-Since",
+                                   cached.last_modified.c_str());
+      }
+    }
+
+    if (sink) {
+      ok = StreamResponse(client, body_data, body_len,
+                          request->GetMethod() == HttpRequest::HEAD, *sink,
+                          &context);
+    } else {
+      if (body_len > 0) {
+        esp_http_client_set_post_field(client, body_data, body_len);
+      }
+      esp_err_t err = esp_http_client_perform(client);
+      if (err == ESP_OK) {
+        response->SetStatusCode(esp_http_client_get_status_code(client));
+      } else {
+        response->SetError(esp_err_to_name(err));
+      }
+      ok = err == ESP_OK;
+      if (ok && context.inflater) {
+        auto append = [&](const uint8_t* data, size_t len) {
+          return AppendInflated(response.get(), data, len);
+        };
+        // HEAD, 204 and 304 may name an encoding without sending a body
+        bool empty = context.inflater->GetStats().in_bytes == 0;
+        if (context.inflate_failed ||
+            (!empty && !context.inflater->Finish(append))) {
+          response->SetError("inflate response body failed");
+          ok = false;
+        }
+      }
+    }
+    if (context.connects > 0 &&
+        esp_http_client_get_transport_type(client) ==
+            HTTP_TRANSPORT_OVER_SSL) {
+      // esp_http_client cannot resume sessions, every connect is a full
+      // handshake
+      TlsHandshakeMetrics::Instance()->RecordHandshake(
+          (uint32_t)((context.connected_us - start_us) / 1000));
     }
+
+    if (pool_) {
+      // a pooled handle keeps headers and body between requests
+      for (size_t i = 0; i < headers.Size(); ++i) {
+        esp_http_client_delete_header(client, headers.At(i).name.data());
+      }
+      if (accept_encoding_) {
+        esp_http_client_delete_header(client, "Accept-Encoding");
+      }
+      if (host_override) {
+        // esp_http_client sets Host from the url once, at init
+        Url parsed;
+        ParseUrl(connect_url, parsed);
+        esp_http_client_set_header(client, "Host",
+                                   HostHeader(parsed).c_str());
+      }
+      if (conditional) {
+        esp_http_client_delete_header(client, "If-None-Match");
+        esp_http_client_delete_header(client, "If-Modified-Since");
+      }
+      esp_http_client_set_post_field(client, nullptr, 0);
+      esp_http_client_set_user_data(client, nullptr);
+      auto latency_ms = (uint32_t)((esp_timer_get_time() - start_us) / 1000);
+      // a partly read stream leaves the connection unusable
+      bool keep =
+          ok && (!sink || esp_http_client_is_complete_data_received(client));
+      pool_->Release(client, keep, context.connects, latency_ms);
+    }
+    if (ok || !reused || attempt > 0 || context.response_started) {
+      break;
+    }
+    ESP_LOGW(TAG, "reused connection failed, retry on a new one");
+    response = std::make_shared<HttpResponse>();
+    context = RequestContext{};
+    context.response = response.get();
+    context.streaming = sink != nullptr;
+    context.accept_encoding = accept_encoding_;
   }
 
-  esp_err_t err = esp_http_client_perform(c.Client());
-  if (err == ESP_OK) {
-    response->SetStatusCode(esp_http_client_get_status_code(c.Client()));
-  } else {
-    response->SetError(esp_err_to_name(err));
+  if (rewritten && !ok && context.connects == 0) {
+    // the cached address may be gone, look the name up again next time
+    Url parsed;
+    ParseUrl(url, parsed);
+    dns_cache_->Remove(std::string(parsed.host).c_str());
+  }
+  if (cacheable && ok) {
+    cache_->Complete(url, conditional ? &cached : nullptr, context.validators,
+                     response.get());
+  }
+  if (context.inflater) {
+    auto inflate_stats = context.inflater->GetStats();
+    ESP_LOGD(TAG, "inflated %u to %u bytes in %u us",
+             (unsigned)inflate_stats.in_bytes,
+             (unsigned)inflate_stats.out_bytes, inflate_stats.busy_us);
   }
   return response;
 }
 
 void HttpClient::SetTxBufferSize(uint32_t tx_size) { tx_size_ = tx_size; }
 void HttpClient::SetRxBufferSize(uint32_t rx_size) { rx_size_ = rx_size; }
+void HttpClient::SetConnectionPool(HttpConnectionPool* pool) { pool_ = pool; }
+void HttpClient::SetAcceptEncoding(bool enable) { accept_encoding_ = enable; }
+void HttpClient::SetCache(HttpCache* cache) { cache_ = cache; }
+void HttpClient::SetDnsCache(DnsCache* dns_cache) { dns_cache_ = dns_cache; }
 }  // namespace esp
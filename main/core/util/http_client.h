@@ -1,5 +1,6 @@
 #pragma once
 
+#include <functional>
 #include <memory>
 
 #include "http_request.h"
@@ -7,8 +8,17 @@
 
 namespace esp {
 
+class DnsCache;
+class HttpCache;
+class HttpConnectionPool;
+
 class HttpClient {
  public:
+  // receives the response body chunk by chunk, return false to abort.
+  // called on the requesting task, reading pauses while it runs so a slow
+  // sink holds the server back through the tcp window
+  using BodySink = std::function<bool(const char* data, size_t len)>;
+
   void SkipCertCommonNameCheck(bool skip);
 
   // only save pem pointer,not copy
@@ -19,16 +29,50 @@ class HttpClient {
   void SetTxBufferSize(uint32_t tx_size);
   void SetRxBufferSize(uint32_t rx_size);
 
+  // send Accept-Encoding: gzip, deflate and inflate encoded bodies, in
+  // the response and for a sink, through a 32 KB window
+  void SetAcceptEncoding(bool enable);
+
+  // reuse keep-alive connections from the pool (e.g.
+  // HttpConnectionPool::Instance()) instead of connecting per request.
+  // a request failing on a reused connection before any response byte is
+  // sent once more on a new connection
+  void SetConnectionPool(HttpConnectionPool* pool);
+
+  // GET requests without a sink revalidate the cached body and are
+  // answered from the cache on a 304, see HttpCache
+  void SetCache(HttpCache* cache);
+
+  // connect http:// urls to the address cached in dns_cache, the Host
+  // header keeps the name. https keeps the name for sni and certificate
+  // checks and is resolved by lwip
+  void SetDnsCache(DnsCache* dns_cache);
+
   std::shared_ptr<HttpResponse> DoRequest(
       const std::shared_ptr<HttpRequest>& request, int32_t timeoutMS);
 
+  // streams the body to sink instead of buffering it in the response, peak
+  // memory is one rx chunk whatever the body size. redirects and auth
+  // retries are not followed in this mode
+  std::shared_ptr<HttpResponse> DoRequest(
+      const std::shared_ptr<HttpRequest>& request, int32_t timeoutMS,
+      const BodySink& sink);
+
  private:
+  std::shared_ptr<HttpResponse> Execute(
+      const std::shared_ptr<HttpRequest>& request, int32_t timeoutMS,
+      const BodySink* sink);
+
   bool skip_cert_common_name_check_{true};
   char* cert_pem_{nullptr};
   char* client_pem_{nullptr};
   char* client_key_pem{nullptr};
   uint32_t tx_size_{0};
   uint32_t rx_size_{0};
+  HttpConnectionPool* pool_{nullptr};
+  HttpCache* cache_{nullptr};
+  DnsCache* dns_cache_{nullptr};
+  bool accept_encoding_{false};
 };
 
 }  // namespace esp
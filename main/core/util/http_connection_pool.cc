@@ -0,0 +1,224 @@
+
+#include "http_connection_pool.h"
+
+#include <cstdio>
+#include <utility>
+
+#include "esp_http_client.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "url.h"
+
+static const char* TAG = "http_pool";
+
+#define SHARED_POOL_MAX_CONNECTIONS 4
+#define SHARED_POOL_MAX_PER_HOST 2
+#define SHARED_POOL_IDLE_TIMEOUT_MS 30000
+
+namespace esp {
+
+struct HttpConnectionPool::Entry {
+  std::string host_key;
+  // settings the handle was created with, url and user data cleared
+  esp_http_client_config_t config;
+  esp_http_client_handle_t handle;
+  bool busy;
+  int64_t last_used_us;
+};
+
+// handles can only be shared between requests using the same transport
+// settings, the per request ones (url, method, headers, timeout, user
+// data) are set again on every request
+static bool SameSettings(const esp_http_client_config_t& a,
+                         const esp_http_client_config_t& b) {
+  return a.cert_pem == b.cert_pem && a.client_cert_pem == b.client_cert_pem &&
+         a.client_key_pem == b.client_key_pem &&
+         a.skip_cert_common_name_check == b.skip_cert_common_name_check &&
+         a.crt_bundle_attach == b.crt_bundle_attach &&
+         a.use_global_ca_store == b.use_global_ca_store &&
+         a.buffer_size == b.buffer_size &&
+         a.buffer_size_tx == b.buffer_size_tx &&
+         a.event_handler == b.event_handler;
+}
+
+static bool HostKey(const char* url, std::string& key) {
+  Url parsed;
+  if (!ParseUrl(url, parsed)) {
+    return false;
+  }
+  char port[8];
+  snprintf(port, sizeof(port), ":%u", parsed.port);
+  key.assign(parsed.scheme.data(), parsed.scheme.size());
+  key.append("://");
+  key.append(parsed.host.data(), parsed.host.size());
+  key.append(port);
+  return true;
+}
+
+HttpConnectionPool* HttpConnectionPool::Instance() {
+  static HttpConnectionPool INSTANCE(Config{SHARED_POOL_MAX_CONNECTIONS,
+                                            SHARED_POOL_MAX_PER_HOST,
+                                            SHARED_POOL_IDLE_TIMEOUT_MS});
+  return &INSTANCE;
+}
+
+HttpConnectionPool::HttpConnectionPool(Config config)
+    : config_(std::move(config)) {}
+
+HttpConnectionPool::~HttpConnectionPool() { Clear(); }
+
+void HttpConnectionPool::CloseIdleLocked(int64_t now) {
+  int64_t timeout_us = (int64_t)config_.idle_timeout_ms * 1000;
+  for (size_t i = entries_.size(); i > 0; --i) {
+    auto& entry = entries_[i - 1];
+    if (!entry->busy && now - entry->last_used_us >= timeout_us) {
+      esp_http_client_cleanup(entry->handle);
+      entries_.erase(entries_.begin() + (i - 1));
+      ++stats_.closed_idle;
+    }
+  }
+}
+
+void* HttpConnectionPool::Acquire(const char* url, const void* config) {
+  return Acquire(url, config, true, nullptr);
+}
+
+void* HttpConnectionPool::Acquire(const char* url, const void* config,
+                                  bool reuse, bool* reused) {
+  if (reused) {
+    *reused = false;
+  }
+  auto request_config = (const esp_http_client_config_t*)config;
+  std::string key;
+  if (!url || !HostKey(url, key)) {
+    ESP_LOGE(TAG, "invalid url");
+    return nullptr;
+  }
+  auto now = esp_timer_get_time();
+  mutex_.Lock();
+  CloseIdleLocked(now);
+  if (!reuse) {
+    ++stats_.retries;
+  }
+  size_t host_count = 0;
+  Entry* lru_idle = nullptr;
+  for (auto& entry : entries_) {
+    if (entry->host_key == key) {
+      ++host_count;
+      if (reuse && !entry->busy &&
+          SameSettings(entry->config, *request_config)) {
+        entry->busy = true;
+        entry->last_used_us = now;
+        auto handle = entry->handle;
+        mutex_.Unlock();
+        if (reused) {
+          *reused = true;
+        }
+        // same host, esp_http_client keeps the open connection
+        esp_http_client_set_url(handle, url);
+        return handle;
+      }
+    }
+    if (!entry->busy &&
+        (!lru_idle || entry->last_used_us < lru_idle->last_used_us)) {
+      lru_idle = entry.get();
+    }
+  }
+
+  bool pooled = host_count < config_.max_per_host;
+  if (pooled && entries_.size() >= config_.max_connections) {
+    if (lru_idle) {
+      for (size_t i = 0; i < entries_.size(); ++i) {
+        if (entries_[i].get() == lru_idle) {
+          esp_http_client_cleanup(lru_idle->handle);
+          entries_.erase(entries_.begin() + i);
+          ++stats_.evicted;
+          break;
+        }
+      }
+    } else {
+      pooled = false;
+    }
+  }
+
+  auto handle = esp_http_client_init(request_config);
+  if (!handle) {
+    mutex_.Unlock();
+    ESP_LOGE(TAG, "esp http client init failed, check request params");
+    return nullptr;
+  }
+  ++stats_.created;
+  if (pooled) {
+    auto entry = std::make_unique<Entry>();
+    entry->host_key = std::move(key);
+    entry->config = *request_config;
+    entry->config.url = nullptr;
+    entry->config.user_data = nullptr;
+    entry->handle = handle;
+    entry->busy = true;
+    entry->last_used_us = now;
+    entries_.push_back(std::move(entry));
+  } else {
+    ++stats_.unpooled;
+  }
+  mutex_.Unlock();
+  return handle;
+}
+
+void HttpConnectionPool::Release(void* handle, bool keep, uint32_t connects,
+                                 uint32_t latency_ms) {
+  if (!handle) {
+    return;
+  }
+  mutex_.Lock();
+  ++stats_.requests;
+  stats_.handshakes += connects;
+  if (connects == 0) {
+    ++stats_.reused;
+  }
+  stats_.latency.Record(latency_ms);
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    auto& entry = entries_[i];
+    if (entry->handle != handle) {
+      continue;
+    }
+    if (keep) {
+      entry->busy = false;
+      entry->last_used_us = esp_timer_get_time();
+    } else {
+      esp_http_client_cleanup(entry->handle);
+      entries_.erase(entries_.begin() + i);
+    }
+    mutex_.Unlock();
+    return;
+  }
+  mutex_.Unlock();
+  // one-off handle
+  esp_http_client_cleanup((esp_http_client_handle_t)handle);
+}
+
+void HttpConnectionPool::CloseIdle() {
+  mutex_.Lock();
+  CloseIdleLocked(esp_timer_get_time());
+  mutex_.Unlock();
+}
+
+void HttpConnectionPool::Clear() {
+  mutex_.Lock();
+  for (size_t i = entries_.size(); i > 0; --i) {
+    if (!entries_[i - 1]->busy) {
+      esp_http_client_cleanup(entries_[i - 1]->handle);
+      entries_.erase(entries_.begin() + (i - 1));
+    }
+  }
+  mutex_.Unlock();
+}
+
+HttpConnectionPool::Stats HttpConnectionPool::GetStats() {
+  mutex_.Lock();
+  auto stats = stats_;
+  mutex_.Unlock();
+  return stats;
+}
+
+}  // namespace esp
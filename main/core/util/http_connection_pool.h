@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "latency_histogram.h"
+#include "mutex.h"
+
+namespace esp {
+
+// keep-alive pool of esp_http_client handles per scheme://host:port.
+// a released handle keeps its connection open, and the next request to
+// the same host with the same tls settings reuses it instead of paying a
+// new tcp connect and tls handshake
+class HttpConnectionPool {
+ public:
+  struct Config {
+    // pooled handles, busy and idle
+    size_t max_connections{4};
+    size_t max_per_host{2};
+    // idle handles older than this are closed on the next Acquire
+    uint32_t idle_timeout_ms{30000};
+  };
+
+  struct Stats {
+    uint32_t requests{0};
+    // tcp connects, a tls handshake each for https
+    uint32_t handshakes{0};
+    // requests served on an already open connection
+    uint32_t reused{0};
+    uint32_t created{0};
+    uint32_t closed_idle{0};
+    // idle handles closed to make room for another host
+    uint32_t evicted{0};
+    // pool full of busy handles, request ran on a one-off handle
+    uint32_t unpooled{0};
+    // requests sent again after a reused connection failed
+    uint32_t retries{0};
+    LatencyHistogram latency;
+  };
+
+  static HttpConnectionPool* Instance();
+
+  explicit HttpConnectionPool(Config config);
+
+  ~HttpConnectionPool();
+
+  // esp_http_client handle for the request, config is an
+  // esp_http_client_config_t, must be paired with Release
+  void* Acquire(const char* url, const void* config);
+
+  // reuse false always opens a new connection, to retry a request whose
+  // reused connection failed. reused tells whether an open connection was
+  // handed out
+  void* Acquire(const char* url, const void* config, bool reuse,
+                bool* reused);
+
+  // keep false closes the connection (request failed). connects is the
+  // number of HTTP_EVENT_ON_CONNECTED seen during the request
+  void Release(void* handle, bool keep, uint32_t connects,
+               uint32_t latency_ms);
+
+  void CloseIdle();
+
+  void Clear();
+
+  Stats GetStats();
+
+ private:
+  struct Entry;
+
+  void CloseIdleLocked(int64_t now);
+
+  Config config_;
+  Mutex mutex_;
+  std::vector<std::unique_ptr<Entry>> entries_;
+  Stats stats_;
+};
+
+}  // namespace esp
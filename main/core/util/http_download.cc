@@ -1,17 +1,146 @@
 #include "http_download.h"
 
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <strings.h>
+
 #include "esp_err.h"
 
 #include "esp_log.h"
 #include "esp_crt_bundle.h"
 #include "esp_http_client.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
 #include "esp_tls.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "nvs.h"
+#include "buffer_pool.h"
+#include "delay.h"
+#include "dns_cache.h"
+#include "http_connection_pool.h"
+#include "inflate_stream.h"
+#include "tls_handshake_metrics.h"
+#include "url.h"
 
 
 static const char* TAG = "HTTP";
 
+#define PROGRESS_NVS_NAMESPACE "http_download"
+// flash writes are limited, a reboot loses at most this much
+#define PROGRESS_SAVE_INTERVAL (64 * 1024)
+#define MAX_VALIDATOR_LEN 64
+#define MAX_NVS_KEY_LEN 15
+#define PARALLEL_TASK_STACK_SIZE 6144
+#define PARALLEL_TASK_PRIORITY 5
+// esp_http_client default, restored on pooled handles
+#define DEFAULT_HTTP_TIMEOUT_MS 5000
+
 namespace esp {
 
+struct DownloadContext {
+  uint32_t connects;
+  bool has_range;
+  size_t range_start;
+  size_t range_total;
+  std::string etag;
+  std::string last_modified;
+};
+
+struct ProgressRecord {
+  uint32_t url_crc;
+  uint32_t offset;
+  uint32_t total;
+  char validator[MAX_VALIDATOR_LEN];
+};
+
+struct HttpDownload::ParallelJob {
+  HttpDownload* download;
+  const char* url;
+  std::string validator;
+  RangeCallback callback;
+  size_t total;
+  size_t segment_size;
+  size_t segment_count;
+  size_t next_segment;
+  size_t completed;
+  bool failed;
+  // serializes the callback and the segment counters
+  Mutex mutex;
+  SemaphoreHandle_t done_sem;
+};
+
+struct Chunk {
+  // buffer to give back, data may start past it
+  uint8_t* buffer;
+  const uint8_t* data;
+  size_t len;
+  size_t offset;
+  size_t total;
+};
+
+struct HttpDownload::Consumer {
+  HttpDownload* download;
+  const DownloadCallback* callback;
+  // Chunk, a null buffer stops the task
+  QueueHandle_t full_queue;
+  // uint8_t*
+  QueueHandle_t free_queue;
+  SemaphoreHandle_t done_sem;
+  std::atomic<bool> failed{false};
+  // file offset up to which the callback took the data
+  std::atomic<size_t> consumed{0};
+  int64_t busy_us{0};
+};
+
+static esp_err_t DownloadEventHandler(esp_http_client_event_t* evt) {
+  auto context = (DownloadContext*)evt->user_data;
+  if (!context) {
+    // idle pooled handle being closed
+    return ESP_OK;
+  }
+  switch (evt->event_id) {
+    case HTTP_EVENT_ON_CONNECTED:
+      ++context->connects;
+      break;
+    case HTTP_EVENT_ON_HEADER:
+      if (strcasecmp(evt->header_key, "Content-Range") == 0) {
+        // bytes <first>-<last>/<total>
+        unsigned long first = 0, total = 0;
+        if (sscanf(evt->header_value, "bytes %lu-%*u/%lu", &first, &total) ==
+            2) {
+          context->has_range = true;
+          context->range_start = first;
+          context->range_total = total;
+        }
+      } else if (strcasecmp(evt->header_key, "ETag") == 0) {
+        context->etag = evt->header_value;
+      } else if (strcasecmp(evt->header_key, "Last-Modified") == 0) {
+        context->last_modified = evt->header_value;
+      }
+      break;
+    default:
+      break;
+  }
+  return ESP_OK;
+}
+
+static void ConsumerTask(void* args) {
+  auto consumer = (HttpDownload::Consumer*)args;
+  consumer->download->ConsumeLoop(consumer);
+}
+
+static void ParallelDownloadTask(void* args) {
+  auto job = (HttpDownload::ParallelJob*)args;
+  job->download->RunParallel(job);
+  xSemaphoreGive(job->done_sem);
+  vTaskDelete(NULL);
+}
+
 void HttpDownload::SkipCertCommonNameCheck(bool skip) {
   skip_cert_common_name_check_ = skip;
 }
@@ -25,9 +154,61 @@ void HttpDownload::SetClientKey(char* pem) {
   client_key_pem = pem;
 }
 
-bool HttpDownload::DoDownload(const char* url, DownloadCallback callback) {
+void HttpDownload::SetBufferSize(uint32_t size) {
+  if (size == 0) {
+    return;
+  }
+  buffer_size_ = size;
+  buffer_.resize(size + 1);
+  spare_buffer_.clear();
+  spare_buffer_.shrink_to_fit();
+}
+
+void HttpDownload::SetPipelined(bool enable, uint32_t task_stack_size,
+                                uint32_t task_priority) {
+  pipelined_ = enable;
+  consumer_stack_size_ = task_stack_size;
+  consumer_priority_ = task_priority;
+}
+
+void HttpDownload::SetInflate(bool enable) { inflate_ = enable; }
+
+void HttpDownload::SetRetry(uint32_t max_retries, uint32_t retry_delay_ms) {
+  max_retries_ = max_retries;
+  retry_delay_ms_ = retry_delay_ms;
+}
+
+void HttpDownload::SetResumeKey(const char* nvs_key) {
+  if (nvs_key && strlen(nvs_key) > MAX_NVS_KEY_LEN) {
+    ESP_LOGE(TAG, "resume key %s too long", nvs_key);
+    return;
+  }
+  resume_key_ = nvs_key ? nvs_key : "";
+}
+
+void HttpDownload::SetConnectionPool(HttpConnectionPool* pool) {
+  pool_ = pool;
+}
+
+void HttpDownload::SetDnsCache(DnsCache* dns_cache) {
+  dns_cache_ = dns_cache;
+}
+
+bool HttpDownload::FetchRange(const char* url, size_t begin, size_t end,
+                              const std::string& if_range,
+                              bool accept_encoding, const RangeSink& sink,
+                              uint8_t** buffer, RangeResult& result) {
+  result.next = begin;
+  DownloadContext context{};
+  std::string connect_url;
+  bool rewritten = dns_cache_ && dns_cache_->RewriteUrl(url, connect_url);
+  if (!rewritten) {
+    connect_url = url;
+  }
   esp_http_client_config_t config{};
-  config.url = url;
+  config.url = connect_url.c_str();
+  config.event_handler = DownloadEventHandler;
+  config.user_data = (void*)&context;
   config.skip_cert_common_name_check = skip_cert_common_name_check_;
 
   if (cert_pem_) {
@@ -39,45 +220,608 @@ bool HttpDownload::DoDownload(const char* url, DownloadCallback callback) {
   if (client_key_pem) {
     config.client_key_pem = client_key_pem;
   }
+  if (pool_) {
+    config.keep_alive_enable = true;
+  }
+
+  esp_http_client_handle_t client = nullptr;
+  if (pool_) {
+    client =
+        (esp_http_client_handle_t)pool_->Acquire(connect_url.c_str(), &config);
+    if (client) {
+      esp_http_client_set_user_data(client, (void*)&context);
+      esp_http_client_set_timeout_ms(client, DEFAULT_HTTP_TIMEOUT_MS);
+    }
+  } else {
+    client = esp_http_client_init(&config);
+  }
+  if (!client) {
+    ESP_LOGE(TAG, "esp http client init failed, check download params");
+    return false;
+  }
+
+  if (accept_encoding) {
+    esp_http_client_set_header(client, "Accept-Encoding", "gzip, deflate");
+  }
+  Url parsed;
+  if (rewritten) {
+    ParseUrl(url, parsed);
+    esp_http_client_set_header(client, "Host", HostHeader(parsed).c_str());
+  }
+  bool ranged = begin > 0 || end > 0;
+  if (ranged) {
+    char range[48];
+    if (end > 0) {
+      snprintf(range, sizeof(range), "bytes=%u-%u", (unsigned)begin,
+               (unsigned)(end - 1));
+    } else {
+      snprintf(range, sizeof(range), "bytes=%u-", (unsigned)begin);
+    }
+    esp_http_client_set_header(client, "Range", range);
+    if (!if_range.empty()) {
+      esp_http_client_set_header(client, "If-Range", if_range.c_str());
+    }
+  }
+
+  // response of the opened request into the sink
+  auto read = [&]() -> bool {
+    int content_length = esp_http_client_fetch_headers(client);
+    result.status = esp_http_client_get_status_code(client);
+    result.validator =
+        context.etag.empty() ? context.last_modified : context.etag;
+    size_t pos = 0;
+    size_t limit = 0;
+    if (result.status == 206) {
+      if (!context.has_range || context.range_start != begin ||
+          context.range_total == 0) {
+        ESP_LOGE(TAG, "unexpected content range");
+        return false;
+      }
+      result.total = context.range_total;
+      pos = begin;
+      limit = end > 0 && end < result.total ? end : result.total;
+    } else if (result.status == 200) {
+      if (content_length <= 0) {
+        ESP_LOGE(TAG, "Cannot fetch http headers or content_length is 0");
+        return false;
+      }
+      result.total = content_length;
+      if (begin > 0 && !if_range.empty() && result.validator != if_range) {
+        result.changed = true;
+        return false;
+      }
+      limit = begin > 0 && end > 0 && end < result.total ? end
+                                                          : result.total;
+    } else if (result.status == 416 && begin > 0 && end == 0) {
+      // the file shrank
+      result.changed = true;
+      return false;
+    } else {
+      ESP_LOGE(TAG, "download failed, status:%d", result.status);
+      return false;
+    }
+
+    while (pos < limit) {
+      size_t want = limit - pos;
+      if (want > buffer_size_) {
+        want = buffer_size_;
+      }
+      uint8_t* data = *buffer;
+      int read_len = esp_http_client_read(client, (char*)data, want);
+      if (read_len <= 0) {
+        ESP_LOGE(TAG, "error download data");
+        return false;
+      }
+      result.received += read_len;
+      // a server ignoring Range sends what we already have again
+      size_t skip = 0;
+      if (pos < begin) {
+        skip = begin - pos;
+        if (skip > (size_t)read_len) {
+          skip = read_len;
+        }
+      }
+      pos += read_len;
+      if ((size_t)read_len > skip) {
+        data[read_len] = 0;
+        size_t len = read_len - skip;
+        if (!sink(pos - len, data + skip, len)) {
+          result.aborted = true;
+          return false;
+        }
+        result.next = pos;
+      }
+    }
+    return true;
+  };
 
-  esp_http_client_handle_t client = esp_http_client_init(&config);
   esp_err_t err;
+  bool ok = false;
+  auto start_us = esp_timer_get_time();
   if ((err = esp_http_client_open(client, 0)) != ESP_OK) {
     ESP_LOGE(TAG, "Failed to open HTTP connection:%s", esp_err_to_name(err));
-    return false;
+    if (rewritten) {
+      dns_cache_->Remove(std::string(parsed.host).c_str());
+    }
+  } else {
+    if (context.connects > 0 &&
+        esp_http_client_get_transport_type(client) ==
+            HTTP_TRANSPORT_OVER_SSL) {
+      TlsHandshakeMetrics::Instance()->RecordHandshake(
+          (uint32_t)((esp_timer_get_time() - start_us) / 1000));
+    }
+    ok = read();
+  }
+
+  if (pool_) {
+    // a pooled handle keeps its headers between requests
+    if (ranged) {
+      esp_http_client_delete_header(client, "Range");
+      esp_http_client_delete_header(client, "If-Range");
+    }
+    if (accept_encoding) {
+      esp_http_client_delete_header(client, "Accept-Encoding");
+    }
+    if (rewritten) {
+      // esp_http_client sets Host from the url once, at init
+      ParseUrl(connect_url, parsed);
+      esp_http_client_set_header(client, "Host", HostHeader(parsed).c_str());
+    }
+    esp_http_client_set_user_data(client, nullptr);
+    // a partly read body leaves the connection unusable
+    bool keep = ok && esp_http_client_is_complete_data_received(client);
+    pool_->Release(client, keep, context.connects,
+                   (uint32_t)((esp_timer_get_time() - start_us) / 1000));
+  } else {
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+  }
+
+  stats_mutex_.Lock();
+  ++stats_.requests;
+  stats_.received += result.received;
+  if (result.total > 0) {
+    stats_.total_size = result.total;
+  }
+  stats_mutex_.Unlock();
+  return ok;
+}
+
+bool HttpDownload::FetchWithRetry(const char* url, size_t begin, size_t end,
+                                  std::string& validator,
+                                  bool accept_encoding,
+                                  const RangeSink& sink, uint8_t** buffer,
+                                  RangeResult& result) {
+  size_t offset = begin;
+  uint32_t attempts = 0;
+  for (;;) {
+    result = RangeResult();
+    bool ok = FetchRange(url, offset, end, validator, accept_encoding, sink,
+                         buffer, result);
+    if (validator.empty()) {
+      validator = result.validator;
+    }
+    if (ok) {
+      return true;
+    }
+    if (result.aborted || result.changed) {
+      return false;
+    }
+    if (result.next > offset) {
+      // made progress, the retry budget is for failures in a row
+      offset = result.next;
+      attempts = 0;
+    }
+    if (attempts++ >= max_retries_) {
+      ESP_LOGE(TAG, "download failed at %u/%u", (unsigned)offset,
+               (unsigned)result.total);
+      return false;
+    }
+    stats_mutex_.Lock();
+    ++stats_.retries;
+    stats_mutex_.Unlock();
+    ESP_LOGW(TAG, "download interrupted at %u/%u, retry %u/%u",
+             (unsigned)offset, (unsigned)result.total, attempts,
+             max_retries_);
+    DelayMS(retry_delay_ms_);
+  }
+}
+
+bool HttpDownload::StartConsumer(Consumer* consumer) {
+  if (spare_buffer_.size() != buffer_size_ + 1) {
+    spare_buffer_.resize(buffer_size_ + 1);
+  }
+  // one chunk in the queue at most, the reader waits for a free buffer
+  // after each send
+  consumer->full_queue = xQueueCreate(2, sizeof(Chunk));
+  consumer->free_queue = xQueueCreate(2, sizeof(uint8_t*));
+  consumer->done_sem = xSemaphoreCreateBinary();
+  bool ok = consumer->full_queue && consumer->free_queue && consumer->done_sem;
+  if (ok) {
+    uint8_t* spare = spare_buffer_.data();
+    xQueueSend(consumer->free_queue, &spare, 0);
+    ok = xTaskCreate(ConsumerTask, "http_consumer", consumer_stack_size_,
+                     (void*)consumer, consumer_priority_, nullptr) == pdPASS;
   }
+  if (!ok) {
+    ESP_LOGW(TAG, "start consumer task failed, download without pipeline");
+    if (consumer->full_queue) {
+      vQueueDelete(consumer->full_queue);
+    }
+    if (consumer->free_queue) {
+      vQueueDelete(consumer->free_queue);
+    }
+    if (consumer->done_sem) {
+      vSemaphoreDelete(consumer->done_sem);
+    }
+  }
+  return ok;
+}
 
-  int content_length = esp_http_client_fetch_headers(client);
-  if (content_length <= 0) {
-    ESP_LOGE(TAG, "Cannot fetch http headers or content_length is 0");
+void HttpDownload::StopConsumer(Consumer* consumer) {
+  Chunk stop = {};
+  xQueueSend(consumer->full_queue, &stop, portMAX_DELAY);
+  xSemaphoreTake(consumer->done_sem, portMAX_DELAY);
+  vQueueDelete(consumer->full_queue);
+  vQueueDelete(consumer->free_queue);
+  vSemaphoreDelete(consumer->done_sem);
+}
+
+void HttpDownload::ConsumeLoop(Consumer* consumer) {
+  auto& callback = *consumer->callback;
+  for (;;) {
+    Chunk chunk;
+    xQueueReceive(consumer->full_queue, &chunk, portMAX_DELAY);
+    if (!chunk.buffer) {
+      break;
+    }
+    if (!consumer->failed) {
+      auto start_us = esp_timer_get_time();
+      size_t end = chunk.offset + chunk.len;
+      if (!callback || callback(chunk.data, chunk.len, chunk.total - end,
+                                chunk.total)) {
+        consumer->consumed = end;
+      } else {
+        consumer->failed = true;
+      }
+      consumer->busy_us += esp_timer_get_time() - start_us;
+    }
+    xQueueSend(consumer->free_queue, &chunk.buffer, portMAX_DELAY);
+  }
+  xSemaphoreGive(consumer->done_sem);
+  vTaskDelete(NULL);
+}
+
+bool HttpDownload::DoDownload(const char* url, DownloadCallback callback) {
+  if (!url) {
     return false;
   }
-  int total_read_len = 0, read_len;
-  bool success = true;
-  while (total_read_len < content_length) {
-    read_len = esp_http_client_read(client, (char*)buffer_.data(),
-                                    HTTP_DOWNLOAD_BUFFER_SIZE);
-    if (read_len < 0) {
-      ESP_LOGE(TAG, "error download data");
-      success = false;
+  stats_mutex_.Lock();
+  stats_ = Stats();
+  stats_mutex_.Unlock();
+  auto start_us = esp_timer_get_time();
+
+  // inflated downloads start from zero, see SetInflate
+  bool persist = !resume_key_.empty() && !inflate_;
+  std::unique_ptr<InflateStream> inflater;
+  size_t inflated = 0;
+  auto emit = [&](const uint8_t* data, size_t len) {
+    inflated += len;
+    return !callback || callback(data, len, 0, inflated);
+  };
+  DownloadCallback deliver = callback;
+  if (inflate_) {
+    inflater = std::make_unique<InflateStream>(InflateStream::kAuto);
+    if (!inflater->Valid()) {
+      return false;
+    }
+    deliver = [&](const uint8_t* data, size_t len, size_t left_size,
+                  size_t total) {
+      if (total - left_size - len == 0 && inflater->GetStats().in_bytes > 0) {
+        // the file changed and is downloaded again
+        inflater->Reset();
+        inflated = 0;
+      }
+      return inflater->Write(data, len, emit);
+    };
+  }
+
+  size_t offset = 0;
+  std::string validator;
+  if (persist && LoadProgress(url, offset, validator)) {
+    ESP_LOGI(TAG, "resume download at %u", (unsigned)offset);
+    stats_mutex_.Lock();
+    stats_.resumed_from = offset;
+    stats_mutex_.Unlock();
+  }
+
+  Consumer consumer;
+  consumer.download = this;
+  consumer.callback = &deliver;
+  consumer.consumed = offset;
+  bool pipelined = pipelined_ && StartConsumer(&consumer);
+  uint8_t* buffer = buffer_.data();
+  int64_t stall_us = 0;
+  size_t saved = offset;
+  RangeResult result;
+  auto sink = [&](size_t pos, const uint8_t* data, size_t len) {
+    if (pipelined) {
+      if (consumer.failed) {
+        return false;
+      }
+      // hand the filled buffer over and read on into the other one
+      Chunk chunk = {buffer, data, len, pos, result.total};
+      xQueueSend(consumer.full_queue, &chunk, portMAX_DELAY);
+      auto wait_us = esp_timer_get_time();
+      xQueueReceive(consumer.free_queue, &buffer, portMAX_DELAY);
+      stall_us += esp_timer_get_time() - wait_us;
+    } else {
+      auto call_us = esp_timer_get_time();
+      bool ok = !deliver ||
+                deliver(data, len, result.total - pos - len, result.total);
+      consumer.busy_us += esp_timer_get_time() - call_us;
+      if (!ok) {
+        return false;
+      }
+      consumer.consumed = pos + len;
+    }
+    ESP_LOGD(TAG, "download data len:%u", (unsigned)len);
+    // only what the callback took is saved
+    size_t consumed = consumer.consumed;
+    if (persist && consumed - saved >= PROGRESS_SAVE_INTERVAL) {
+      saved = consumed;
+      SaveProgress(url, saved, result.total, result.validator);
+    }
+    return true;
+  };
+
+  bool success;
+  uint32_t restarts = 0;
+  for (;;) {
+    success = FetchWithRetry(url, offset, 0, validator, inflate_, sink, &buffer,
+                             result);
+    if (success || !result.changed || restarts > 0) {
+      break;
+    }
+    ESP_LOGW(TAG, "file changed on server, download again");
+    ++restarts;
+    stats_mutex_.Lock();
+    ++stats_.restarts;
+    stats_mutex_.Unlock();
+    if (pipelined) {
+      // wait for the callback to finish the old file
+      uint8_t* spare = nullptr;
+      xQueueReceive(consumer.free_queue, &spare, portMAX_DELAY);
+      xQueueSend(consumer.free_queue, &spare, 0);
+    }
+    offset = 0;
+    saved = 0;
+    consumer.consumed = 0;
+    validator.clear();
+  }
+
+  if (pipelined) {
+    StopConsumer(&consumer);
+    success = success && !consumer.failed;
+  }
+  if (success && inflater) {
+    success = inflater->Finish(emit);
+  }
+  if (persist) {
+    if (success || result.changed) {
+      ClearProgress();
+    } else if (consumer.consumed > saved) {
+      SaveProgress(url, consumer.consumed, result.total, validator);
+    }
+  }
+  stats_mutex_.Lock();
+  stats_.consumer_ms = consumer.busy_us / 1000;
+  stats_.stall_ms = stall_us / 1000;
+  if (inflater) {
+    auto inflate_stats = inflater->GetStats();
+    stats_.inflated = inflate_stats.out_bytes;
+    stats_.inflate_ms = inflate_stats.busy_us / 1000;
+  }
+  stats_mutex_.Unlock();
+  FinishStats(start_us);
+  return success;
+}
+
+void HttpDownload::RunParallel(ParallelJob* job) {
+  auto buffer = BufferPool::Instance()->Acquire(buffer_size_ + 1);
+  if (!buffer.Valid()) {
+    // the other workers take its segments
+    ESP_LOGW(TAG, "no memory for download buffer");
+    return;
+  }
+  std::string validator = job->validator;
+  auto sink = [job](size_t offset, const uint8_t* data, size_t len) {
+    job->mutex.Lock();
+    bool ok = !job->failed && job->callback(offset, data, len, job->total);
+    job->mutex.Unlock();
+    return ok;
+  };
+  for (;;) {
+    job->mutex.Lock();
+    if (job->failed || job->next_segment >= job->segment_count) {
+      job->mutex.Unlock();
       break;
     }
-    buffer_[read_len] = 0;
-    total_read_len += read_len;
-    if (callback && read_len > 0) {
-      auto ret = callback(buffer_.data(), read_len,
-                          content_length - total_read_len, content_length);
-      if (!ret) {
-        success = false;
+    size_t segment = job->next_segment++;
+    job->mutex.Unlock();
+
+    size_t begin = segment * job->segment_size;
+    size_t end = begin + job->segment_size;
+    if (end > job->total) {
+      end = job->total;
+    }
+    RangeResult result;
+    uint8_t* data = buffer.Data();
+    bool ok = FetchWithRetry(job->url, begin, end, validator, false, sink,
+                             &data, result);
+    job->mutex.Lock();
+    if (ok) {
+      ++job->completed;
+    } else {
+      job->failed = true;
+    }
+    job->mutex.Unlock();
+    if (!ok) {
+      break;
+    }
+  }
+}
+
+bool HttpDownload::DoParallelDownload(const char* url, uint32_t connections,
+                                      size_t segment_size,
+                                      RangeCallback callback) {
+  if (!url || !callback || segment_size == 0 || connections == 0) {
+    ESP_LOGE(TAG, "invalid parallel download params");
+    return false;
+  }
+  stats_mutex_.Lock();
+  stats_ = Stats();
+  stats_mutex_.Unlock();
+  auto start_us = esp_timer_get_time();
+
+  // the first segment learns the size and whether ranges work
+  std::string validator;
+  RangeResult first;
+  auto first_sink = [&](size_t offset, const uint8_t* data, size_t len) {
+    return callback(offset, data, len, first.total);
+  };
+  uint8_t* buffer = buffer_.data();
+  if (!FetchWithRetry(url, 0, segment_size, validator, false, first_sink,
+                      &buffer, first)) {
+    FinishStats(start_us);
+    return false;
+  }
+  if (first.status != 206 || first.next >= first.total) {
+    // whole file in one response
+    FinishStats(start_us);
+    return true;
+  }
+
+  ParallelJob job;
+  job.download = this;
+  job.url = url;
+  job.validator = validator;
+  job.callback = std::move(callback);
+  job.total = first.total;
+  job.segment_size = segment_size;
+  job.segment_count = (first.total + segment_size - 1) / segment_size;
+  job.next_segment = 1;
+  job.completed = 0;
+  job.failed = false;
+  job.done_sem = xSemaphoreCreateCounting(connections, 0);
+
+  uint32_t workers = connections;
+  if (workers > job.segment_count - 1) {
+    workers = job.segment_count - 1;
+  }
+  uint32_t started = 0;
+  if (job.done_sem) {
+    for (uint32_t i = 1; i < workers; ++i) {
+      auto ret = xTaskCreate(ParallelDownloadTask, "http_download",
+                             PARALLEL_TASK_STACK_SIZE, (void*)&job,
+                             PARALLEL_TASK_PRIORITY, nullptr);
+      if (ret != pdPASS) {
+        ESP_LOGW(TAG, "start download worker failed, %u running", started);
         break;
       }
+      ++started;
     }
-    ESP_LOGI(TAG, "download data len:%d", read_len);
   }
+  RunParallel(&job);
+  for (uint32_t i = 0; i < started; ++i) {
+    xSemaphoreTake(job.done_sem, portMAX_DELAY);
+  }
+  if (job.done_sem) {
+    vSemaphoreDelete(job.done_sem);
+  }
+  FinishStats(start_us);
+  return !job.failed && job.completed == job.segment_count - 1;
+}
+
+void HttpDownload::SaveProgress(const char* url, size_t offset, size_t total,
+                                const std::string& validator) {
+  // without a validator a resumed download could mix two versions
+  if (validator.empty() || validator.size() >= MAX_VALIDATOR_LEN) {
+    return;
+  }
+  ProgressRecord record{};
+  record.url_crc = esp_rom_crc32_le(0, (const uint8_t*)url, strlen(url));
+  record.offset = offset;
+  record.total = total;
+  memcpy(record.validator, validator.data(), validator.size());
+  nvs_handle_t handle;
+  if (nvs_open(PROGRESS_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+    ESP_LOGE(TAG, "open nvs for download progress failed");
+    return;
+  }
+  if (nvs_set_blob(handle, resume_key_.c_str(), &record, sizeof(record)) ==
+      ESP_OK) {
+    nvs_commit(handle);
+  }
+  nvs_close(handle);
+}
 
-  esp_http_client_close(client);
-  esp_http_client_cleanup(client);
-  return success;
+bool HttpDownload::LoadProgress(const char* url, size_t& offset,
+                                std::string& validator) {
+  nvs_handle_t handle;
+  if (nvs_open(PROGRESS_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+    return false;
+  }
+  ProgressRecord record{};
+  size_t len = sizeof(record);
+  auto err = nvs_get_blob(handle, resume_key_.c_str(), &record, &len);
+  nvs_close(handle);
+  if (err != ESP_OK || len != sizeof(record) ||
+      record.url_crc !=
+          esp_rom_crc32_le(0, (const uint8_t*)url, strlen(url)) ||
+      record.offset == 0 || record.offset >= record.total) {
+    return false;
+  }
+  record.validator[MAX_VALIDATOR_LEN - 1] = 0;
+  offset = record.offset;
+  validator = record.validator;
+  return true;
+}
+
+void HttpDownload::ClearProgress() {
+  if (resume_key_.empty()) {
+    return;
+  }
+  nvs_handle_t handle;
+  if (nvs_open(PROGRESS_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+    return;
+  }
+  if (nvs_erase_key(handle, resume_key_.c_str()) == ESP_OK) {
+    nvs_commit(handle);
+  }
+  nvs_close(handle);
+}
+
+void HttpDownload::FinishStats(int64_t start_us) {
+  auto elapsed_ms = (uint32_t)((esp_timer_get_time() - start_us) / 1000);
+  stats_mutex_.Lock();
+  stats_.elapsed_ms = elapsed_ms;
+  if (elapsed_ms > 0) {
+    stats_.bytes_per_sec = (uint64_t)stats_.received * 1000 / elapsed_ms;
+  }
+  auto stats = stats_;
+  stats_mutex_.Unlock();
+  ESP_LOGI(TAG,
+           "download %u bytes in %u ms, %u B/s, %u requests, %u retries",
+           (unsigned)stats.received, stats.elapsed_ms, stats.bytes_per_sec,
+           stats.requests, stats.retries);
+}
+
+HttpDownload::Stats HttpDownload::GetStats() {
+  stats_mutex_.Lock();
+  auto stats = stats_;
+  stats_mutex_.Unlock();
+  return stats;
 }
 
 HttpDownload::HttpDownload() {
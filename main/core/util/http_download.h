@@ -2,17 +2,50 @@
 
 #include <cstdint>
 #include <functional>
+#include <string>
 #include <vector>
 
+#include "mutex.h"
+
 namespace esp {
 
 #define HTTP_DOWNLOAD_BUFFER_SIZE 1024
 
+class DnsCache;
+class HttpConnectionPool;
+
 class HttpDownload {
  public:
+  // the position of data in the file is total_size - left_size - len, a
+  // resumed download starts past zero
   using DownloadCallback = std::function<bool(
       const uint8_t* data, size_t len, size_t left_size, size_t total_size)>;
 
+  // parallel mode, ranges complete out of order. calls are serialized
+  using RangeCallback = std::function<bool(
+      size_t offset, const uint8_t* data, size_t len, size_t total_size)>;
+
+  struct Stats {
+    size_t total_size{0};
+    // body bytes received, including bytes fetched again after a restart
+    size_t received{0};
+    // start position taken from the persisted progress
+    size_t resumed_from{0};
+    uint32_t requests{0};
+    uint32_t retries{0};
+    // the file changed on the server, started over from zero
+    uint32_t restarts{0};
+    uint32_t elapsed_ms{0};
+    uint32_t bytes_per_sec{0};
+    // time spent in the callback
+    uint32_t consumer_ms{0};
+    // pipelined, reads waiting for the callback to give a buffer back
+    uint32_t stall_ms{0};
+    // inflate, bytes given to the callback and time spent decoding
+    size_t inflated{0};
+    uint32_t inflate_ms{0};
+  };
+
   HttpDownload();
 
   void SkipCertCommonNameCheck(bool skip);
@@ -22,14 +55,139 @@ class HttpDownload {
   void SetClientPem(char* pem);
   void SetClientKey(char* pem);
 
+  // bytes per read and per callback, HTTP_DOWNLOAD_BUFFER_SIZE by default
+  void SetBufferSize(uint32_t size);
+
+  size_t BufferSize() const { return buffer_size_; }
+
+  // DoDownload runs the callback on a consumer task with two buffers, the
+  // next read fills one while the callback processes the other, so a slow
+  // callback (flash write, inflate) no longer stalls the socket
+  void SetPipelined(bool enable, uint32_t task_stack_size = 4096,
+                    uint32_t task_priority = 5);
+
+  bool Pipelined() const { return pipelined_; }
+
+  uint32_t ConsumerStackSize() const { return consumer_stack_size_; }
+
+  uint32_t ConsumerPriority() const { return consumer_priority_; }
+
+  // DoDownload sends Accept-Encoding: gzip, deflate and inflates a gzip or
+  // zlib body (Content-Encoding or a .gz file) before the callback, other
+  // bodies are passed through. the callback sees the inflated stream:
+  // left_size is 0 and total_size the bytes inflated so far, the size is
+  // not known before the end. progress is not persisted, the decoder state
+  // does not survive a reboot
+  void SetInflate(bool enable);
+
+  bool Inflate() const { return inflate_; }
+
+  // a failed read resumes with a Range request from the last byte
+  // received, max_retries in a row without progress
+  void SetRetry(uint32_t max_retries, uint32_t retry_delay_ms);
+
+  // persist progress in nvs under key (at most 15 chars), so DoDownload
+  // resumes after a reboot. needs an ETag or Last-Modified from the
+  // server, the callback must accept data from the resume position, see
+  // DownloadCallback
+  void SetResumeKey(const char* nvs_key);
+
+  const std::string& ResumeKey() const { return resume_key_; }
+
+  void ClearProgress();
+
+  // ranges reuse keep-alive connections from the pool
+  void SetConnectionPool(HttpConnectionPool* pool);
+
+  // connect http:// urls to the address cached in dns_cache, the Host
+  // header keeps the name. a failed connect drops the address so the
+  // retry looks the name up again
+  void SetDnsCache(DnsCache* dns_cache);
+
   bool DoDownload(const char* url, DownloadCallback callback);
 
+  // splits the file in segment_size ranges fetched on up to connections
+  // tasks at once (the caller is one of them). falls back to a single
+  // stream when the server ignores Range. progress is not persisted and
+  // SetInflate does not apply, the ranges are requested unencoded
+  bool DoParallelDownload(const char* url, uint32_t connections,
+                          size_t segment_size, RangeCallback callback);
+
+  Stats GetStats();
+
+  struct ParallelJob;
+
+  // worker task loop of DoParallelDownload
+  void RunParallel(ParallelJob* job);
+
+  struct Consumer;
+
+  // consumer task loop of the pipelined DoDownload
+  void ConsumeLoop(Consumer* consumer);
+
  private:
+  using RangeSink =
+      std::function<bool(size_t offset, const uint8_t* data, size_t len)>;
+
+  struct RangeResult {
+    int status{0};
+    size_t total{0};
+    std::string validator;
+    // file offset after the last byte given to the sink
+    size_t next{0};
+    size_t received{0};
+    bool aborted{false};
+    // validator mismatch or unsatisfiable range, nothing delivered
+    bool changed{false};
+  };
+
+  // one GET for [begin, end), end 0 is to the end of the file. a server
+  // ignoring Range answers 200, the bytes before begin are dropped, or
+  // the whole file is delivered when begin is 0.
+  // reads go to *buffer, the sink may swap it for another buffer of
+  // buffer_size_ + 1 bytes
+  // accept_encoding sends Accept-Encoding: gzip, deflate
+  bool FetchRange(const char* url, size_t begin, size_t end,
+                  const std::string& if_range, bool accept_encoding,
+                  const RangeSink& sink, uint8_t** buffer,
+                  RangeResult& result);
+
+  bool FetchWithRetry(const char* url, size_t begin, size_t end,
+                      std::string& validator, bool accept_encoding,
+                      const RangeSink& sink, uint8_t** buffer,
+                      RangeResult& result);
+
+  bool StartConsumer(Consumer* consumer);
+
+  void StopConsumer(Consumer* consumer);
+
+  void SaveProgress(const char* url, size_t offset, size_t total,
+                    const std::string& validator);
+
+  bool LoadProgress(const char* url, size_t& offset,
+                    std::string& validator);
+
+  void FinishStats(int64_t start_us);
+
   bool skip_cert_common_name_check_{true};
   char* cert_pem_{nullptr};
   char* client_pem_{nullptr};
   char* client_key_pem{nullptr};
   std::vector<uint8_t> buffer_;
+  size_t buffer_size_{HTTP_DOWNLOAD_BUFFER_SIZE};
+  // second buffer of the pipelined mode
+  std::vector<uint8_t> spare_buffer_;
+  bool pipelined_{false};
+  bool inflate_{false};
+  uint32_t consumer_stack_size_{4096};
+  uint32_t consumer_priority_{5};
+  uint32_t max_retries_{3};
+  uint32_t retry_delay_ms_{1000};
+  std::string resume_key_;
+  HttpConnectionPool* pool_{nullptr};
+  DnsCache* dns_cache_{nullptr};
+  Mutex stats_mutex_;
+  Stats stats_;
 };
 
 }  // namespace esp
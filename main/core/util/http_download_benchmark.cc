@@ -0,0 +1,134 @@
+#include "http_download_benchmark.h"
+
+#include <cstdio>
+#include <utility>
+
+#include "esp_log.h"
+#include "esp_rom_sys.h"
+
+static const char* TAG = "http_download_benchmark";
+
+namespace esp {
+
+HttpDownloadBenchmark::HttpDownloadBenchmark(HttpDownload* download,
+                                             Config config)
+    : download_(download), config_(std::move(config)) {}
+
+HttpDownloadBenchmark::Result HttpDownloadBenchmark::RunOne(
+    uint32_t buffer_size, uint32_t us_per_kb, bool pipelined, bool inflate) {
+  Result result;
+  result.buffer_size = buffer_size;
+  result.consumer_us_per_kb = us_per_kb;
+  result.pipelined = pipelined;
+  result.inflate = inflate;
+  download_->SetBufferSize(buffer_size);
+  download_->SetInflate(inflate);
+  download_->SetPipelined(pipelined, config_.consumer_stack_size,
+                          config_.consumer_priority);
+  // cpu bound like inflate, the fraction of a KB carries over so small
+  // chunks cost the same per byte
+  uint64_t owed = 0;
+  auto consume = [&](const uint8_t* data, size_t len, size_t left_size,
+                     size_t total) {
+    owed += (uint64_t)len * us_per_kb;
+    if (owed >= 1024) {
+      esp_rom_delay_us(owed / 1024);
+      owed %= 1024;
+    }
+    return true;
+  };
+  result.ok = download_->DoDownload(config_.url.c_str(), consume);
+  result.stats = download_->GetStats();
+  return result;
+}
+
+HttpDownloadBenchmark::Result HttpDownloadBenchmark::RunParallel(
+    uint32_t connections) {
+  Result result;
+  result.buffer_size = HTTP_DOWNLOAD_BUFFER_SIZE;
+  result.connections = connections;
+  download_->SetBufferSize(HTTP_DOWNLOAD_BUFFER_SIZE);
+  download_->SetInflate(false);
+  download_->SetPipelined(false);
+  auto consume = [](size_t offset, const uint8_t* data, size_t len,
+                    size_t total) { return true; };
+  result.ok = download_->DoParallelDownload(config_.url.c_str(), connections,
+                                            config_.segment_size, consume);
+  result.stats = download_->GetStats();
+  return result;
+}
+
+std::vector<HttpDownloadBenchmark::Result> HttpDownloadBenchmark::Run() {
+  std::vector<Result> results;
+  if (!download_ || config_.url.empty()) {
+    return results;
+  }
+  for (int inflate = 0; inflate <= (config_.compare_inflate ? 1 : 0);
+       ++inflate) {
+    for (auto buffer_size : config_.buffer_sizes) {
+      for (auto us_per_kb : config_.consumer_us_per_kb) {
+        results.push_back(RunOne(buffer_size, us_per_kb, false, inflate));
+        results.push_back(RunOne(buffer_size, us_per_kb, true, inflate));
+      }
+    }
+  }
+  for (auto connections : config_.parallel_connections) {
+    if (connections > 0) {
+      results.push_back(RunParallel(connections));
+    }
+  }
+  download_->SetInflate(false);
+  download_->SetPipelined(false);
+  download_->SetBufferSize(HTTP_DOWNLOAD_BUFFER_SIZE);
+  return results;
+}
+
+std::vector<HttpDownloadBenchmark::Result>
+HttpDownloadBenchmark::RunOnFaultServer(
+    HttpDownload* download, uint16_t port,
+    const HttpFaultServer::Config& server_config, Config config) {
+  HttpFaultServer server(port, server_config);
+  if (!server.Start()) {
+    return {};
+  }
+  char url[48];
+  snprintf(url, sizeof(url), "http://127.0.0.1:%u/file.bin", port);
+  config.url = url;
+  // the fault server serves plain bytes only
+  config.compare_inflate = false;
+  auto results = HttpDownloadBenchmark(download, std::move(config)).Run();
+  auto stats = server.GetStats();
+  ESP_LOGI(TAG, "fault server: %u connections, %u requests, %u faults",
+           stats.connections, stats.requests, stats.faults);
+  server.Stop();
+  return results;
+}
+
+void HttpDownloadBenchmark::LogReport(const std::vector<Result>& results) {
+  // B/s and wire bytes are as received, out bytes after inflate
+  ESP_LOGI(TAG,
+           "buffer  us/KB  mode              B/s  consumer ms  stall ms"
+           "  wire bytes  out bytes  inflate ms");
+  for (const auto& result : results) {
+    const auto& stats = result.stats;
+    // inflate, or the connection count of a parallel run
+    char variant[12] = "";
+    if (result.connections > 0) {
+      snprintf(variant, sizeof(variant), "x%u", (unsigned)result.connections);
+    } else if (result.inflate) {
+      snprintf(variant, sizeof(variant), "inflate");
+    }
+    ESP_LOGI(TAG, "%6u  %5u  %-9s %-7s %7u  %11u  %8u  %10u  %9u  %10u%s",
+             (unsigned)result.buffer_size, (unsigned)result.consumer_us_per_kb,
+             result.connections > 0
+                 ? "parallel"
+                 : (result.pipelined ? "pipelined" : "inline"),
+             variant, (unsigned)stats.bytes_per_sec,
+             (unsigned)stats.consumer_ms, (unsigned)stats.stall_ms,
+             (unsigned)stats.received,
+             (unsigned)(result.inflate ? stats.inflated : stats.received),
+             (unsigned)stats.inflate_ms, result.ok ? "" : "  failed");
+  }
+}
+
+}  // namespace esp
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "http_download.h"
+#include "http_fault_server.h"
+
+namespace esp {
+
+// downloads one url for every buffer size and simulated consumer cost,
+// inline and pipelined, optionally inflated, and reports throughput, so
+// the buffer size and mode of a consumer (flash write, inflate) can be
+// picked on the device.
+// RunOnFaultServer measures without a real server, against a local
+// HttpFaultServer, optionally closing connections mid body:
+//   HttpDownloadBenchmark::LogReport(HttpDownloadBenchmark::RunOnFaultServer(
+//       &download, 8080, {512 * 1024, 100 * 1024}, {}));
+// the download is left inline with the default buffer size, set no resume
+// key on it
+class HttpDownloadBenchmark {
+ public:
+  struct Config {
+    std::string url;
+    std::vector<uint32_t> buffer_sizes{1024, 4096};
+    // busy wait per KB in the callback, 0 is a free consumer
+    std::vector<uint32_t> consumer_us_per_kb{0, 250, 1000, 4000};
+    uint32_t consumer_stack_size{4096};
+    uint32_t consumer_priority{5};
+    // run every case again with SetInflate, to weigh the decode time
+    // against the bytes saved. the url must serve gzip
+    bool compare_inflate{false};
+    // DoParallelDownload once per connection count with a free consumer,
+    // after the single stream cases
+    std::vector<uint32_t> parallel_connections{2, 4};
+    size_t segment_size{64 * 1024};
+  };
+
+  struct Result {
+    uint32_t buffer_size{0};
+    uint32_t consumer_us_per_kb{0};
+    bool pipelined{false};
+    bool inflate{false};
+    // parallel download, 0 is a single stream
+    uint32_t connections{0};
+    bool ok{false};
+    HttpDownload::Stats stats;
+  };
+
+  HttpDownloadBenchmark(HttpDownload* download, Config config);
+
+  // blocks the calling task for all the runs
+  std::vector<Result> Run();
+
+  // serves a generated file from a loopback HttpFaultServer on port for
+  // the runs, config.url is replaced. faults and retries show up in the
+  // stats of every result
+  static std::vector<Result> RunOnFaultServer(
+      HttpDownload* download, uint16_t port,
+      const HttpFaultServer::Config& server_config, Config config);
+
+  static void LogReport(const std::vector<Result>& results);
+
+ private:
+  Result RunOne(uint32_t buffer_size, uint32_t us_per_kb, bool pipelined,
+                bool inflate);
+
+  Result RunParallel(uint32_t connections);
+
+  HttpDownload* download_;
+  Config config_;
+};
+
+}  // namespace esp
@@ -0,0 +1,354 @@
+
+#include "http_fault_server.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <strings.h>
+#include <utility>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+
+static const char* TAG = "http_fault_server";
+
+#define MAX_CONNECTIONS 4
+#define MAX_REQUEST_SIZE 2048
+#define RECV_CHUNK_SIZE 512
+#define SEND_CHUNK_SIZE 1024
+#define SELECT_TIMEOUT_MS 100
+#define SERVER_TASK_STACK_SIZE 4096
+#define SERVER_TASK_PRIORITY 5
+
+namespace esp {
+
+static void ServerTask(void* args) {
+  auto self = (HttpFaultServer*)args;
+  if (self) {
+    self->Run();
+  }
+}
+
+// value of a request header, case insensitive name, empty if missing
+static std::string HeaderValue(const std::string& request, const char* name) {
+  size_t name_len = strlen(name);
+  size_t pos = request.find("\r\n");
+  while (pos != std::string::npos && pos + 2 < request.size()) {
+    size_t line = pos + 2;
+    size_t line_end = request.find("\r\n", line);
+    if (line_end == std::string::npos) {
+      break;
+    }
+    if (line_end - line > name_len && request[line + name_len] == ':' &&
+        strncasecmp(request.c_str() + line, name, name_len) == 0) {
+      size_t value = line + name_len + 1;
+      while (value < line_end && request[value] == ' ') {
+        ++value;
+      }
+      return request.substr(value, line_end - value);
+    }
+    pos = line_end;
+  }
+  return "";
+}
+
+uint8_t HttpFaultServer::ByteAt(size_t offset) {
+  return (uint8_t)((offset >> 8) ^ (offset * 7));
+}
+
+HttpFaultServer::HttpFaultServer(uint16_t port, Config config)
+    : port_(port), config_(std::move(config)) {}
+
+HttpFaultServer::~HttpFaultServer() { Stop(); }
+
+bool HttpFaultServer::Start() {
+  if (task_handle_) {
+    return true;
+  }
+  listen_fd_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listen_fd_ < 0) {
+    ESP_LOGE(TAG, "create socket failed");
+    return false;
+  }
+  int reuse = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port_);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(listen_fd_, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(listen_fd_, MAX_CONNECTIONS) != 0) {
+    ESP_LOGE(TAG, "listen on port %u failed", port_);
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  exit_ = false;
+  exit_sem_ = xSemaphoreCreateBinary();
+  TaskHandle_t task = nullptr;
+  auto ret = xTaskCreate(ServerTask, "http_fault", SERVER_TASK_STACK_SIZE,
+                         (void*)this, SERVER_TASK_PRIORITY, &task);
+  if (ret != pdPASS) {
+    ESP_LOGE(TAG, "start server task failed");
+    vSemaphoreDelete((SemaphoreHandle_t)exit_sem_);
+    exit_sem_ = nullptr;
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  task_handle_ = task;
+  ESP_LOGI(TAG, "fault server listen on port %u, %u bytes, fault every %u",
+           port_, (unsigned)config_.file_size,
+           (unsigned)config_.fault_interval);
+  return true;
+}
+
+void HttpFaultServer::Stop() {
+  if (!task_handle_) {
+    return;
+  }
+  exit_ = true;
+  xSemaphoreTake((SemaphoreHandle_t)exit_sem_, portMAX_DELAY);
+  vSemaphoreDelete((SemaphoreHandle_t)exit_sem_);
+  exit_sem_ = nullptr;
+  task_handle_ = nullptr;
+}
+
+void HttpFaultServer::ChangeFile(const std::string& etag) {
+  mutex_.Lock();
+  config_.etag = etag;
+  mutex_.Unlock();
+}
+
+HttpFaultServer::Stats HttpFaultServer::GetStats() {
+  mutex_.Lock();
+  auto stats = stats_;
+  mutex_.Unlock();
+  return stats;
+}
+
+void HttpFaultServer::Run() {
+  while (!exit_) {
+    fd_set read_fds;
+    fd_set write_fds;
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    FD_SET(listen_fd_, &read_fds);
+    int max_fd = listen_fd_;
+    for (const auto& connection : connections_) {
+      FD_SET(connection.fd, connection.sending ? &write_fds : &read_fds);
+      if (connection.fd > max_fd) {
+        max_fd = connection.fd;
+      }
+    }
+    struct timeval timeout = {0, SELECT_TIMEOUT_MS * 1000};
+    int ready = select(max_fd + 1, &read_fds, &write_fds, nullptr, &timeout);
+    if (ready <= 0) {
+      continue;
+    }
+    if (FD_ISSET(listen_fd_, &read_fds)) {
+      Accept();
+    }
+    for (size_t i = connections_.size(); i > 0; --i) {
+      auto& connection = connections_[i - 1];
+      bool keep = true;
+      if (FD_ISSET(connection.fd, &read_fds)) {
+        keep = Receive(connection);
+      } else if (FD_ISSET(connection.fd, &write_fds)) {
+        keep = SendSome(connection);
+      }
+      if (!keep) {
+        CloseConnection(i - 1);
+      }
+    }
+  }
+  while (!connections_.empty()) {
+    CloseConnection(connections_.size() - 1);
+  }
+  close(listen_fd_);
+  listen_fd_ = -1;
+  xSemaphoreGive((SemaphoreHandle_t)exit_sem_);
+  vTaskDelete(NULL);
+}
+
+bool HttpFaultServer::Accept() {
+  int fd = accept(listen_fd_, nullptr, nullptr);
+  if (fd < 0) {
+    return false;
+  }
+  if (connections_.size() == MAX_CONNECTIONS) {
+    ESP_LOGW(TAG, "too many connections, reject");
+    close(fd);
+    return false;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  connections_.push_back({fd, {}, {}, 0, 0, 0, false, true});
+  mutex_.Lock();
+  ++stats_.connections;
+  mutex_.Unlock();
+  return true;
+}
+
+void HttpFaultServer::CloseConnection(size_t index) {
+  close(connections_[index].fd);
+  connections_.erase(connections_.begin() + index);
+}
+
+bool HttpFaultServer::Receive(Connection& connection) {
+  char chunk[RECV_CHUNK_SIZE];
+  int len = recv(connection.fd, chunk, sizeof(chunk), 0);
+  if (len <= 0) {
+    return false;
+  }
+  connection.rx.append(chunk, len);
+  // one request at a time, esp_http_client does not pipeline
+  size_t end = connection.rx.find("\r\n\r\n");
+  if (end == std::string::npos) {
+    return connection.rx.size() < MAX_REQUEST_SIZE;
+  }
+  std::string request = connection.rx.substr(0, end + 2);
+  connection.rx.erase(0, end + 4);
+  return HandleRequest(connection, request);
+}
+
+bool HttpFaultServer::HandleRequest(Connection& connection,
+                                    const std::string& request) {
+  bool head = request.compare(0, 5, "HEAD ") == 0;
+  if (!head && request.compare(0, 4, "GET ") != 0) {
+    const char* reply =
+        "HTTP/1.1 405 Method Not Allowed\r\nContent-Length: 0\r\n"
+        "Connection: close\r\n\r\n";
+    send(connection.fd, reply, strlen(reply), 0);
+    return false;
+  }
+  auto range = HeaderValue(request, "Range");
+  auto if_range = HeaderValue(request, "If-Range");
+  connection.keep_alive =
+      strcasecmp(HeaderValue(request, "Connection").c_str(), "close") != 0;
+
+  mutex_.Lock();
+  auto etag = config_.etag;
+  bool ignore_range = config_.ignore_range;
+  ++stats_.requests;
+  if (!range.empty()) {
+    ++stats_.range_requests;
+  }
+  mutex_.Unlock();
+
+  size_t size = config_.file_size;
+  unsigned long first = 0, last = size > 0 ? size - 1 : 0;
+  bool partial = false;
+  if (!range.empty() && !ignore_range &&
+      (if_range.empty() || if_range == etag)) {
+    // single range, bytes=<first>- or bytes=<first>-<last>
+    int fields = sscanf(range.c_str(), "bytes=%lu-%lu", &first, &last);
+    if (fields < 1) {
+      first = 0;
+      last = size > 0 ? size - 1 : 0;
+    } else {
+      partial = true;
+      if (fields == 1 || last >= size) {
+        last = size - 1;
+      }
+    }
+  }
+
+  char header[256];
+  if (partial && (first >= size || first > last)) {
+    snprintf(header, sizeof(header),
+             "HTTP/1.1 416 Range Not Satisfiable\r\n"
+             "Content-Range: bytes */%u\r\nContent-Length: 0\r\n"
+             "Connection: %s\r\n\r\n",
+             (unsigned)size, connection.keep_alive ? "keep-alive" : "close");
+    connection.body_pos = connection.body_end = 0;
+  } else {
+    char content_range[64] = "";
+    if (partial) {
+      snprintf(content_range, sizeof(content_range),
+               "Content-Range: bytes %lu-%lu/%u\r\n", first, last,
+               (unsigned)size);
+    }
+    connection.body_pos = size > 0 ? first : 0;
+    connection.body_end = size > 0 ? last + 1 : 0;
+    snprintf(header, sizeof(header),
+             "HTTP/1.1 %s\r\n%sContent-Length: %u\r\nETag: %s\r\n"
+             "Accept-Ranges: %s\r\nConnection: %s\r\n\r\n",
+             partial ? "206 Partial Content" : "200 OK", content_range,
+             (unsigned)(connection.body_end - connection.body_pos),
+             etag.c_str(), ignore_range ? "none" : "bytes",
+             connection.keep_alive ? "keep-alive" : "close");
+  }
+  if (head) {
+    connection.body_end = connection.body_pos;
+  }
+  connection.header = header;
+  connection.header_pos = 0;
+  connection.sending = true;
+  return true;
+}
+
+bool HttpFaultServer::SendSome(Connection& connection) {
+  if (connection.header_pos < connection.header.size()) {
+    const char* data = connection.header.data() + connection.header_pos;
+    int ret = send(connection.fd, data,
+                   connection.header.size() - connection.header_pos, 0);
+    if (ret <= 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    connection.header_pos += ret;
+    mutex_.Lock();
+    stats_.bytes_out += ret;
+    mutex_.Unlock();
+    if (connection.header_pos < connection.header.size()) {
+      return true;
+    }
+  }
+
+  if (connection.body_pos < connection.body_end) {
+    uint8_t chunk[SEND_CHUNK_SIZE];
+    size_t len = connection.body_end - connection.body_pos;
+    if (len > sizeof(chunk)) {
+      len = sizeof(chunk);
+    }
+    if (config_.fault_interval > 0 &&
+        len > config_.fault_interval - sent_since_fault_) {
+      len = config_.fault_interval - sent_since_fault_;
+    }
+    for (size_t i = 0; i < len; ++i) {
+      chunk[i] = ByteAt(connection.body_pos + i);
+    }
+    int ret = send(connection.fd, chunk, len, 0);
+    if (ret <= 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    connection.body_pos += ret;
+    mutex_.Lock();
+    stats_.bytes_out += ret;
+    mutex_.Unlock();
+    if (config_.fault_interval > 0) {
+      sent_since_fault_ += ret;
+      if (sent_since_fault_ >= config_.fault_interval) {
+        sent_since_fault_ = 0;
+        mutex_.Lock();
+        ++stats_.faults;
+        mutex_.Unlock();
+        ESP_LOGD(TAG, "inject fault at %u", (unsigned)connection.body_pos);
+        return false;
+      }
+    }
+    if (connection.body_pos < connection.body_end) {
+      return true;
+    }
+  }
+
+  // response complete
+  connection.sending = false;
+  connection.header.clear();
+  return connection.keep_alive;
+}
+
+}  // namespace esp
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "mutex.h"
+
+namespace esp {
+
+// http/1.1 server on the lwip loopback interface serving one generated
+// file with Range and If-Range support, so HttpDownload throughput and
+// recovery can be measured on the device without a real server:
+//   HttpFaultServer server(8080, {512 * 1024, 100 * 1024});
+//   server.Start();
+//   download.DoDownload("http://127.0.0.1:8080/firmware.bin", ...);
+//   download.GetStats().bytes_per_sec
+// every fault_interval body bytes sent (over all connections) the
+// connection in flight is closed mid body
+class HttpFaultServer {
+ public:
+  struct Config {
+    size_t file_size{256 * 1024};
+    // 0 never injects a fault
+    size_t fault_interval{0};
+    // answer 200 with the whole file, like servers without range support
+    bool ignore_range{false};
+    std::string etag{"\"1\""};
+  };
+
+  struct Stats {
+    uint32_t connections{0};
+    uint32_t requests{0};
+    uint32_t range_requests{0};
+    uint32_t faults{0};
+    uint64_t bytes_out{0};
+  };
+
+  // content of the file, to check what was downloaded
+  static uint8_t ByteAt(size_t offset);
+
+  HttpFaultServer(uint16_t port, Config config);
+
+  ~HttpFaultServer();
+
+  bool Start();
+
+  void Stop();
+
+  // a new etag, downloads resuming with the old one start over
+  void ChangeFile(const std::string& etag);
+
+  Stats GetStats();
+
+  void Run();
+
+ private:
+  struct Connection {
+    int fd;
+    std::string rx;
+    // response being sent, header then body [body_pos, body_end)
+    std::string header;
+    size_t header_pos;
+    size_t body_pos;
+    size_t body_end;
+    bool sending;
+    bool keep_alive;
+  };
+
+  bool Accept();
+
+  // false when the connection must be closed
+  bool Receive(Connection& connection);
+
+  bool HandleRequest(Connection& connection, const std::string& request);
+
+  bool SendSome(Connection& connection);
+
+  void CloseConnection(size_t index);
+
+  uint16_t port_;
+  Config config_;
+  int listen_fd_{-1};
+  std::vector<Connection> connections_;
+  size_t sent_since_fault_{0};
+  std::atomic<bool> exit_{false};
+  void* task_handle_{nullptr};
+  void* exit_sem_{nullptr};
+  Mutex mutex_;
+  Stats stats_;
+};
+
+}  // namespace esp
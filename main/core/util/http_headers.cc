@@ -0,0 +1,174 @@
+#include "http_headers.h"
+
+#include <strings.h>
+
+namespace esp {
+
+// first allocation of the arena, room for a handful of headers
+#define HEADER_ARENA_SIZE 256
+
+// in Name order
+static const std::string_view WELL_KNOWN_NAMES[HttpHeaders::kNameCount] = {
+    "Accept",
+    "Accept-Encoding",
+    "Accept-Ranges",
+    "Authorization",
+    "Cache-Control",
+    "Connection",
+    "Content-Encoding",
+    "Content-Length",
+    "Content-Range",
+    "Content-Type",
+    "Date",
+    "ETag",
+    "Host",
+    "If-Modified-Since",
+    "If-None-Match",
+    "If-Range",
+    "Last-Modified",
+    "Location",
+    "Range",
+    "Server",
+    "Transfer-Encoding",
+    "User-Agent",
+};
+
+static bool EqualsIgnoreCase(std::string_view a, std::string_view b) {
+  return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+HttpHeaders::Name HttpHeaders::Intern(std::string_view name) {
+  for (size_t i = 0; i < kNameCount; ++i) {
+    if (EqualsIgnoreCase(name, WELL_KNOWN_NAMES[i])) {
+      return (Name)i;
+    }
+  }
+  return kCustom;
+}
+
+std::string_view HttpHeaders::NameOf(Name name) {
+  return name < kNameCount ? WELL_KNOWN_NAMES[name] : std::string_view();
+}
+
+HttpHeaders::HttpHeaders(const HttpHeaders& other) { *this = other; }
+
+HttpHeaders& HttpHeaders::operator=(const HttpHeaders& other) {
+  if (this == &other) {
+    return *this;
+  }
+  Clear();
+  for (size_t i = 0; i < other.size_; ++i) {
+    auto header = other.At(i);
+    Set(header.name, header.value);
+  }
+  return *this;
+}
+
+const HttpHeaders::Entry& HttpHeaders::EntryAt(size_t index) const {
+  return index < kInlineEntries ? inline_[index]
+                                : overflow_[index - kInlineEntries];
+}
+
+HttpHeaders::Entry& HttpHeaders::EntryAt(size_t index) {
+  return index < kInlineEntries ? inline_[index]
+                                : overflow_[index - kInlineEntries];
+}
+
+int HttpHeaders::Find(Name id, std::string_view name) const {
+  for (size_t i = 0; i < size_; ++i) {
+    const auto& entry = EntryAt(i);
+    if (entry.name != id) {
+      continue;
+    }
+    if (id != kCustom ||
+        EqualsIgnoreCase(name, std::string_view(arena_.data() +
+                                                    entry.name_offset,
+                                                entry.name_len))) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+uint32_t HttpHeaders::Store(std::string_view text) {
+  if (arena_.capacity() == 0) {
+    arena_.reserve(HEADER_ARENA_SIZE);
+  }
+  uint32_t offset = arena_.size();
+  arena_.append(text.data(), text.size());
+  arena_.push_back('\0');
+  return offset;
+}
+
+void HttpHeaders::Set(std::string_view name, std::string_view value) {
+  if (name.empty() || name.size() > UINT16_MAX || value.size() > UINT16_MAX) {
+    return;
+  }
+  Name id = Intern(name);
+  int index = Find(id, name);
+  if (index >= 0) {
+    auto& entry = EntryAt(index);
+    entry.value_offset = Store(value);
+    entry.value_len = value.size();
+    return;
+  }
+  Entry entry{0, 0, 0, (uint16_t)value.size(), id};
+  if (id == kCustom) {
+    entry.name_offset = Store(name);
+    entry.name_len = name.size();
+  }
+  entry.value_offset = Store(value);
+  if (size_ < kInlineEntries) {
+    inline_[size_] = entry;
+  } else {
+    overflow_.push_back(entry);
+  }
+  ++size_;
+}
+
+std::string_view HttpHeaders::Get(std::string_view name) const {
+  int index = Find(Intern(name), name);
+  return index >= 0 ? At(index).value : std::string_view();
+}
+
+bool HttpHeaders::Has(std::string_view name) const {
+  return Find(Intern(name), name) >= 0;
+}
+
+bool HttpHeaders::Remove(std::string_view name) {
+  int index = Find(Intern(name), name);
+  if (index < 0) {
+    return false;
+  }
+  for (size_t i = index; i + 1 < size_; ++i) {
+    EntryAt(i) = EntryAt(i + 1);
+  }
+  --size_;
+  if (size_ >= kInlineEntries) {
+    overflow_.pop_back();
+  }
+  return true;
+}
+
+HttpHeaders::Header HttpHeaders::At(size_t index) const {
+  const auto& entry = EntryAt(index);
+  Header header;
+  header.name = entry.name == kCustom
+                    ? std::string_view(arena_.data() + entry.name_offset,
+                                       entry.name_len)
+                    : NameOf(entry.name);
+  header.value =
+      std::string_view(arena_.data() + entry.value_offset, entry.value_len);
+  return header;
+}
+
+void HttpHeaders::Clear() {
+  // keeps the arena and overflow capacity for reuse
+  arena_.clear();
+  overflow_.clear();
+  size_ = 0;
+}
+
+void HttpHeaders::Reserve(size_t bytes) { arena_.reserve(bytes); }
+
+}  // namespace esp
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace esp {
+
+// header list for HttpRequest and HttpResponse. names match case
+// insensitively, well known names are interned to an id and not stored.
+// other names and all values are copied, nul terminated, into one arena
+// string, and the first kInlineEntries entries live in the object, so a
+// typical request or response allocates once (the arena) for its headers.
+// a Set on an existing name appends the new value, the old bytes are
+// reclaimed by Clear only
+class HttpHeaders {
+ public:
+  enum Name : uint8_t {
+    kAccept = 0,
+    kAcceptEncoding,
+    kAcceptRanges,
+    kAuthorization,
+    kCacheControl,
+    kConnection,
+    kContentEncoding,
+    kContentLength,
+    kContentRange,
+    kContentType,
+    kDate,
+    kETag,
+    kHost,
+    kIfModifiedSince,
+    kIfNoneMatch,
+    kIfRange,
+    kLastModified,
+    kLocation,
+    kRange,
+    kServer,
+    kTransferEncoding,
+    kUserAgent,
+    kNameCount,
+    kCustom = 0xff,
+  };
+
+  static constexpr size_t kInlineEntries = 8;
+
+  // names and values, .data() is nul terminated
+  struct Header {
+    std::string_view name;
+    std::string_view value;
+  };
+
+  // kCustom if name is not well known
+  static Name Intern(std::string_view name);
+
+  // canonical spelling of a well known name
+  static std::string_view NameOf(Name name);
+
+  HttpHeaders() = default;
+
+  HttpHeaders(const HttpHeaders& other);
+
+  HttpHeaders& operator=(const HttpHeaders& other);
+
+  // replaces a header of the same name
+  void Set(std::string_view name, std::string_view value);
+
+  // empty if missing
+  std::string_view Get(std::string_view name) const;
+
+  bool Has(std::string_view name) const;
+
+  bool Remove(std::string_view name);
+
+  size_t Size() const { return size_; }
+
+  bool Empty() const { return size_ == 0; }
+
+  Header At(size_t index) const;
+
+  void Clear();
+
+  // arena bytes, to size it up front
+  void Reserve(size_t bytes);
+
+ private:
+  struct Entry {
+    uint32_t name_offset;
+    uint32_t value_offset;
+    uint16_t name_len;
+    uint16_t value_len;
+    Name name;
+  };
+
+  const Entry& EntryAt(size_t index) const;
+
+  Entry& EntryAt(size_t index);
+
+  // index of the header, -1 if missing
+  int Find(Name id, std::string_view name) const;
+
+  // offset of the nul terminated copy
+  uint32_t Store(std::string_view text);
+
+  std::string arena_;
+  Entry inline_[kInlineEntries];
+  std::vector<Entry> overflow_;
+  size_t size_{0};
+};
+
+}  // namespace esp
@@ -5,13 +5,14 @@ namespace esp {
 HttpRequest::HttpRequest(std::string url, Method method)
     : url_(std::move(url)), method_(method) {}
 
-void HttpRequest::SetHeader(const std::string& header,
-                            const std::string& value) {
-  headers_[header] = value;
+void HttpRequest::SetHeader(std::string_view header, std::string_view value) {
+  headers_.Set(header, value);
 }
 
 void HttpRequest::SetRawHeader(const char* header, const char* value) {
-  raw_headers_[header] = value;
+  if (header && value) {
+    headers_.Set(header, value);
+  }
 }
 
 void HttpRequest::SetUrl(std::string url) {
@@ -30,20 +31,16 @@ void HttpRequest::SetRequestBody(HttpRequest::RequestBody data) {
   request_data_ = std::move(data);
 }
 
-std::string HttpRequest::GetHeader(const std::string& name) const {
-  auto it = headers_.find(name);
-  if (it != headers_.end()) {
-    return it->second;
-  }
-  return "";
+std::string_view HttpRequest::GetHeader(std::string_view name) const {
+  return headers_.Get(name);
 }
 
 HttpRequest::Headers& HttpRequest::GetHeaders() {
   return headers_;
 }
 
-HttpRequest::RawHeaders& HttpRequest::GetRawHeaders() {
-  return raw_headers_;
+const HttpRequest::Headers& HttpRequest::GetHeaders() const {
+  return headers_;
 }
 
 std::string& HttpRequest::GetUrl() {
@@ -1,15 +1,16 @@
 #pragma once
 
-#include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "http_headers.h"
+
 namespace esp {
 
 class HttpRequest {
  public:
-  using Headers = std::map<std::string, std::string>;
-  using RawHeaders = std::map<const char*, const char*>;
+  using Headers = HttpHeaders;
   using RequestBody = std::vector<uint8_t>;
 
   enum Method {
@@ -23,8 +24,10 @@ class HttpRequest {
 
   HttpRequest(std::string url, Method method);
 
-  void SetHeader(const std::string& header, const std::string& value);
+  // names are case insensitive, a header set again is replaced
+  void SetHeader(std::string_view header, std::string_view value);
 
+  // same as SetHeader, kept for callers passing literals
   void SetRawHeader(const char* header, const char* value);
 
   void SetUrl(std::string url);
@@ -37,11 +40,12 @@ class HttpRequest {
 
   void SetRawRequestBody(char* data);
 
-  std::string GetHeader(const std::string& name) const;
+  // empty if missing, valid until the headers change
+  std::string_view GetHeader(std::string_view name) const;
 
   Headers& GetHeaders();
 
-  RawHeaders& GetRawHeaders();
+  const Headers& GetHeaders() const;
 
   std::string& GetUrl();
 
@@ -55,7 +59,6 @@ class HttpRequest {
   std::string url_;
   Method method_;
   Headers headers_;
-  RawHeaders raw_headers_;
   RequestBody request_data_;
   char* raw_request_data_{nullptr};
 };
@@ -6,55 +6,167 @@
 namespace esp {
 
 #define DEFAULT_DATA_SIZE 2048
+// blocks double up to this size, larger ones are hard to find in a
+// fragmented heap
+#define MAX_BLOCK_SIZE (32 * 1024)
+// a 64 KB body needs 6 blocks
+#define INITIAL_BLOCK_SLOTS 8
+// a known length up to this is presized into one block, a longer one
+// only sets the block size, so a bogus Content-Length reserves nothing
+#define MAX_PRESIZE_SIZE (64 * 1024)
+#define MAX_BLOCK_SLOTS 64
+// only the small blocks are kept for reuse
+#define BODY_POOL_MAX_FREE_BLOCKS 4
+
+static BufferPool* BodyPool() {
+  static BufferPool INSTANCE(DEFAULT_DATA_SIZE, BODY_POOL_MAX_FREE_BLOCKS);
+  return &INSTANCE;
+}
 
 void HttpResponse::SetStatusCode(int32_t code) { code_ = code; }
 
 int32_t HttpResponse::GetStatusCode() const { return code_; }
 
+bool HttpResponse::AddBlock(size_t min_size) {
+  size_t block_size = DEFAULT_DATA_SIZE;
+  if (expected_size_ > size_) {
+    // large known length, full blocks and an exact last one
+    block_size = expected_size_ - size_ + 1;
+    if (block_size > MAX_BLOCK_SIZE) {
+      block_size = MAX_BLOCK_SIZE;
+    }
+  } else if (!blocks_.empty()) {
+    block_size = blocks_.back().Capacity() * 2;
+    if (block_size > MAX_BLOCK_SIZE) {
+      block_size = MAX_BLOCK_SIZE;
+    }
+  }
+  if (block_size < min_size) {
+    block_size = min_size;
+  }
+  auto block = BodyPool()->Acquire(block_size);
+  if (!block.Valid() && block_size > min_size) {
+    block = BodyPool()->Acquire(min_size);
+  }
+  if (!block.Valid()) {
+    return false;
+  }
+  if (blocks_.capacity() == 0) {
+    blocks_.reserve(INITIAL_BLOCK_SLOTS);
+  }
+  blocks_.push_back(std::move(block));
+  return true;
+}
+
 void HttpResponse::SetResponseDataCapacity(size_t size) {
-  response_data_.reserve(size);
+  size_t left = blocks_.empty()
+                    ? 0
+                    : blocks_.back().Capacity() - blocks_.back().Size();
+  if (size <= size_ + left) {
+    return;
+  }
+  if (size - size_ - left <= MAX_PRESIZE_SIZE) {
+    // room for the rest of the body plus a nul terminator
+    AddBlock(size - size_ - left + 1);
+    return;
+  }
+  expected_size_ = size;
+  size_t slots = blocks_.size() + (size - size_) / MAX_BLOCK_SIZE + 1;
+  blocks_.reserve(slots < MAX_BLOCK_SLOTS ? slots : MAX_BLOCK_SLOTS);
 }
 
-void HttpResponse::AddHeader(const std::string& header,
-                             const std::string& value) {
-  headers_[header] = value;
+void HttpResponse::AddHeader(std::string_view header, std::string_view value) {
+  headers_.Set(header, value);
 }
 
 void HttpResponse::SetResponseData(ResponseData data) {
-  has_response_ = true;
-  response_data_.swap(data);
-  current_size_ = 0;
+  blocks_.clear();
+  size_ = 0;
+  expected_size_ = 0;
+  SetResponseDataCapacity(data.size());
+  AppendResponseData(data.data(), data.size());
 }
 
 void HttpResponse::AppendResponseData(const char* data, size_t size) {
   has_response_ = true;
-  if (current_size_ + size >= response_data_.size()) {
-    size_t new_add_size = DEFAULT_DATA_SIZE;
-    if (size >= new_add_size) {
-      new_add_size = size + 1;
+  while (size > 0) {
+    if (blocks_.empty() ||
+        blocks_.back().Size() == blocks_.back().Capacity()) {
+      if (!AddBlock(size)) {
+        error_ = "no memory for response data";
+        return;
+      }
+    }
+    auto& block = blocks_.back();
+    size_t len = block.Capacity() - block.Size();
+    if (len > size) {
+      len = size;
     }
-    response_data_.resize(response_data_.size() + new_add_size, 0);
+    block.Append(data, len);
+    data += len;
+    size -= len;
+    size_ += len;
   }
-  std::memcpy(response_data_.data() + current_size_, data, size);
-  current_size_ += size;
 }
 
-std::string HttpResponse::GetHeader(const std::string& header) const {
-  auto it = headers_.find(header);
-  if (it != headers_.end()) {
-    return it->second;
-  }
-  return "";
+std::string_view HttpResponse::GetHeader(std::string_view header) const {
+  return headers_.Get(header);
 }
 
 void HttpResponse::ReleaseReponseData(ResponseData& data) {
   has_response_ = false;
-  data.swap(response_data_);
-  data.resize(current_size_);
-  current_size_ = 0;
+  data.resize(size_);
+  size_t offset = 0;
+  for (const auto& block : blocks_) {
+    std::memcpy(data.data() + offset, block.Data(), block.Size());
+    offset += block.Size();
+  }
+  blocks_.clear();
+  size_ = 0;
+  expected_size_ = 0;
+}
+
+bool HttpResponse::Coalesce() {
+  if (blocks_.size() == 1 && blocks_[0].Size() < blocks_[0].Capacity()) {
+    return true;
+  }
+  auto merged = BodyPool()->Acquire(size_ + 1);
+  if (!merged.Valid()) {
+    return false;
+  }
+  for (const auto& block : blocks_) {
+    merged.Append(block.Data(), block.Size());
+  }
+  blocks_.clear();
+  blocks_.push_back(std::move(merged));
+  return true;
 }
 
-char* HttpResponse::RawResponseData() { return response_data_.data(); }
+char* HttpResponse::RawResponseData() {
+  if (!Coalesce()) {
+    return nullptr;
+  }
+  auto& block = blocks_[0];
+  block.Data()[block.Size()] = 0;
+  return (char*)block.Data();
+}
+
+std::string_view HttpResponse::ResponseDataView() {
+  auto data = RawResponseData();
+  return data ? std::string_view(data, size_) : std::string_view();
+}
+
+std::string_view HttpResponse::ResponseChunk(size_t index) const {
+  if (index >= blocks_.size()) {
+    return std::string_view();
+  }
+  return std::string_view((const char*)blocks_[index].Data(),
+                          blocks_[index].Size());
+}
+
+BufferPool::Stats HttpResponse::GetBodyPoolStats() {
+  return BodyPool()->GetStats();
+}
 
 void HttpResponse::SetError(std::string error) { error_ = std::move(error); }
 
@@ -2,34 +2,56 @@
 
 #include <cstdint>
 
-#include <map>
+#include <string>
+#include <string_view>
 #include <vector>
 
+#include "buffer_pool.h"
+#include "http_headers.h"
+
 namespace esp {
 
 class HttpResponse {
  public:
-  using Headers = std::map<std::string, std::string>;
+  using Headers = HttpHeaders;
   using ResponseData = std::vector<char>;
 
   void SetStatusCode(int32_t code);
 
   int32_t GetStatusCode() const;
 
+  // pre-size the body, e.g. from Content-Length: up to 64 KB lands in one
+  // block, a longer body in full size blocks allocated as data arrives
   void SetResponseDataCapacity(size_t size);
 
-  void AddHeader(const std::string& header, const std::string& value);
+  // names are case insensitive, a repeated header keeps the last value
+  void AddHeader(std::string_view header, std::string_view value);
 
   void SetResponseData(ResponseData data);
 
+  // the body is kept as a list of pooled blocks growing geometrically, so
+  // appending never copies what is already stored
   void AppendResponseData(const char* data, size_t size);
 
-  std::string GetHeader(const std::string& header) const;
+  // empty if missing, valid until the headers change
+  std::string_view GetHeader(std::string_view header) const;
+
+  const Headers& GetHeaders() const { return headers_; }
 
   void ReleaseReponseData(ResponseData& data);
 
+  // contiguous nul terminated body, merges the blocks on first use
   char* RawResponseData();
 
+  std::string_view ResponseDataView();
+
+  size_t ResponseDataSize() const { return size_; }
+
+  // zero copy access to the body blocks
+  size_t ResponseChunkCount() const { return blocks_.size(); }
+
+  std::string_view ResponseChunk(size_t index) const;
+
   void SetError(std::string error);
 
   std::string GetError() const;
@@ -40,13 +62,23 @@ class HttpResponse {
 
   bool IsAlreadyPrcessDisconnected();
 
+  // the pool body blocks come from, alloc_count is the heap allocations
+  static BufferPool::Stats GetBodyPoolStats();
+
  private:
+  bool AddBlock(size_t min_size);
+
+  // single block with room for a nul terminator
+  bool Coalesce();
+
   int32_t code_{0};
-  ResponseData response_data_;
+  std::vector<PooledBuffer> blocks_;
+  size_t size_{0};
+  // a Content-Length too long to presize, sizes the blocks
+  size_t expected_size_{0};
   Headers headers_;
   bool has_response_{false};
   std::string error_;
-  size_t current_size_{0};
   bool already_process_disconnected_{false};
 };
 
@@ -0,0 +1,105 @@
+#include "http_response_benchmark.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "http_response.h"
+
+static const char* TAG = "http_response_benchmark";
+
+namespace esp {
+
+HttpResponseBenchmark::HttpResponseBenchmark(Config config)
+    : config_(std::move(config)) {
+  if (config_.chunk_size == 0) {
+    config_.chunk_size = 1;
+  }
+}
+
+HttpResponseBenchmark::Result HttpResponseBenchmark::RunOne(
+    size_t body_bytes, Mode mode) {
+  Result result;
+  result.body_bytes = body_bytes;
+  result.mode = mode;
+  if (config_.iterations == 0) {
+    return result;
+  }
+  std::vector<char> chunk(config_.chunk_size);
+  for (size_t i = 0; i < chunk.size(); ++i) {
+    chunk[i] = (char)('a' + i % 26);
+  }
+  uint32_t allocations = 0;
+  int64_t fill_us = 0;
+  int64_t view_us = 0;
+  bool ok = true;
+  for (uint32_t i = 0; i < config_.iterations && ok; ++i) {
+    if (mode == kVector) {
+      // what the body was before the blocks: grown by resize per chunk,
+      // nul terminated on read
+      std::vector<char> body;
+      auto start_us = esp_timer_get_time();
+      for (size_t done = 0; done < body_bytes; done += chunk.size()) {
+        size_t len = std::min(chunk.size(), body_bytes - done);
+        auto capacity = body.capacity();
+        body.resize(body.size() + len);
+        std::memcpy(body.data() + done, chunk.data(), len);
+        allocations += body.capacity() != capacity;
+      }
+      auto filled_us = esp_timer_get_time();
+      auto capacity = body.capacity();
+      body.push_back(0);
+      allocations += body.capacity() != capacity;
+      view_us += esp_timer_get_time() - filled_us;
+      fill_us += filled_us - start_us;
+      ok = body.size() == body_bytes + 1;
+      continue;
+    }
+    auto before = HttpResponse::GetBodyPoolStats().alloc_count;
+    HttpResponse response;
+    auto start_us = esp_timer_get_time();
+    if (mode == kPresized) {
+      response.SetResponseDataCapacity(body_bytes);
+    }
+    for (size_t done = 0; done < body_bytes; done += chunk.size()) {
+      response.AppendResponseData(
+          chunk.data(), std::min(chunk.size(), body_bytes - done));
+    }
+    auto filled_us = esp_timer_get_time();
+    auto view = response.ResponseDataView();
+    view_us += esp_timer_get_time() - filled_us;
+    fill_us += filled_us - start_us;
+    allocations += HttpResponse::GetBodyPoolStats().alloc_count - before;
+    ok = view.size() == body_bytes && response.GetError().empty();
+  }
+  result.ok = ok;
+  result.allocations = allocations / config_.iterations;
+  result.fill_us = (uint32_t)(fill_us / config_.iterations);
+  result.view_us = (uint32_t)(view_us / config_.iterations);
+  return result;
+}
+
+std::vector<HttpResponseBenchmark::Result> HttpResponseBenchmark::Run() {
+  std::vector<Result> results;
+  for (auto body_bytes : config_.body_sizes) {
+    results.push_back(RunOne(body_bytes, kVector));
+    results.push_back(RunOne(body_bytes, kBlocks));
+    results.push_back(RunOne(body_bytes, kPresized));
+  }
+  return results;
+}
+
+void HttpResponseBenchmark::LogReport(const std::vector<Result>& results) {
+  static const char* MODES[] = {"vector", "blocks", "presized"};
+  ESP_LOGI(TAG, "   bytes  mode      allocs  fill us  view us");
+  for (const auto& result : results) {
+    ESP_LOGI(TAG, "%8u  %-8s  %6u  %7u  %7u%s", (unsigned)result.body_bytes,
+             MODES[result.mode], (unsigned)result.allocations,
+             (unsigned)result.fill_us, (unsigned)result.view_us,
+             result.ok ? "" : "  failed");
+  }
+}
+
+}  // namespace esp
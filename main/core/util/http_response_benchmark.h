@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace esp {
+
+// fills HttpResponse bodies the way esp_http_client delivers them, chunk
+// by chunk, and reads them back as one view. reports heap allocations and
+// time per response for growing blocks, for a body presized from
+// Content-Length, and for a plain std::vector as the baseline:
+//   HttpResponseBenchmark::LogReport(HttpResponseBenchmark({}).Run());
+// block allocations come from the body pool stats, the small vector of
+// block slots is not counted
+class HttpResponseBenchmark {
+ public:
+  enum Mode {
+    kVector = 0,
+    kBlocks,
+    kPresized,
+  };
+
+  struct Config {
+    std::vector<size_t> body_sizes{1024, 16 * 1024, 64 * 1024, 256 * 1024};
+    // esp_http_client hands over at most its rx buffer per event
+    size_t chunk_size{512};
+    uint32_t iterations{10};
+  };
+
+  struct Result {
+    size_t body_bytes{0};
+    Mode mode{kVector};
+    bool ok{false};
+    // per response, body filled and read back
+    uint32_t allocations{0};
+    uint32_t fill_us{0};
+    uint32_t view_us{0};
+  };
+
+  explicit HttpResponseBenchmark(Config config);
+
+  // blocks the calling task for all the runs, needs the largest body
+  // size about twice in free heap
+  std::vector<Result> Run();
+
+  static void LogReport(const std::vector<Result>& results);
+
+ private:
+  Result RunOne(size_t body_bytes, Mode mode);
+
+  Config config_;
+};
+
+}  // namespace esp
@@ -0,0 +1,318 @@
+#include "inflate_stream.h"
+
+#include <cstdlib>
+#include <strings.h>
+
+#include "esp32/rom/miniz.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+
+static const char* TAG = "inflate";
+
+#define GZIP_HEADER_SIZE 10
+#define GZIP_TRAILER_SIZE 8
+#define GZIP_METHOD_DEFLATE 8
+#define GZIP_FLAG_HEADER_CRC 0x02
+#define GZIP_FLAG_EXTRA 0x04
+#define GZIP_FLAG_NAME 0x08
+#define GZIP_FLAG_COMMENT 0x10
+
+namespace esp {
+
+// gzip header fields in stream order, only the fixed one is mandatory
+enum GzipField {
+  kFieldFixed = 0,
+  kFieldExtraLen,
+  kFieldExtra,
+  kFieldName,
+  kFieldComment,
+  kFieldHeaderCrc,
+  kFieldEnd,
+};
+
+static bool HasField(uint8_t flags, int field) {
+  switch (field) {
+    case kFieldExtraLen:
+    case kFieldExtra:
+      return flags & GZIP_FLAG_EXTRA;
+    case kFieldName:
+      return flags & GZIP_FLAG_NAME;
+    case kFieldComment:
+      return flags & GZIP_FLAG_COMMENT;
+    case kFieldHeaderCrc:
+      return flags & GZIP_FLAG_HEADER_CRC;
+    default:
+      return true;
+  }
+}
+
+static uint32_t ReadLE32(const uint8_t* data) {
+  return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+bool InflateStream::FormatOf(const char* content_encoding, Format& format) {
+  if (!content_encoding) {
+    return false;
+  }
+  if (strcasecmp(content_encoding, "gzip") == 0 ||
+      strcasecmp(content_encoding, "x-gzip") == 0) {
+    format = kGzip;
+    return true;
+  }
+  if (strcasecmp(content_encoding, "deflate") == 0) {
+    format = kDeflate;
+    return true;
+  }
+  return false;
+}
+
+InflateStream::InflateStream(Format format) : format_(format) {
+  decompressor_ = malloc(sizeof(tinfl_decompressor));
+  window_ = (uint8_t*)malloc(TINFL_LZ_DICT_SIZE);
+  if (!decompressor_ || !window_) {
+    ESP_LOGE(TAG, "no memory for the inflate window");
+    free(decompressor_);
+    free(window_);
+    decompressor_ = nullptr;
+    window_ = nullptr;
+    return;
+  }
+  Reset();
+}
+
+InflateStream::~InflateStream() {
+  free(decompressor_);
+  free(window_);
+}
+
+void InflateStream::Reset() {
+  switch (format_) {
+    case kGzip:
+      stage_ = kGzipHeader;
+      break;
+    case kZlib:
+    case kRaw:
+      stage_ = kBody;
+      break;
+    default:
+      stage_ = kDetect;
+      break;
+  }
+  flags_ = format_ == kZlib ? TINFL_FLAG_PARSE_ZLIB_HEADER : 0;
+  gzip_ = format_ == kGzip;
+  window_pos_ = 0;
+  magic_len_ = 0;
+  field_ = kFieldFixed;
+  field_pos_ = 0;
+  field_left_ = 0;
+  gzip_flags_ = 0;
+  crc_ = 0;
+  stream_out_ = 0;
+  if (decompressor_) {
+    tinfl_init((tinfl_decompressor*)decompressor_);
+  }
+}
+
+bool InflateStream::Write(const uint8_t* data, size_t len,
+                          const Output& output) {
+  if (!Valid() || stage_ == kFailed) {
+    return false;
+  }
+  stats_.in_bytes += len;
+  if (!Feed(data, len, output)) {
+    stage_ = kFailed;
+    return false;
+  }
+  return true;
+}
+
+bool InflateStream::Finish(const Output& output) {
+  if (!Valid()) {
+    return false;
+  }
+  if (stage_ == kDetect && format_ == kAuto) {
+    // shorter than the magic bytes, not compressed
+    stage_ = kPassthrough;
+    if (magic_len_ > 0 && !Feed(magic_, magic_len_, output)) {
+      stage_ = kFailed;
+    }
+  }
+  if (stage_ != kFinished && stage_ != kPassthrough) {
+    ESP_LOGE(TAG, "compressed stream truncated");
+    return false;
+  }
+  return true;
+}
+
+bool InflateStream::Feed(const uint8_t* data, size_t len,
+                         const Output& output) {
+  while (len > 0) {
+    switch (stage_) {
+      case kDetect:
+        magic_[magic_len_++] = *data++;
+        --len;
+        if (magic_len_ == sizeof(magic_) && !Detect(output)) {
+          return false;
+        }
+        break;
+      case kGzipHeader:
+        if (!ParseGzipHeader(data, len)) {
+          return false;
+        }
+        break;
+      case kBody:
+        if (!Inflate(data, len, output)) {
+          return false;
+        }
+        break;
+      case kGzipTrailer:
+        if (!ParseGzipTrailer(data, len)) {
+          return false;
+        }
+        break;
+      case kFinished:
+        // trailing bytes or a second gzip member are ignored
+        return true;
+      case kPassthrough:
+        stream_out_ += len;
+        stats_.out_bytes += len;
+        return output(data, len);
+      case kFailed:
+        return false;
+    }
+  }
+  return true;
+}
+
+bool InflateStream::Detect(const Output& output) {
+  bool gzip = magic_[0] == 0x1f && magic_[1] == 0x8b;
+  // deflate method, window at most 32 KB, header check
+  bool zlib = (magic_[0] & 0x0f) == 8 && (magic_[0] >> 4) <= 7 &&
+              ((magic_[0] << 8) | magic_[1]) % 31 == 0;
+  if (format_ == kAuto && gzip) {
+    stage_ = kGzipHeader;
+    gzip_ = true;
+  } else if (zlib) {
+    stage_ = kBody;
+    flags_ = TINFL_FLAG_PARSE_ZLIB_HEADER;
+  } else if (format_ == kDeflate) {
+    stage_ = kBody;
+  } else {
+    stage_ = kPassthrough;
+  }
+  return Feed(magic_, magic_len_, output);
+}
+
+bool InflateStream::ParseGzipHeader(const uint8_t*& data, size_t& len) {
+  while (field_ != kFieldEnd) {
+    if (!HasField(gzip_flags_, field_) ||
+        (field_ == kFieldExtra && field_left_ == 0)) {
+      ++field_;
+      field_pos_ = 0;
+      continue;
+    }
+    if (len == 0) {
+      return true;
+    }
+    uint8_t byte = *data++;
+    --len;
+    bool done = false;
+    switch (field_) {
+      case kFieldFixed:
+        header_[field_pos_++] = byte;
+        if (field_pos_ == GZIP_HEADER_SIZE) {
+          if (header_[0] != 0x1f || header_[1] != 0x8b ||
+              header_[2] != GZIP_METHOD_DEFLATE) {
+            ESP_LOGE(TAG, "not a gzip stream");
+            return false;
+          }
+          gzip_flags_ = header_[3];
+          done = true;
+        }
+        break;
+      case kFieldExtraLen:
+        field_left_ |= (size_t)byte << (8 * field_pos_++);
+        done = field_pos_ == 2;
+        break;
+      case kFieldExtra:
+        done = --field_left_ == 0;
+        break;
+      case kFieldName:
+      case kFieldComment:
+        done = byte == 0;
+        break;
+      case kFieldHeaderCrc:
+        done = ++field_pos_ == 2;
+        break;
+    }
+    if (done) {
+      ++field_;
+      field_pos_ = 0;
+    }
+  }
+  stage_ = kBody;
+  return true;
+}
+
+bool InflateStream::Inflate(const uint8_t*& data, size_t& len,
+                            const Output& output) {
+  auto decompressor = (tinfl_decompressor*)decompressor_;
+  for (;;) {
+    auto start_us = esp_timer_get_time();
+    size_t in_size = len;
+    size_t out_size = TINFL_LZ_DICT_SIZE - window_pos_;
+    uint8_t* out = window_ + window_pos_;
+    // the window wraps, tinfl keeps the last 32 KB there as dictionary
+    auto status =
+        tinfl_decompress(decompressor, data, &in_size, window_, out,
+                         &out_size, flags_ | TINFL_FLAG_HAS_MORE_INPUT);
+    data += in_size;
+    len -= in_size;
+    if (gzip_ && out_size > 0) {
+      crc_ = esp_rom_crc32_le(crc_, out, out_size);
+    }
+    stats_.busy_us += esp_timer_get_time() - start_us;
+    if (out_size > 0) {
+      stream_out_ += out_size;
+      stats_.out_bytes += out_size;
+      if (!output(out, out_size)) {
+        return false;
+      }
+      window_pos_ = (window_pos_ + out_size) & (TINFL_LZ_DICT_SIZE - 1);
+    }
+    if (status == TINFL_STATUS_DONE) {
+      stage_ = gzip_ ? kGzipTrailer : kFinished;
+      field_pos_ = 0;
+      return true;
+    }
+    if (status < 0) {
+      ESP_LOGE(TAG, "inflate failed:%d", (int)status);
+      return false;
+    }
+    if (status == TINFL_STATUS_NEEDS_MORE_INPUT) {
+      return true;
+    }
+    // window full, hand it out and go on
+  }
+}
+
+bool InflateStream::ParseGzipTrailer(const uint8_t*& data, size_t& len) {
+  while (len > 0 && field_pos_ < GZIP_TRAILER_SIZE) {
+    header_[field_pos_++] = *data++;
+    --len;
+  }
+  if (field_pos_ < GZIP_TRAILER_SIZE) {
+    return true;
+  }
+  // crc-32 and size modulo 2^32 of the inflated data
+  if (ReadLE32(header_) != crc_ ||
+      ReadLE32(header_ + 4) != (uint32_t)stream_out_) {
+    ESP_LOGE(TAG, "gzip checksum mismatch");
+    return false;
+  }
+  stage_ = kFinished;
+  return true;
+}
+
+}  // namespace esp
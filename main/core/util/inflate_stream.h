@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace esp {
+
+// streaming gzip/zlib/deflate decoder on the rom tinfl, memory is the
+// 32 KB window plus about 11 KB decoder state whatever the body size.
+// compressed bytes go in as they arrive, inflated bytes come out of the
+// window in pieces of at most 32 KB:
+//   InflateStream inflater(InflateStream::kGzip);
+//   inflater.Write(data, len, output);  // per received chunk
+//   inflater.Finish(output);            // checksum and size verified
+class InflateStream {
+ public:
+  enum Format {
+    kGzip = 0,
+    kZlib,
+    kRaw,
+    // Content-Encoding deflate, zlib or raw deflate as servers differ
+    kDeflate,
+    // gzip or zlib by the leading bytes, anything else is passed through
+    kAuto,
+  };
+
+  // return false to abort
+  using Output = std::function<bool(const uint8_t* data, size_t len)>;
+
+  struct Stats {
+    size_t in_bytes{0};
+    size_t out_bytes{0};
+    // decoding only, output calls are not counted
+    uint32_t busy_us{0};
+  };
+
+  // format of a Content-Encoding value, false for identity or unknown
+  static bool FormatOf(const char* content_encoding, Format& format);
+
+  explicit InflateStream(Format format);
+
+  ~InflateStream();
+
+  InflateStream(const InflateStream&) = delete;
+
+  InflateStream& operator=(const InflateStream&) = delete;
+
+  // false if the window could not be allocated
+  bool Valid() const { return window_ != nullptr; }
+
+  // start over with a new stream, stats are kept
+  void Reset();
+
+  // false on corrupt data or when output returns false, the stream is
+  // unusable until Reset
+  bool Write(const uint8_t* data, size_t len, const Output& output);
+
+  // end of input, true if the stream was complete and its checksum matched
+  bool Finish(const Output& output);
+
+  Stats GetStats() const { return stats_; }
+
+ private:
+  enum Stage {
+    kDetect = 0,
+    kGzipHeader,
+    kBody,
+    kGzipTrailer,
+    kFinished,
+    kPassthrough,
+    kFailed,
+  };
+
+  // first bytes are known, pick the stage and feed them
+  bool Detect(const Output& output);
+
+  bool ParseGzipHeader(const uint8_t*& data, size_t& len);
+
+  bool Inflate(const uint8_t*& data, size_t& len, const Output& output);
+
+  bool ParseGzipTrailer(const uint8_t*& data, size_t& len);
+
+  bool Feed(const uint8_t* data, size_t len, const Output& output);
+
+  Format format_;
+  Stage stage_{kDetect};
+  // tinfl_decompressor
+  void* decompressor_{nullptr};
+  uint8_t* window_{nullptr};
+  size_t window_pos_{0};
+  uint32_t flags_{0};
+  // leading bytes for kAuto and kDeflate
+  uint8_t magic_[2];
+  size_t magic_len_{0};
+  // gzip header field being parsed and bytes of it seen
+  int field_{0};
+  size_t field_pos_{0};
+  size_t field_left_{0};
+  uint8_t gzip_flags_{0};
+  bool gzip_{false};
+  // fixed gzip header, then the trailer
+  uint8_t header_[10];
+  uint32_t crc_{0};
+  size_t stream_out_{0};
+  Stats stats_;
+};
+
+}  // namespace esp
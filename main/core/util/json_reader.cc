@@ -0,0 +1,527 @@
+
+#include "json_reader.h"
+
+#include <cmath>
+#include <cstring>
+
+// mantissa digits past this are dropped, keeps the value in 64 bits
+#define MAX_MANTISSA ((UINT64_MAX - 9) / 10)
+// powers of ten up to here are exact doubles
+#define MAX_EXACT_POW10 22
+#define MAX_EXPONENT 1000
+
+namespace esp {
+
+static bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+// json number grammar: -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+static bool IsNumber(std::string_view text) {
+  size_t i = 0;
+  auto digits = [&]() {
+    size_t start = i;
+    while (i < text.size() && IsDigit(text[i])) {
+      ++i;
+    }
+    return i > start;
+  };
+  if (i < text.size() && text[i] == '-') {
+    ++i;
+  }
+  if (i < text.size() && text[i] == '0') {
+    ++i;
+  } else if (!digits()) {
+    return false;
+  }
+  if (i < text.size() && text[i] == '.') {
+    ++i;
+    if (!digits()) {
+      return false;
+    }
+  }
+  if (i < text.size() && (text[i] == 'e' || text[i] == 'E')) {
+    ++i;
+    if (i < text.size() && (text[i] == '+' || text[i] == '-')) {
+      ++i;
+    }
+    if (!digits()) {
+      return false;
+    }
+  }
+  return i == text.size();
+}
+
+JsonReader::JsonReader(const char* data, size_t len) : data_(data), len_(len) {}
+
+void JsonReader::SkipSpace() {
+  while (pos_ < len_ && (data_[pos_] == ' ' || data_[pos_] == '\t' ||
+                         data_[pos_] == '\n' || data_[pos_] == '\r')) {
+    ++pos_;
+  }
+}
+
+JsonReader::Token JsonReader::Fail() {
+  error_ = true;
+  return kError;
+}
+
+bool JsonReader::ScanString() {
+  // at the opening quote
+  size_t start = ++pos_;
+  while (pos_ < len_) {
+    char c = data_[pos_];
+    if (c == '"') {
+      value_ = std::string_view(data_ + start, pos_ - start);
+      ++pos_;
+      return true;
+    }
+    if (c == '\\') {
+      ++pos_;
+    } else if ((unsigned char)c < 0x20) {
+      return false;
+    }
+    ++pos_;
+  }
+  return false;
+}
+
+bool JsonReader::SetPath(size_t base_len, std::string_view component) {
+  size_t len = base_len + (base_len > 0 ? 1 : 0) + component.size();
+  if (len > kMaxPath) {
+    return false;
+  }
+  path_len_ = base_len;
+  if (base_len > 0) {
+    path_[path_len_++] = '.';
+  }
+  std::memcpy(path_ + path_len_, component.data(), component.size());
+  path_len_ += component.size();
+  return true;
+}
+
+bool JsonReader::SetIndexPath(size_t base_len, uint32_t index) {
+  char digits[10];
+  size_t len = 0;
+  do {
+    digits[len++] = (char)('0' + index % 10);
+    index /= 10;
+  } while (index > 0);
+  char component[10];
+  for (size_t i = 0; i < len; ++i) {
+    component[i] = digits[len - 1 - i];
+  }
+  return SetPath(base_len, std::string_view(component, len));
+}
+
+JsonReader::Token JsonReader::Next() {
+  if (error_) {
+    return kError;
+  }
+  SkipSpace();
+  if (done_) {
+    return pos_ == len_ ? kEnd : Fail();
+  }
+  if (pos_ >= len_) {
+    return Fail();
+  }
+
+  Level* level = depth_ > 0 ? &levels_[depth_ - 1] : nullptr;
+  char c = data_[pos_];
+  if (level) {
+    // close the current container
+    if (c == (level->is_array ? ']' : '}')) {
+      if (level->after_comma || level->has_key) {
+        return Fail();
+      }
+      ++pos_;
+      path_len_ = level->path_len;
+      --depth_;
+      if (depth_ == 0) {
+        done_ = true;
+      }
+      return level->is_array ? kEndArray : kEndObject;
+    }
+    if (level->count > 0 && !level->has_key && !level->after_comma) {
+      if (c != ',') {
+        return Fail();
+      }
+      ++pos_;
+      level->after_comma = true;
+      SkipSpace();
+      if (pos_ >= len_) {
+        return Fail();
+      }
+      c = data_[pos_];
+    }
+    if (!level->is_array && !level->has_key) {
+      if (c != '"' || !ScanString()) {
+        return Fail();
+      }
+      SkipSpace();
+      if (pos_ >= len_ || data_[pos_] != ':') {
+        return Fail();
+      }
+      ++pos_;
+      if (!SetPath(level->path_len, value_)) {
+        return Fail();
+      }
+      level->has_key = true;
+      level->after_comma = false;
+      return kKey;
+    }
+    if (level->is_array && !SetIndexPath(level->path_len, level->count)) {
+      return Fail();
+    }
+    ++level->count;
+    level->has_key = false;
+    level->after_comma = false;
+  }
+
+  // a value, its path is already set
+  if (c == '{' || c == '[') {
+    if (depth_ == kMaxDepth) {
+      return Fail();
+    }
+    ++pos_;
+    levels_[depth_++] = {c == '[', false, false, 0, path_len_};
+    return c == '[' ? kBeginArray : kBeginObject;
+  }
+  if (!level) {
+    done_ = true;
+  }
+  if (c == '"') {
+    return ScanString() ? kString : Fail();
+  }
+  static const struct {
+    const char* text;
+    Token token;
+  } kLiterals[] = {{"true", kTrue}, {"false", kFalse}, {"null", kNull}};
+  for (const auto& literal : kLiterals) {
+    size_t len = std::strlen(literal.text);
+    if (len_ - pos_ >= len &&
+        std::memcmp(data_ + pos_, literal.text, len) == 0) {
+      pos_ += len;
+      return literal.token;
+    }
+  }
+  size_t start = pos_;
+  while (pos_ < len_ && (std::strchr("+-.eE", data_[pos_]) ||
+                         (data_[pos_] >= '0' && data_[pos_] <= '9'))) {
+    ++pos_;
+  }
+  value_ = std::string_view(data_ + start, pos_ - start);
+  if (!IsNumber(value_)) {
+    return Fail();
+  }
+  return kNumber;
+}
+
+bool JsonReader::SkipContainer() {
+  size_t depth = depth_;
+  if (depth == 0) {
+    return false;
+  }
+  while (depth_ >= depth) {
+    auto token = Next();
+    if (token == kError || token == kEnd) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static int HexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+static bool ReadHex4(std::string_view raw, size_t pos, uint32_t& value) {
+  if (pos + 4 > raw.size()) {
+    return false;
+  }
+  value = 0;
+  for (size_t i = 0; i < 4; ++i) {
+    int digit = HexValue(raw[pos + i]);
+    if (digit < 0) {
+      return false;
+    }
+    value = (value << 4) | digit;
+  }
+  return true;
+}
+
+// decoded length of raw in len, written to out unless it is null
+static bool DecodeEscapes(std::string_view raw, char* out, size_t& len) {
+  len = 0;
+  auto put = [&](char c) {
+    if (out) {
+      out[len] = c;
+    }
+    ++len;
+    return true;
+  };
+  for (size_t i = 0; i < raw.size(); ++i) {
+    char c = raw[i];
+    if (c != '\\') {
+      if (!put(c)) {
+        return false;
+      }
+      continue;
+    }
+    if (++i >= raw.size()) {
+      return false;
+    }
+    switch (raw[i]) {
+      case 'b':
+        c = '\b';
+        break;
+      case 'f':
+        c = '\f';
+        break;
+      case 'n':
+        c = '\n';
+        break;
+      case 'r':
+        c = '\r';
+        break;
+      case 't':
+        c = '\t';
+        break;
+      case 'u': {
+        uint32_t code;
+        if (!ReadHex4(raw, i + 1, code)) {
+          return false;
+        }
+        i += 4;
+        // surrogate pair
+        uint32_t low;
+        if (code >= 0xd800 && code < 0xdc00 && i + 2 < raw.size() &&
+            raw[i + 1] == '\\' && raw[i + 2] == 'u' &&
+            ReadHex4(raw, i + 3, low) && low >= 0xdc00 && low < 0xe000) {
+          code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+          i += 6;
+        }
+        // utf-8
+        bool ok;
+        if (code < 0x80) {
+          ok = put((char)code);
+        } else if (code < 0x800) {
+          ok = put((char)(0xc0 | (code >> 6))) &&
+               put((char)(0x80 | (code & 0x3f)));
+        } else if (code < 0x10000) {
+          ok = put((char)(0xe0 | (code >> 12))) &&
+               put((char)(0x80 | ((code >> 6) & 0x3f))) &&
+               put((char)(0x80 | (code & 0x3f)));
+        } else {
+          ok = put((char)(0xf0 | (code >> 18))) &&
+               put((char)(0x80 | ((code >> 12) & 0x3f))) &&
+               put((char)(0x80 | ((code >> 6) & 0x3f))) &&
+               put((char)(0x80 | (code & 0x3f)));
+        }
+        if (!ok) {
+          return false;
+        }
+        continue;
+      }
+      default:
+        // \" \\ \/
+        c = raw[i];
+        break;
+    }
+    if (!put(c)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool JsonReader::Unescape(std::string_view raw, char* out, size_t capacity) {
+  // measured first, a value that does not fit leaves out untouched
+  size_t len = 0;
+  if (!DecodeEscapes(raw, nullptr, len) || len + 1 > capacity) {
+    return false;
+  }
+  DecodeEscapes(raw, out, len);
+  out[len] = 0;
+  return true;
+}
+
+bool JsonReader::ParseInt(std::string_view number, int64_t& value) {
+  if (number.empty()) {
+    return false;
+  }
+  size_t i = 0;
+  bool negative = number[0] == '-';
+  if (negative) {
+    ++i;
+  }
+  if (i == number.size()) {
+    return false;
+  }
+  uint64_t result = 0;
+  for (; i < number.size(); ++i) {
+    char c = number[i];
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    uint64_t next = result * 10 + (c - '0');
+    if (next / 10 != result || next > (uint64_t)INT64_MAX + negative) {
+      return false;
+    }
+    result = next;
+  }
+  value = negative ? (int64_t)(0 - result) : (int64_t)result;
+  return true;
+}
+
+bool JsonReader::ParseDouble(std::string_view number, double& value) {
+  // no strtod, it allocates in newlib. exact when the digits fit 53 bits
+  // and the exponent is within 22, otherwise within a few ulp
+  static const double kPow10[MAX_EXACT_POW10 + 1] = {
+      1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  if (!IsNumber(number)) {
+    return false;
+  }
+  size_t i = 0;
+  bool negative = number[0] == '-';
+  if (negative) {
+    ++i;
+  }
+  uint64_t mantissa = 0;
+  int32_t exponent = 0;
+  for (; i < number.size() && IsDigit(number[i]); ++i) {
+    if (mantissa <= MAX_MANTISSA) {
+      mantissa = mantissa * 10 + (number[i] - '0');
+    } else {
+      ++exponent;
+    }
+  }
+  if (i < number.size() && number[i] == '.') {
+    for (++i; i < number.size() && IsDigit(number[i]); ++i) {
+      if (mantissa <= MAX_MANTISSA) {
+        mantissa = mantissa * 10 + (number[i] - '0');
+        --exponent;
+      }
+    }
+  }
+  if (i < number.size()) {
+    // e or E
+    ++i;
+    bool negative_exponent = number[i] == '-';
+    if (number[i] == '+' || number[i] == '-') {
+      ++i;
+    }
+    int32_t digits = 0;
+    for (; i < number.size(); ++i) {
+      if (digits < MAX_EXPONENT) {
+        digits = digits * 10 + (number[i] - '0');
+      }
+    }
+    exponent += negative_exponent ? -digits : digits;
+  }
+  double result = (double)mantissa;
+  while (exponent > MAX_EXACT_POW10 && result != 0 && !std::isinf(result)) {
+    result *= kPow10[MAX_EXACT_POW10];
+    exponent -= MAX_EXACT_POW10;
+  }
+  while (exponent < -MAX_EXACT_POW10 && result != 0) {
+    result /= kPow10[MAX_EXACT_POW10];
+    exponent += MAX_EXACT_POW10;
+  }
+  if (exponent > MAX_EXACT_POW10 || exponent < -MAX_EXACT_POW10) {
+    exponent = 0;
+  }
+  result = exponent >= 0 ? result * kPow10[exponent]
+                         : result / kPow10[-exponent];
+  if (std::isinf(result)) {
+    return false;
+  }
+  value = negative ? -result : result;
+  return true;
+}
+
+static bool BindValue(JsonReader& reader, JsonReader::Token token,
+                      const JsonField& field, void* out) {
+  auto target = (uint8_t*)out + field.offset;
+  int64_t int_value;
+  double double_value;
+  switch (field.type) {
+    case JsonFieldType::kBool:
+      if (token != JsonReader::kTrue && token != JsonReader::kFalse) {
+        return false;
+      }
+      *(bool*)target = token == JsonReader::kTrue;
+      return true;
+    case JsonFieldType::kInt32:
+      if (token != JsonReader::kNumber ||
+          !JsonReader::ParseInt(reader.Value(), int_value) ||
+          int_value < INT32_MIN || int_value > INT32_MAX) {
+        return false;
+      }
+      *(int32_t*)target = (int32_t)int_value;
+      return true;
+    case JsonFieldType::kInt64:
+      if (token != JsonReader::kNumber ||
+          !JsonReader::ParseInt(reader.Value(), int_value)) {
+        return false;
+      }
+      *(int64_t*)target = int_value;
+      return true;
+    case JsonFieldType::kFloat:
+    case JsonFieldType::kDouble:
+      if (token != JsonReader::kNumber ||
+          !JsonReader::ParseDouble(reader.Value(), double_value)) {
+        return false;
+      }
+      if (field.type == JsonFieldType::kFloat) {
+        *(float*)target = (float)double_value;
+      } else {
+        *(double*)target = double_value;
+      }
+      return true;
+    case JsonFieldType::kString:
+      return token == JsonReader::kString &&
+             JsonReader::Unescape(reader.Value(), (char*)target, field.size);
+  }
+  return false;
+}
+
+int JsonBindFields(const char* data, size_t len, const JsonField* fields,
+                   size_t field_count, void* out) {
+  JsonReader reader(data, len);
+  int bound = 0;
+  for (;;) {
+    auto token = reader.Next();
+    switch (token) {
+      case JsonReader::kEnd:
+        return bound;
+      case JsonReader::kError:
+        return -1;
+      case JsonReader::kKey:
+      case JsonReader::kEndObject:
+      case JsonReader::kEndArray:
+        continue;
+      default:
+        break;
+    }
+    auto path = reader.Path();
+    for (size_t i = 0; i < field_count; ++i) {
+      if (path == fields[i].path) {
+        if (BindValue(reader, token, fields[i], out)) {
+          ++bound;
+        }
+        break;
+      }
+    }
+  }
+}
+
+}  // namespace esp
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace esp {
+
+// pull json tokenizer working in place over a borrowed buffer (mqtt
+// payload, http body), no allocation. keys and strings are returned raw,
+// without escape decoding, see Unescape.
+// Path() is the dotted path of the current token, array items use their
+// index: {"servers":[{"host":"a"}]} gives "servers.0.host"
+class JsonReader {
+ public:
+  static constexpr size_t kMaxDepth = 16;
+  static constexpr size_t kMaxPath = 128;
+
+  enum Token {
+    kBeginObject,
+    kEndObject,
+    kBeginArray,
+    kEndArray,
+    kKey,
+    kString,
+    kNumber,
+    kTrue,
+    kFalse,
+    kNull,
+    kEnd,
+    kError,
+  };
+
+  JsonReader(const char* data, size_t len);
+
+  Token Next();
+
+  // raw text of the last kKey/kString (between quotes) or kNumber
+  std::string_view Value() const { return value_; }
+
+  std::string_view Path() const { return std::string_view(path_, path_len_); }
+
+  size_t Depth() const { return depth_; }
+
+  // skip the rest of the object/array whose begin token was just returned
+  bool SkipContainer();
+
+  // decode escapes into out, nul terminated. false if out is too small or
+  // the escapes are malformed, out is left untouched then
+  static bool Unescape(std::string_view raw, char* out, size_t capacity);
+
+  static bool ParseInt(std::string_view number, int64_t& value);
+
+  static bool ParseDouble(std::string_view number, double& value);
+
+ private:
+  struct Level {
+    bool is_array;
+    bool has_key;
+    bool after_comma;
+    uint32_t count;
+    size_t path_len;
+  };
+
+  void SkipSpace();
+
+  Token Fail();
+
+  bool ScanString();
+
+  bool SetPath(size_t base_len, std::string_view component);
+
+  bool SetIndexPath(size_t base_len, uint32_t index);
+
+  const char* data_;
+  size_t len_;
+  size_t pos_{0};
+  bool done_{false};
+  bool error_{false};
+  std::string_view value_;
+  Level levels_[kMaxDepth];
+  size_t depth_{0};
+  char path_[kMaxPath];
+  size_t path_len_{0};
+};
+
+// compile time schema binding json paths to plain struct members:
+//   struct Config { char ssid[33]; int32_t port; bool tls; };
+//   static constexpr JsonField kConfigFields[] = {
+//       JSON_FIELD(Config, ssid, "wifi.ssid"),
+//       JSON_FIELD(Config, port, "server.port"),
+//       JSON_FIELD(Config, tls, "server.tls"),
+//   };
+//   JsonBind(data, len, kConfigFields, config);
+enum class JsonFieldType {
+  kBool,
+  kInt32,
+  kInt64,
+  kFloat,
+  kDouble,
+  kString,
+};
+
+struct JsonField {
+  const char* path;
+  JsonFieldType type;
+  size_t offset;
+  // capacity of char array members
+  size_t size;
+};
+
+template <typename T>
+struct JsonFieldTypeOf;
+
+template <>
+struct JsonFieldTypeOf<bool> {
+  static constexpr JsonFieldType value = JsonFieldType::kBool;
+};
+
+template <>
+struct JsonFieldTypeOf<int32_t> {
+  static constexpr JsonFieldType value = JsonFieldType::kInt32;
+};
+
+template <>
+struct JsonFieldTypeOf<int64_t> {
+  static constexpr JsonFieldType value = JsonFieldType::kInt64;
+};
+
+template <>
+struct JsonFieldTypeOf<float> {
+  static constexpr JsonFieldType value = JsonFieldType::kFloat;
+};
+
+template <>
+struct JsonFieldTypeOf<double> {
+  static constexpr JsonFieldType value = JsonFieldType::kDouble;
+};
+
+template <size_t N>
+struct JsonFieldTypeOf<char[N]> {
+  static constexpr JsonFieldType value = JsonFieldType::kString;
+};
+
+#define JSON_FIELD(type, member, path)                                  \
+  esp::JsonField {                                                      \
+    path, esp::JsonFieldTypeOf<decltype(type::member)>::value,          \
+        offsetof(type, member), sizeof(type::member)                    \
+  }
+
+// returns the number of fields bound, -1 if the document is malformed
+int JsonBindFields(const char* data, size_t len, const JsonField* fields,
+                   size_t field_count, void* out);
+
+template <typename T, size_t N>
+int JsonBind(const char* data, size_t len, const JsonField (&fields)[N],
+             T& out) {
+  return JsonBindFields(data, len, fields, N, &out);
+}
+
+}  // namespace esp
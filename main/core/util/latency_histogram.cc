@@ -0,0 +1,44 @@
+
+#include "latency_histogram.h"
+
+namespace esp {
+
+void LatencyHistogram::Record(uint32_t ms) {
+  uint32_t bucket = 0;
+  while (bucket + 1 < kBucketCount && ms >= BucketUpperMS(bucket)) {
+    ++bucket;
+  }
+  ++buckets[bucket];
+  ++count;
+  sum_ms += ms;
+  if (ms > max_ms) {
+    max_ms = ms;
+  }
+}
+
+void LatencyHistogram::Reset() { *this = LatencyHistogram(); }
+
+uint32_t LatencyHistogram::PercentileMS(uint32_t percentile) const {
+  if (count == 0) {
+    return 0;
+  }
+  uint64_t target = ((uint64_t)count * percentile + 99) / 100;
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < kBucketCount; ++i) {
+    seen += buckets[i];
+    if (seen >= target && seen > 0) {
+      return i + 1 == kBucketCount ? max_ms : BucketUpperMS(i);
+    }
+  }
+  return max_ms;
+}
+
+uint32_t LatencyHistogram::AverageMS() const {
+  return count > 0 ? (uint32_t)(sum_ms / count) : 0;
+}
+
+uint32_t LatencyHistogram::BucketUpperMS(uint32_t bucket) {
+  return 1u << bucket;
+}
+
+}  // namespace esp
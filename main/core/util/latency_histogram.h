@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+
+namespace esp {
+
+// log2 buckets in ms: bucket 0 counts < 1 ms, bucket i counts
+// [2^(i-1), 2^i) ms, the last bucket also counts everything above.
+// not thread safe, the owner serializes access
+class LatencyHistogram {
+ public:
+  static constexpr uint32_t kBucketCount = 14;
+
+  void Record(uint32_t ms);
+
+  void Reset();
+
+  // upper bound of the bucket holding the given percentile (0-100)
+  uint32_t PercentileMS(uint32_t percentile) const;
+
+  uint32_t AverageMS() const;
+
+  static uint32_t BucketUpperMS(uint32_t bucket);
+
+  uint32_t count{0};
+  uint32_t max_ms{0};
+  uint64_t sum_ms{0};
+  uint32_t buckets[kBucketCount]{};
+};
+
+}  // namespace esp
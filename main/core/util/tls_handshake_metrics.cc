@@ -0,0 +1,31 @@
+
+#include "tls_handshake_metrics.h"
+
+namespace esp {
+
+TlsHandshakeMetrics* TlsHandshakeMetrics::Instance() {
+  static TlsHandshakeMetrics INSTANCE;
+  return &INSTANCE;
+}
+
+void TlsHandshakeMetrics::RecordHandshake(uint32_t ms) {
+  mutex_.Lock();
+  ++stats_.handshakes;
+  stats_.latency.Record(ms);
+  mutex_.Unlock();
+}
+
+void TlsHandshakeMetrics::Reset() {
+  mutex_.Lock();
+  stats_ = Stats();
+  mutex_.Unlock();
+}
+
+TlsHandshakeMetrics::Stats TlsHandshakeMetrics::GetStats() {
+  mutex_.Lock();
+  auto stats = stats_;
+  mutex_.Unlock();
+  return stats;
+}
+
+}  // namespace esp
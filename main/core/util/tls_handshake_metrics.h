@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+
+#include "latency_histogram.h"
+#include "mutex.h"
+
+namespace esp {
+
+// process wide count and latency of tls handshakes, recorded by
+// HttpClient, HttpDownload and MqttClient from connect to ready.
+// esp_http_client and esp-mqtt cannot take a client session, so every
+// connect is a full handshake: the way to avoid them is keeping
+// connections open (HttpConnectionPool, mqtt keep-alive), and these
+// numbers show what each reconnect costs
+class TlsHandshakeMetrics {
+ public:
+  struct Stats {
+    uint32_t handshakes{0};
+    LatencyHistogram latency;
+  };
+
+  static TlsHandshakeMetrics* Instance();
+
+  void RecordHandshake(uint32_t ms);
+
+  void Reset();
+
+  Stats GetStats();
+
+ private:
+  Mutex mutex_;
+  Stats stats_;
+};
+
+}  // namespace esp
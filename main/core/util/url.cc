@@ -0,0 +1,112 @@
+
+#include "url.h"
+
+namespace esp {
+
+static bool EqualsIgnoreCase(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); ++i) {
+    char x = a[i] >= 'A' && a[i] <= 'Z' ? a[i] - 'A' + 'a' : a[i];
+    char y = b[i] >= 'A' && b[i] <= 'Z' ? b[i] - 'A' + 'a' : b[i];
+    if (x != y) {
+      return false;
+    }
+  }
+  return true;
+}
+
+uint16_t DefaultPort(std::string_view scheme) {
+  if (EqualsIgnoreCase(scheme, "mqtts")) {
+    return 8883;
+  }
+  if (EqualsIgnoreCase(scheme, "mqtt")) {
+    return 1883;
+  }
+  if (EqualsIgnoreCase(scheme, "https") || EqualsIgnoreCase(scheme, "wss")) {
+    return 443;
+  }
+  return 80;
+}
+
+std::string HostHeader(const Url& url) {
+  std::string host;
+  bool ipv6 = url.host.find(':') != std::string_view::npos;
+  if (ipv6) {
+    host.push_back('[');
+  }
+  host.append(url.host);
+  if (ipv6) {
+    host.push_back(']');
+  }
+  if (url.port != DefaultPort(url.scheme)) {
+    host.push_back(':');
+    host.append(std::to_string(url.port));
+  }
+  return host;
+}
+
+bool ParseUrl(std::string_view text, Url& url) {
+  url = Url();
+  auto scheme_end = text.find("://");
+  if (scheme_end == std::string_view::npos || scheme_end == 0) {
+    return false;
+  }
+  url.scheme = text.substr(0, scheme_end);
+  auto rest = text.substr(scheme_end + 3);
+  auto path_start = rest.find_first_of("/?#");
+  auto authority = rest.substr(0, path_start);
+  url.path = path_start == std::string_view::npos ? std::string_view("/")
+                                                  : rest.substr(path_start);
+  auto at = authority.rfind('@');
+  if (at != std::string_view::npos) {
+    authority = authority.substr(at + 1);
+  }
+  std::string_view port;
+  if (!authority.empty() && authority[0] == '[') {
+    auto close = authority.find(']');
+    if (close == std::string_view::npos) {
+      return false;
+    }
+    url.host = authority.substr(1, close - 1);
+    auto after = authority.substr(close + 1);
+    if (!after.empty()) {
+      if (after[0] != ':') {
+        return false;
+      }
+      port = after.substr(1);
+    }
+  } else {
+    auto colon = authority.rfind(':');
+    url.host = authority.substr(0, colon);
+    if (colon != std::string_view::npos) {
+      port = authority.substr(colon + 1);
+    }
+  }
+  if (url.host.empty()) {
+    return false;
+  }
+
+  url.secure = EqualsIgnoreCase(url.scheme, "https") ||
+               EqualsIgnoreCase(url.scheme, "mqtts") ||
+               EqualsIgnoreCase(url.scheme, "wss");
+  if (port.empty()) {
+    url.port = DefaultPort(url.scheme);
+    return true;
+  }
+  uint32_t value = 0;
+  for (char c : port) {
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    value = value * 10 + (c - '0');
+    if (value > 0xffff) {
+      return false;
+    }
+  }
+  url.port = (uint16_t)value;
+  return true;
+}
+
+}  // namespace esp
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace esp {
+
+// views into the parsed url string
+struct Url {
+  std::string_view scheme;
+  std::string_view host;
+  // explicit port, or the scheme default
+  uint16_t port{0};
+  // path with query, "/" when the url has none
+  std::string_view path;
+  bool secure{false};
+};
+
+// scheme://[user@]host[:port][/path], ipv6 literals in brackets
+bool ParseUrl(std::string_view text, Url& url);
+
+// 80/443/1883/8883 by scheme
+uint16_t DefaultPort(std::string_view scheme);
+
+// host[:port] as sent in the Host header, the port only when it is not
+// the scheme default
+std::string HostHeader(const Url& url);
+
+}  // namespace esp
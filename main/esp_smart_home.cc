@@ -6,7 +6,10 @@
 #include "core/led/led_indicator_wrapper.h"
 #include "core/manager/sntp_manager.h"
 #include "core/manager/wifi_manager.h"
+#include "core/mqtt/mqtt_batch_publisher.h"
 #include "core/mqtt/mqtt_client_wrapper.h"
+#include "core/mqtt/mqtt_event_bridge.h"
+#include "core/mqtt/mqtt_offline_queue.h"
 #include "core/util/board_info.h"
 #include "core/util/delay.h"
 #include "esp_log.h"
@@ -44,6 +47,17 @@ class TestEventHandler : public EventHandler {
   }
 };
 
+class MqttCommandHandler : public EventHandler {
+ public:
+  void Process(Event* event) override {
+    auto msg = (MqttMessageEvent*)event;
+    auto topic = msg->Topic();
+    auto payload = msg->Payload();
+    ESP_LOGI(TAG, "receive msg: %.*s from topic:%.*s", (int)payload.size(),
+             payload.data(), (int)topic.size(), topic.data());
+  }
+};
+
 extern "C" void app_main(void) {
   PrintBoardInfoToLog();
   if (!BaseInit()) {
@@ -65,19 +79,25 @@ extern "C" void app_main(void) {
   }
 
   PrintHeapMemInfoToLog();
+  static MqttOfflineQueue offline_queue(MqttOfflineQueue::Config{});
   auto mqtt_client = std::make_shared<MqttClient>("mqtt://192.168.0.105:1883",
                                                   "123", true, true);
-  mqtt_client->SetOnReadyCallback([client = mqtt_client.get()]() {
-    ESP_LOGI(TAG, "connect mqtt broker");
-    client->Subscribe("topic/#", 0);
-  });
-  mqtt_client->SetOnReceiveMsgCallback([](std::string topic, const char* data,
-                                          int32_t len) {
-    std::string msg(data, len);
-    ESP_LOGI(TAG, "receive msg: %s from topic:%s", msg.c_str(), topic.c_str());
-  });
+  if (offline_queue.Init()) {
+    mqtt_client->SetOfflineQueue(&offline_queue);
+  }
+  mqtt_client->SetOnReadyCallback(
+      []() { ESP_LOGI(TAG, "connect mqtt broker"); });
+  MqttEventBridge bridge(mqtt_client.get());
+  bridge.MapInbound("topic/#", "mqtt_command", 0, 0);
+  bridge.Start();
+  GlobalEventBus::Instance()->Subscribe(
+      "mqtt_command", std::make_shared<MqttCommandHandler>());
   PrintHeapMemInfoToLog();
   mqtt_client->Start();
+  MqttBatchPublisher::Config publisher_config{};
+  publisher_config.flush_interval_ms = 5000;
+  MqttBatchPublisher publisher(mqtt_client.get(), publisher_config);
+  publisher.Start();
   auto event_handler = std::make_shared<TestEventHandler>();
   GlobalEventBus::Instance()->Subscribe("test_event1", event_handler);
   GlobalEventBus::Instance()->Subscribe("test_event3", event_handler);
@@ -89,6 +109,6 @@ extern "C" void app_main(void) {
     GlobalEventBus::Instance()->Publish(new TestEvent3());
     GlobalEventBus::Instance()->Publish(new TestEvent2());
     GlobalEventBus::Instance()->Publish(new TestEvent1());
-    mqtt_client->AsyncPublish("topic/test", "hello123", 8, 0, 0);
+    publisher.Publish("topic/test", "hello123", 8);
   }
 }